@@ -0,0 +1,96 @@
+//
+//  Chat broadcast benchmark
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/streambuf.hpp>
+#include "cereal/archives/binary.hpp"
+#include "Frame.hpp"
+#include "Message.hpp"
+
+namespace
+{
+    // stands in for the socket write, which copies the bytes to the kernel on both paths
+    template <class ConstBufferSequence>
+    void write(std::vector<uint8_t>& socket, const ConstBufferSequence& buffers)
+    {
+        socket.resize(boost::asio::buffer_size(buffers));
+        boost::asio::buffer_copy(boost::asio::buffer(socket), buffers);
+    }
+
+    // the old path: every recipient serializes the message into its own output buffer
+    void broadcastPerClient(const chat::Message& message,
+                            std::vector<boost::asio::streambuf>& outputBuffers,
+                            std::vector<std::vector<uint8_t>>& sockets)
+    {
+        for (size_t i = 0; i < outputBuffers.size(); ++i)
+        {
+            boost::asio::streambuf& outputBuffer = outputBuffers[i];
+            std::ostream outputStream(&outputBuffer);
+            cereal::BinaryOutputArchive archive(outputStream);
+            archive(message);
+
+            write(sockets[i], outputBuffer.data());
+            outputBuffer.consume(outputBuffer.size());
+        }
+    }
+
+    // the new path: the message is encoded once and every recipient holds a reference to the frame
+    void broadcastShared(const chat::Message& message,
+                         std::vector<std::vector<chat::FramePtr>>& sendQueues,
+                         std::vector<std::vector<uint8_t>>& sockets)
+    {
+        chat::FramePtr frame = std::make_shared<const chat::Frame>(message);
+
+        for (size_t i = 0; i < sendQueues.size(); ++i)
+        {
+            std::vector<chat::FramePtr>& sendQueue = sendQueues[i];
+            sendQueue.push_back(frame);
+
+            write(sockets[i], sendQueue.front()->buffer());
+            sendQueue.clear();
+        }
+    }
+
+    template <class F>
+    double measure(size_t iterations, F f)
+    {
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < iterations; ++i) f();
+        auto end = std::chrono::steady_clock::now();
+
+        return std::chrono::duration<double, std::nano>(end - start).count() / iterations;
+    }
+}
+
+int main()
+{
+    chat::Message message;
+    message.type = chat::Message::Type::TEXT;
+    message.nickname = "benchmark";
+    message.body = std::string(128, 'x');
+
+    std::cout << "clients\tper-client ns\tshared ns\tspeedup" << std::endl;
+
+    for (size_t clientCount : {1, 10, 100, 1000, 5000, 10000})
+    {
+        size_t iterations = std::max(static_cast<size_t>(10), static_cast<size_t>(1000000) / clientCount);
+
+        std::vector<boost::asio::streambuf> outputBuffers(clientCount);
+        std::vector<std::vector<chat::FramePtr>> sendQueues(clientCount);
+        std::vector<std::vector<uint8_t>> sockets(clientCount);
+
+        double perClient = measure(iterations, [&]() { broadcastPerClient(message, outputBuffers, sockets); });
+        double shared = measure(iterations, [&]() { broadcastShared(message, sendQueues, sockets); });
+
+        std::cout << clientCount << "\t" << perClient << "\t" << shared << "\t" << perClient / shared << std::endl;
+    }
+
+    return EXIT_SUCCESS;
+}
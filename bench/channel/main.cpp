@@ -0,0 +1,82 @@
+//
+//  Chat channel benchmark
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include "Channel.hpp"
+
+namespace
+{
+    struct Member
+    {
+        size_t index = 0;
+        std::string channel;
+        uint64_t delivered = 0;
+    };
+
+    template <class F>
+    double measure(size_t iterations, F f)
+    {
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < iterations; ++i) f();
+        auto end = std::chrono::steady_clock::now();
+
+        return std::chrono::duration<double, std::nano>(end - start).count() / iterations;
+    }
+}
+
+int main()
+{
+    const size_t connectionCount = 100000;
+    std::vector<Member> connections(connectionCount);
+
+    std::cout << "members\tscan ns/post\tindex ns/post\tjoin+part ns" << std::endl;
+
+    for (size_t memberCount : {1, 100, 10000, 100000})
+    {
+        chat::Channel<Member> channel("benchmark");
+
+        for (Member& connection : connections) connection.channel.clear();
+        for (size_t i = 0; i < memberCount; ++i)
+        {
+            connections[i].channel = channel.getName();
+            connections[i].index = channel.add(&connections[i]);
+        }
+
+        size_t iterations = std::max(static_cast<size_t>(10), static_cast<size_t>(10000000) / connectionCount);
+
+        // every connection is checked for membership
+        double scan = measure(iterations, [&]() {
+            for (Member& connection : connections)
+                if (connection.channel == channel.getName()) ++connection.delivered;
+        });
+
+        iterations = std::max(static_cast<size_t>(10), static_cast<size_t>(10000000) / memberCount);
+
+        // only the members are visited
+        double index = measure(iterations, [&]() {
+            for (Member* member : channel.getMembers())
+                ++member->delivered;
+        });
+
+        // a random member leaves and joins again
+        std::mt19937 random(1);
+        std::uniform_int_distribution<size_t> distribution(0, memberCount - 1);
+
+        double joinPart = measure(100000, [&]() {
+            Member& member = connections[distribution(random)];
+            if (Member* moved = channel.remove(member.index)) moved->index = member.index;
+            member.index = channel.add(&member);
+        });
+
+        std::cout << memberCount << "\t" << scan << "\t" << index << "\t" << joinPart << std::endl;
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,814 @@
+//
+//  Chat load generator
+//
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/resource.h>
+#include <boost/asio.hpp>
+#include "args.hxx"
+#include "Frame.hpp"
+#include "FrameDecoder.hpp"
+#include "Histogram.hpp"
+#include "Message.hpp"
+
+namespace
+{
+    typedef std::chrono::steady_clock Clock;
+
+    static const size_t TICK = 10; // milliseconds between the rate controlled steps
+    static const size_t KEEP_ALIVE_INTERVAL = 5; // seconds, below the server's inactivity timeout
+    static const size_t STAMP_SIZE = 24; // run id and send time at the start of every message body
+
+    struct Options
+    {
+        std::vector<boost::asio::ip::tcp::endpoint> endpoints; // the clients are spread over the servers
+        size_t clients = 1000;
+        size_t threads = 1;
+        double loginRate = 1000.0; // logins per second
+        size_t senders = 10;
+        double sendRate = 1000.0; // messages per second from all the senders
+        size_t messageSize = 128; // bytes of message body
+        size_t slowReaders = 0;
+        size_t readDelay = 0; // milliseconds slow readers wait between reads
+        size_t duration = 10; // seconds
+        size_t drain = 2; // seconds to wait for the messages in flight
+        std::string features; // requested with a hello before the login, none if empty
+        size_t stormClients = 0; // clients that keep logging in and out while the others send
+        uint32_t runId = 0;
+    };
+
+    struct Stats
+    {
+        chat::Histogram latency; // microseconds from send to receive
+        chat::Histogram connectTime; // microseconds from connect to the login reply
+        uint64_t sent = 0;
+        uint64_t received = 0;
+        uint64_t failed = 0;
+        uint64_t disconnected = 0;
+        uint64_t stormLogins = 0;
+        uint64_t stormRejected = 0; // logins and connections turned away by the server
+    };
+
+    // progress of all the workers, polled by the main thread
+    struct Progress
+    {
+        std::atomic<size_t> loggedIn{0};
+        std::atomic<size_t> failed{0};
+    };
+
+    class Worker;
+
+    // Simulated client that logs in, optionally sends stamped messages and reads everything it gets
+    class BenchClient final
+    {
+    public:
+        BenchClient(Worker& w, size_t i, bool slow);
+
+        inline bool isLoggedIn() const { return loggedIn; }
+
+        void connect();
+        void send(const chat::FramePtr& frame);
+        void close();
+
+    private:
+        void fail();
+        void login();
+        void write();
+        void receive();
+        void handleMessage(const chat::MessageView& message);
+
+        Worker& worker;
+        size_t index;
+        bool slowReader;
+        boost::asio::ip::tcp::socket socket;
+        boost::asio::deadline_timer readTimer;
+        chat::FrameDecoder decoder{UINT16_MAX};
+        std::deque<chat::FramePtr> outputQueue;
+        uint8_t outputHeader[chat::Frame::MAX_VARINT_HEADER_SIZE];
+        bool channelFields = false;
+        bool varint = false;
+        bool writing = false;
+        bool loggedIn = false;
+        bool failed = false;
+        Clock::time_point connectTime;
+    };
+
+    // Client of the reconnect storm: logs in, disconnects and reconnects right away, or as late as a busy server asks
+    class StormClient final
+    {
+    public:
+        StormClient(Worker& w, size_t i);
+
+        void connect();
+        void stop();
+
+    private:
+        void reconnect(uint64_t delay);
+        void receive();
+        void handleMessage(const chat::MessageView& message);
+
+        Worker& worker;
+        boost::asio::ip::tcp::socket socket;
+        boost::asio::deadline_timer retryTimer;
+        chat::FrameDecoder decoder{UINT16_MAX};
+        chat::FramePtr loginFrame;
+        size_t endpointIndex;
+        uint64_t retryAfter = 0;
+        bool stopped = false;
+    };
+
+    // One event loop with its share of the clients
+    class Worker final
+    {
+    public:
+        Worker(const Options& o, Progress& p, size_t index, size_t workerCount):
+            options(o),
+            progress(p),
+            work(new boost::asio::io_service::work(ioService)),
+            tickTimer(ioService),
+            keepAliveTimer(ioService)
+        {
+            for (size_t i = index; i < options.clients; i += workerCount)
+            {
+                clients.push_back(std::unique_ptr<BenchClient>(new BenchClient(*this, i, i >= options.clients - options.slowReaders)));
+                if (i < options.senders) senders.push_back(clients.back().get());
+            }
+
+            for (size_t i = index; i < options.stormClients; i += workerCount)
+                stormClients.push_back(std::unique_ptr<StormClient>(new StormClient(*this, i)));
+
+            loginRate = options.loginRate / workerCount;
+            sendRate = options.sendRate / workerCount;
+
+            // leaving a channel the client is not in is a no-op for the server, but it keeps the connection alive
+            chat::Message keepAlive;
+            keepAlive.type = chat::Message::Type::PART;
+            keepAlive.channel = "bench-keep-alive";
+            keepAliveFrame = std::make_shared<const chat::Frame>(keepAlive);
+        }
+
+        void run()
+        {
+            thread = std::thread([this]() { ioService.run(); });
+        }
+
+        void join()
+        {
+            thread.join();
+        }
+
+        void startLogins()
+        {
+            ioService.post([this]() {
+                loginStart = Clock::now();
+                tick();
+                keepAlive();
+            });
+        }
+
+        void startSending()
+        {
+            ioService.post([this]() {
+                sendStart = Clock::now();
+                sending = true;
+
+                // the storm starts all at once, like clients reconnecting after a load balancer flapped
+                for (auto& client : stormClients) client->connect();
+            });
+        }
+
+        void stopSending()
+        {
+            ioService.post([this]() {
+                sending = false;
+                for (auto& client : stormClients) client->stop();
+            });
+        }
+
+        void stop()
+        {
+            ioService.post([this]() {
+                tickTimer.cancel();
+                keepAliveTimer.cancel();
+                for (auto& client : clients) client->close();
+                for (auto& client : stormClients) client->stop();
+                work.reset();
+            });
+        }
+
+        const Options& options;
+        Progress& progress;
+        boost::asio::io_service ioService{1};
+        Stats stats;
+
+    private:
+        void tick()
+        {
+            auto now = Clock::now();
+
+            // start as many connections as the login rate allows by now
+            double elapsed = std::chrono::duration<double>(now - loginStart).count();
+            while (connecting < clients.size() && connecting < loginRate * elapsed)
+                clients[connecting++]->connect();
+
+            if (sending && !senders.empty())
+            {
+                elapsed = std::chrono::duration<double>(now - sendStart).count();
+                while (sendCount < sendRate * elapsed)
+                {
+                    BenchClient* sender = senders[sendCount++ % senders.size()];
+                    if (sender->isLoggedIn()) sender->send(createFrame());
+                }
+            }
+
+            tickTimer.expires_from_now(boost::posix_time::milliseconds(TICK));
+            tickTimer.async_wait([this](const boost::system::error_code& error)
+            {
+                if (!error) // not boost::asio::error::operation_aborted
+                    tick();
+            });
+        }
+
+        void keepAlive()
+        {
+            keepAliveTimer.expires_from_now(boost::posix_time::seconds(KEEP_ALIVE_INTERVAL));
+            keepAliveTimer.async_wait([this](const boost::system::error_code& error)
+            {
+                if (!error) // not boost::asio::error::operation_aborted
+                {
+                    for (auto& client : clients)
+                        if (client->isLoggedIn()) client->send(keepAliveFrame);
+
+                    keepAlive();
+                }
+            });
+        }
+
+        chat::FramePtr createFrame()
+        {
+            // the body starts with the run id and the send time, so the receivers can measure the latency
+            // and skip the messages of earlier runs replayed from the server's history
+            uint64_t sendTime = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                Clock::now().time_since_epoch()).count());
+
+            char stamp[STAMP_SIZE + 1];
+            std::snprintf(stamp, sizeof(stamp), "%08x%016llx", options.runId, static_cast<unsigned long long>(sendTime));
+
+            chat::Message message;
+            message.type = chat::Message::Type::TEXT;
+            message.body = stamp;
+            message.body.resize(std::max(options.messageSize, STAMP_SIZE), 'x');
+
+            ++stats.sent;
+            return std::make_shared<const chat::Frame>(message);
+        }
+
+        std::unique_ptr<boost::asio::io_service::work> work;
+        std::thread thread;
+        std::vector<std::unique_ptr<BenchClient>> clients;
+        std::vector<BenchClient*> senders;
+        std::vector<std::unique_ptr<StormClient>> stormClients;
+        boost::asio::deadline_timer tickTimer;
+        boost::asio::deadline_timer keepAliveTimer;
+        chat::FramePtr keepAliveFrame;
+
+        double loginRate;
+        double sendRate;
+        Clock::time_point loginStart;
+        Clock::time_point sendStart;
+        size_t connecting = 0;
+        uint64_t sendCount = 0;
+        bool sending = false;
+    };
+
+    BenchClient::BenchClient(Worker& w, size_t i, bool slow):
+        worker(w),
+        index(i),
+        slowReader(slow),
+        socket(w.ioService),
+        readTimer(w.ioService)
+    {
+        // the original layout until the channels feature is negotiated
+        decoder.setLayout(chat::MessageCodec::Layout::BASIC);
+    }
+
+    void BenchClient::connect()
+    {
+        connectTime = Clock::now();
+
+        const std::vector<boost::asio::ip::tcp::endpoint>& endpoints = worker.options.endpoints;
+
+        socket.async_connect(endpoints[index % endpoints.size()], [this](const boost::system::error_code& error)
+        {
+            if (error)
+            {
+                fail();
+                return;
+            }
+
+            socket.set_option(boost::asio::ip::tcp::no_delay(true));
+
+            // the login follows the hello reply
+            if (!worker.options.features.empty())
+            {
+                chat::Message message;
+                message.type = chat::Message::Type::HELLO;
+                message.body = "channels " + worker.options.features;
+                send(std::make_shared<const chat::Frame>(message));
+            }
+            else
+                login();
+
+            receive();
+        });
+    }
+
+    void BenchClient::login()
+    {
+        char nickname[32];
+        std::snprintf(nickname, sizeof(nickname), "bench%08x-%zu", worker.options.runId, index);
+
+        chat::Message message;
+        message.type = chat::Message::Type::LOGIN;
+        message.nickname = nickname;
+        send(std::make_shared<const chat::Frame>(message));
+    }
+
+    void BenchClient::send(const chat::FramePtr& frame)
+    {
+        chat::FramePtr outputFrame = channelFields ? frame : frame->getBasicFrame();
+        if (!outputFrame) return; // a server without the channels feature does not know the message
+
+        outputQueue.push_back(outputFrame);
+        if (!writing) write();
+    }
+
+    void BenchClient::close()
+    {
+        readTimer.cancel();
+        socket.close();
+    }
+
+    void BenchClient::fail()
+    {
+        if (failed) return;
+        failed = true;
+
+        if (loggedIn)
+            ++worker.stats.disconnected;
+        else
+        {
+            ++worker.stats.failed;
+            ++worker.progress.failed;
+        }
+
+        close();
+    }
+
+    void BenchClient::write()
+    {
+        writing = true;
+
+        const chat::Frame& frame = *outputQueue.front();
+        std::vector<boost::asio::const_buffer> buffers;
+
+        if (varint)
+            buffers.push_back(boost::asio::buffer(outputHeader, chat::Frame::encodeVarintHeader(frame.getPayloadSize(), outputHeader)));
+        else
+            buffers.push_back(boost::asio::buffer(frame.getData(), chat::Frame::HEADER_SIZE));
+
+        buffers.push_back(boost::asio::buffer(frame.getPayload(), frame.getPayloadSize()));
+
+        boost::asio::async_write(socket, buffers,
+                                 [this](const boost::system::error_code& error, std::size_t)
+        {
+            if (error)
+            {
+                if (error != boost::asio::error::operation_aborted) fail();
+                return;
+            }
+
+            outputQueue.pop_front();
+            writing = false;
+
+            if (!outputQueue.empty()) write();
+        });
+    }
+
+    void BenchClient::receive()
+    {
+        socket.async_receive(decoder.prepare(),
+                             [this](const boost::system::error_code& error, std::size_t bytesTransferred)
+        {
+            if (error)
+            {
+                if (error != boost::asio::error::operation_aborted) fail();
+                return;
+            }
+
+            decoder.commit(bytesTransferred);
+
+            try
+            {
+                chat::MessageView message;
+                while (decoder.decode(message))
+                    handleMessage(message);
+            }
+            catch (const std::exception&)
+            {
+                fail();
+                return;
+            }
+
+            if (!socket.is_open()) return;
+
+            if (slowReader && worker.options.readDelay)
+            {
+                readTimer.expires_from_now(boost::posix_time::milliseconds(worker.options.readDelay));
+                readTimer.async_wait([this](const boost::system::error_code& error)
+                {
+                    if (!error) // not boost::asio::error::operation_aborted
+                        receive();
+                });
+            }
+            else
+                receive();
+        });
+    }
+
+    void BenchClient::handleMessage(const chat::MessageView& message)
+    {
+        switch (message.type)
+        {
+            case chat::Message::Type::HELLO:
+            {
+                std::string features = message.body.to_string();
+                if (features.find("channels") != std::string::npos)
+                {
+                    channelFields = true;
+                    decoder.setLayout(chat::MessageCodec::Layout::CHANNELS);
+                }
+                if (features.find("varint") != std::string::npos)
+                {
+                    varint = true;
+                    decoder.setVarint(chat::Frame::MAX_PAYLOAD_SIZE);
+                }
+                if (features.find("deflate") != std::string::npos)
+                    decoder.setInflate();
+
+                login();
+                break;
+            }
+            case chat::Message::Type::LOGIN:
+                if (message.body.starts_with("Logged in"))
+                {
+                    loggedIn = true;
+                    worker.stats.connectTime.record(static_cast<uint64_t>(
+                        std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - connectTime).count()));
+                    ++worker.progress.loggedIn;
+                }
+                else
+                    fail();
+                break;
+            case chat::Message::Type::TEXT:
+            {
+                if (message.body.size() < STAMP_SIZE) break;
+
+                char runId[9];
+                std::snprintf(runId, sizeof(runId), "%08x", worker.options.runId);
+                if (message.body.substr(0, 8) != runId) break;
+
+                uint64_t sendTime = std::strtoull(message.body.substr(8, 16).to_string().c_str(), nullptr, 16);
+                uint64_t now = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    Clock::now().time_since_epoch()).count());
+
+                worker.stats.latency.record(now > sendTime ? (now - sendTime) / 1000 : 0);
+                ++worker.stats.received;
+                break;
+            }
+            default:
+                break;
+        }
+    }
+
+    StormClient::StormClient(Worker& w, size_t i):
+        worker(w),
+        socket(w.ioService),
+        retryTimer(w.ioService),
+        endpointIndex(i)
+    {
+        char nickname[40];
+        std::snprintf(nickname, sizeof(nickname), "storm%08x-%zu", worker.options.runId, i);
+
+        chat::Message message;
+        message.type = chat::Message::Type::LOGIN;
+        message.nickname = nickname;
+        loginFrame = std::make_shared<const chat::Frame>(message)->getBasicFrame();
+    }
+
+    void StormClient::connect()
+    {
+        const std::vector<boost::asio::ip::tcp::endpoint>& endpoints = worker.options.endpoints;
+
+        socket.async_connect(endpoints[endpointIndex % endpoints.size()], [this](const boost::system::error_code& error)
+        {
+            if (stopped) return;
+
+            if (error)
+            {
+                reconnect(TICK);
+                return;
+            }
+
+            // no hello, the login goes out with the frame's own 16-bit prefix
+            decoder = chat::FrameDecoder(UINT16_MAX);
+            decoder.setLayout(chat::MessageCodec::Layout::BASIC);
+            retryAfter = 0;
+            boost::asio::async_write(socket, boost::asio::buffer(loginFrame->getData(), loginFrame->getSize()),
+                                     [](const boost::system::error_code&, std::size_t) {});
+            receive();
+        });
+    }
+
+    void StormClient::stop()
+    {
+        stopped = true;
+        retryTimer.cancel();
+        socket.close();
+    }
+
+    void StormClient::reconnect(uint64_t delay)
+    {
+        socket.close();
+
+        if (!delay)
+        {
+            connect();
+            return;
+        }
+
+        retryTimer.expires_from_now(boost::posix_time::milliseconds(static_cast<int64_t>(delay)));
+        retryTimer.async_wait([this](const boost::system::error_code& error)
+        {
+            if (!error && !stopped) connect();
+        });
+    }
+
+    void StormClient::receive()
+    {
+        socket.async_receive(decoder.prepare(),
+                             [this](const boost::system::error_code& error, std::size_t bytesTransferred)
+        {
+            if (stopped || error == boost::asio::error::operation_aborted) return;
+
+            // the server closes the connection after turning it away
+            if (error)
+            {
+                reconnect(retryAfter ? retryAfter : TICK);
+                return;
+            }
+
+            decoder.commit(bytesTransferred);
+
+            try
+            {
+                chat::MessageView message;
+                while (socket.is_open() && decoder.decode(message))
+                    handleMessage(message);
+            }
+            catch (const std::exception&)
+            {
+                reconnect(TICK);
+                return;
+            }
+
+            // logged in, out again at once
+            if (!socket.is_open())
+                reconnect(0);
+            else
+                receive();
+        });
+    }
+
+    void StormClient::handleMessage(const chat::MessageView& message)
+    {
+        if (message.type != chat::Message::Type::LOGIN) return;
+
+        if (message.body.starts_with("Logged in"))
+        {
+            ++worker.stats.stormLogins;
+            socket.close();
+        }
+        else if (message.timestamp)
+        {
+            ++worker.stats.stormRejected;
+            retryAfter = message.timestamp;
+        }
+    }
+
+    // resident set size and its peak of a process in kilobytes, 0 if unavailable
+    void readMemoryUsage(const std::string& pid, uint64_t& rss, uint64_t& peakRss)
+    {
+        rss = peakRss = 0;
+
+        std::ifstream status("/proc/" + pid + "/status");
+        std::string line;
+        while (std::getline(status, line))
+        {
+            if (line.compare(0, 6, "VmRSS:") == 0)
+                rss = std::strtoull(line.c_str() + 6, nullptr, 10);
+            else if (line.compare(0, 6, "VmHWM:") == 0)
+                peakRss = std::strtoull(line.c_str() + 6, nullptr, 10);
+        }
+    }
+
+    void writeHistogram(std::ostream& output, const chat::Histogram& histogram)
+    {
+        output << "{\"count\": " << histogram.getCount() <<
+            ", \"mean\": " << histogram.getMean() <<
+            ", \"p50\": " << histogram.getPercentile(0.5) <<
+            ", \"p99\": " << histogram.getPercentile(0.99) <<
+            ", \"p999\": " << histogram.getPercentile(0.999) <<
+            ", \"max\": " << histogram.getMax() << "}";
+    }
+}
+
+int main(int argc, const char* argv[])
+{
+    Options options;
+
+    args::ArgumentParser parser("Load generator for the chat server.");
+    args::HelpFlag help(parser, "help", "Display this help menu", {'h', "help"});
+    args::ValueFlag<std::string> address(parser, "address", "Address of the server", {'a', "address"}, "127.0.0.1");
+    args::ValueFlagList<uint16_t> ports(parser, "port", "Port number to connect to, repeat to spread the clients over several servers", {'p', "port"});
+    args::ValueFlag<size_t> clients(parser, "clients", "Number of simulated clients", {'c', "clients"}, options.clients);
+    args::ValueFlag<size_t> threads(parser, "threads", "Number of event loop threads", {'t', "threads"}, options.threads);
+    args::ValueFlag<double> loginRate(parser, "per-second", "Logins per second", {"login-rate"}, options.loginRate);
+    args::ValueFlag<size_t> senders(parser, "senders", "Number of clients that send messages", {"senders"}, options.senders);
+    args::ValueFlag<double> sendRate(parser, "per-second", "Messages per second from all the senders", {"send-rate"}, options.sendRate);
+    args::ValueFlag<size_t> messageSize(parser, "bytes", "Size of the message body", {"message-size"}, options.messageSize);
+    args::ValueFlag<size_t> slowReaders(parser, "clients", "Number of clients that read slowly", {"slow-readers"}, options.slowReaders);
+    args::ValueFlag<size_t> readDelay(parser, "milliseconds", "Time slow readers wait between reads", {"read-delay"}, options.readDelay);
+    args::ValueFlag<size_t> duration(parser, "seconds", "Time to send messages for", {'d', "duration"}, options.duration);
+    args::ValueFlag<size_t> drain(parser, "seconds", "Time to wait for the messages in flight", {"drain"}, options.drain);
+    args::ValueFlag<size_t> stormClients(parser, "clients", "Number of clients that keep logging in and out while the others send", {"storm-clients"}, options.stormClients);
+    args::ValueFlag<std::string> features(parser, "features", "Features to request from the server (e.g. \"varint batch\")", {"features"});
+    args::ValueFlag<std::string> serverPid(parser, "pid", "Process id of the server to report the memory usage of", {"server-pid"});
+    args::ValueFlag<std::string> outputPath(parser, "path", "File to write the JSON results to instead of the standard output", {'o', "output"});
+
+    try
+    {
+        parser.ParseCLI(argc, argv);
+    }
+    catch (const args::Help&)
+    {
+        std::cout << parser << std::endl;
+        return EXIT_SUCCESS;
+    }
+    catch (const args::ParseError& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    try
+    {
+        options.clients = clients.Get();
+        options.threads = std::max(threads.Get(), static_cast<size_t>(1));
+        options.loginRate = loginRate.Get();
+        options.senders = std::min(senders.Get(), options.clients);
+        options.sendRate = sendRate.Get();
+        options.messageSize = messageSize.Get();
+        options.slowReaders = std::min(slowReaders.Get(), options.clients);
+        options.readDelay = readDelay.Get();
+        options.duration = std::max(duration.Get(), static_cast<size_t>(1));
+        options.drain = drain.Get();
+        options.features = features.Get();
+        options.stormClients = stormClients.Get();
+        options.runId = static_cast<uint32_t>(std::random_device()());
+
+        boost::asio::io_service ioService;
+        boost::asio::ip::tcp::resolver resolver(ioService);
+        if (ports.Get().empty())
+        {
+            std::cerr << "Option 'port' is required" << std::endl;
+            return EXIT_FAILURE;
+        }
+
+        for (uint16_t port : ports.Get())
+        {
+            boost::asio::ip::tcp::resolver::query query(address.Get(), std::to_string(port));
+            options.endpoints.push_back(resolver.resolve(query)->endpoint());
+        }
+
+        // every client needs its own descriptor
+        rlimit limit;
+        if (getrlimit(RLIMIT_NOFILE, &limit) == 0)
+        {
+            limit.rlim_cur = limit.rlim_max;
+            setrlimit(RLIMIT_NOFILE, &limit);
+        }
+
+        Progress progress;
+        std::vector<std::unique_ptr<Worker>> workers;
+        for (size_t i = 0; i < options.threads; ++i)
+            workers.push_back(std::unique_ptr<Worker>(new Worker(options, progress, i, options.threads)));
+
+        for (auto& worker : workers) worker->run();
+
+        // connect and log in all the clients
+        auto setupStart = Clock::now();
+        auto setupDeadline = setupStart + std::chrono::seconds(10) +
+            std::chrono::milliseconds(static_cast<int64_t>(1000.0 * options.clients / options.loginRate));
+
+        for (auto& worker : workers) worker->startLogins();
+
+        while (progress.loggedIn + progress.failed < options.clients && Clock::now() < setupDeadline)
+            std::this_thread::sleep_for(std::chrono::milliseconds(TICK));
+
+        double setupTime = std::chrono::duration<double>(Clock::now() - setupStart).count();
+        std::cerr << progress.loggedIn << " clients logged in in " << setupTime << " s" << std::endl;
+
+        // send for the duration and give the last messages time to arrive
+        for (auto& worker : workers) worker->startSending();
+        std::this_thread::sleep_for(std::chrono::seconds(options.duration));
+        for (auto& worker : workers) worker->stopSending();
+        std::this_thread::sleep_for(std::chrono::seconds(options.drain));
+
+        uint64_t rss = 0;
+        uint64_t peakRss = 0;
+        if (serverPid) readMemoryUsage(serverPid.Get(), rss, peakRss);
+
+        for (auto& worker : workers) worker->stop();
+        for (auto& worker : workers) worker->join();
+
+        Stats total;
+        for (auto& worker : workers)
+        {
+            total.latency.merge(worker->stats.latency);
+            total.connectTime.merge(worker->stats.connectTime);
+            total.sent += worker->stats.sent;
+            total.received += worker->stats.received;
+            total.failed += worker->stats.failed;
+            total.disconnected += worker->stats.disconnected;
+            total.stormLogins += worker->stats.stormLogins;
+            total.stormRejected += worker->stats.stormRejected;
+        }
+
+        uint64_t expected = total.sent * progress.loggedIn;
+
+        std::ofstream file;
+        if (outputPath) file.open(outputPath.Get());
+        std::ostream& output = outputPath ? file : std::cout;
+
+        output << "{\n" <<
+            "  \"clients\": " << options.clients << ",\n" <<
+            "  \"servers\": " << options.endpoints.size() << ",\n" <<
+            "  \"threads\": " << options.threads << ",\n" <<
+            "  \"senders\": " << options.senders << ",\n" <<
+            "  \"send_rate\": " << options.sendRate << ",\n" <<
+            "  \"message_size\": " << options.messageSize << ",\n" <<
+            "  \"slow_readers\": " << options.slowReaders << ",\n" <<
+            "  \"features\": \"" << options.features << "\",\n" <<
+            "  \"duration\": " << options.duration << ",\n" <<
+            "  \"logged_in\": " << progress.loggedIn << ",\n" <<
+            "  \"failed\": " << total.failed << ",\n" <<
+            "  \"disconnected\": " << total.disconnected << ",\n" <<
+            "  \"setup_seconds\": " << setupTime << ",\n" <<
+            "  \"connect_us\": ";
+        writeHistogram(output, total.connectTime);
+        output << ",\n" <<
+            "  \"sent\": " << total.sent << ",\n" <<
+            "  \"received\": " << total.received << ",\n" <<
+            "  \"expected\": " << expected << ",\n" <<
+            "  \"send_throughput\": " << static_cast<double>(total.sent) / options.duration << ",\n" <<
+            "  \"delivery_throughput\": " << static_cast<double>(total.received) / options.duration << ",\n" <<
+            "  \"latency_us\": ";
+        writeHistogram(output, total.latency);
+        output << ",\n" <<
+            "  \"storm_clients\": " << options.stormClients << ",\n" <<
+            "  \"storm_logins\": " << total.stormLogins << ",\n" <<
+            "  \"storm_rejected\": " << total.stormRejected << ",\n" <<
+            "  \"server_rss_kb\": " << rss << ",\n" <<
+            "  \"server_peak_rss_kb\": " << peakRss << "\n" <<
+            "}" << std::endl;
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,239 @@
+//
+//  Chat codec benchmark
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <istream>
+#include <ostream>
+#include <random>
+#include <streambuf>
+#include <string>
+#include <vector>
+#include "cereal/archives/binary.hpp"
+#include "Frame.hpp"
+#include "Message.hpp"
+#include "MessageCodec.hpp"
+
+namespace
+{
+    // appends everything written to the stream to a vector, the way frames were encoded with cereal
+    class OutputBuffer final: public std::streambuf
+    {
+    public:
+        explicit OutputBuffer(std::vector<uint8_t>& d): data(d) {}
+
+    protected:
+        std::streamsize xsputn(const char* s, std::streamsize n) override
+        {
+            data.insert(data.end(), s, s + n);
+            return n;
+        }
+
+        int_type overflow(int_type c) override
+        {
+            if (!traits_type::eq_int_type(c, traits_type::eof()))
+                data.push_back(static_cast<uint8_t>(c));
+
+            return traits_type::not_eof(c);
+        }
+
+    private:
+        std::vector<uint8_t>& data;
+    };
+
+    // reads from a block of memory
+    class InputBuffer final: public std::streambuf
+    {
+    public:
+        InputBuffer(const uint8_t* data, size_t size)
+        {
+            char* begin = const_cast<char*>(reinterpret_cast<const char*>(data));
+            setg(begin, begin, begin + size);
+        }
+    };
+
+    void encodeCereal(const chat::Message& message, std::vector<uint8_t>& output)
+    {
+        output.clear();
+        OutputBuffer outputBuffer(output);
+        std::ostream outputStream(&outputBuffer);
+        cereal::BinaryOutputArchive archive(outputStream);
+        archive(message);
+    }
+
+    void encodeCodec(const chat::Message& message, std::vector<uint8_t>& output)
+    {
+        output.resize(chat::MessageCodec::getEncodedSize(message));
+        chat::MessageCodec::encode(message, output.data());
+    }
+
+    void decodeCereal(const std::vector<uint8_t>& input, chat::Message& message)
+    {
+        InputBuffer inputBuffer(input.data(), input.size());
+        std::istream inputStream(&inputBuffer);
+        cereal::BinaryInputArchive archive(inputStream);
+        archive(message);
+    }
+
+    void decodeCodec(const std::vector<uint8_t>& input, chat::MessageView& message)
+    {
+        chat::MessageCodec::decode(reinterpret_cast<const char*>(input.data()), input.size(), message);
+    }
+
+    std::vector<chat::Message> createMessages(size_t count, std::function<size_t(std::mt19937&)> bodySize)
+    {
+        std::mt19937 random(1);
+        std::vector<chat::Message> messages(count);
+
+        for (chat::Message& message : messages)
+        {
+            message.type = chat::Message::Type::TEXT;
+            message.nickname = "user" + std::to_string(random() % 10000);
+            message.body = std::string(bodySize(random), 'x');
+            if (random() % 4 == 0) message.channel = "channel" + std::to_string(random() % 100);
+            message.timestamp = 1500000000000 + random();
+        }
+
+        return messages;
+    }
+
+    // a message of every type with every field it carries, for the comparison with cereal
+    std::vector<chat::Message> createMessagesOfEveryType()
+    {
+        std::vector<chat::Message> messages;
+
+        for (uint8_t type = 0; type <= static_cast<uint8_t>(chat::Message::Type::ERROR); ++type)
+        {
+            chat::Message message;
+            message.type = static_cast<chat::Message::Type>(type);
+            message.nickname = "user";
+            message.body = "body";
+            message.channel = "channel";
+            message.timestamp = 1500000000000;
+
+            if (message.type == chat::Message::Type::CHUNK)
+            {
+                message.transfer = 1;
+                message.offset = 4;
+                message.size = 12;
+                message.name = "file";
+            }
+
+            if (message.type == chat::Message::Type::DIRECT || message.type == chat::Message::Type::MULTICAST)
+                message.recipients = {"alice", "", "bob"};
+
+            messages.push_back(message);
+        }
+
+        return messages;
+    }
+
+    bool isSame(const chat::Message& a, const chat::Message& b)
+    {
+        return a.type == b.type && a.nickname == b.nickname && a.body == b.body && a.channel == b.channel &&
+            a.timestamp == b.timestamp && a.transfer == b.transfer && a.offset == b.offset && a.size == b.size &&
+            a.name == b.name && a.recipients == b.recipients;
+    }
+
+    template <class F>
+    double measure(size_t iterations, size_t count, F f)
+    {
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < iterations; ++i)
+            for (size_t j = 0; j < count; ++j) f(j);
+        auto end = std::chrono::steady_clock::now();
+
+        return std::chrono::duration<double, std::nano>(end - start).count() / (iterations * count);
+    }
+}
+
+int main()
+{
+    const size_t messageCount = 1000;
+
+    struct Distribution
+    {
+        const char* name;
+        std::function<size_t(std::mt19937&)> bodySize;
+    };
+
+    std::vector<Distribution> distributions = {
+        {"short (1-32)", [](std::mt19937& random) { return std::uniform_int_distribution<size_t>(1, 32)(random); }},
+        {"chat (log-normal, median 40)", [](std::mt19937& random) {
+            return std::min(static_cast<size_t>(std::lognormal_distribution<double>(std::log(40.0), 1.0)(random)) + 1,
+                            static_cast<size_t>(1000));
+        }},
+        {"long (512-1000)", [](std::mt19937& random) { return std::uniform_int_distribution<size_t>(512, 1000)(random); }},
+        {"large (2048-8192)", [](std::mt19937& random) { return std::uniform_int_distribution<size_t>(2048, 8192)(random); }}
+    };
+
+    // the codec has to produce exactly what cereal does, and read it back, for every type of message
+    for (const chat::Message& message : createMessagesOfEveryType())
+    {
+        std::vector<uint8_t> cerealOutput;
+        std::vector<uint8_t> codecOutput;
+        encodeCereal(message, cerealOutput);
+        encodeCodec(message, codecOutput);
+
+        chat::MessageView messageView;
+        decodeCodec(cerealOutput, messageView);
+
+        if (codecOutput != cerealOutput || !isSame(messageView.toMessage(), message))
+        {
+            std::cerr << "Codec differs from cereal for type " << static_cast<int>(message.type) << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    std::cout << "bodies\tcereal encode ns\tcodec encode ns\tframe ns\tcereal decode ns\tcodec decode ns\tcodec decode+copy ns" << std::endl;
+
+    for (const Distribution& distribution : distributions)
+    {
+        std::vector<chat::Message> messages = createMessages(messageCount, distribution.bodySize);
+        std::vector<std::vector<uint8_t>> encoded(messageCount);
+
+        // the codec has to produce exactly what cereal does
+        for (size_t i = 0; i < messageCount; ++i)
+        {
+            std::vector<uint8_t> codecOutput;
+            encodeCereal(messages[i], encoded[i]);
+            encodeCodec(messages[i], codecOutput);
+
+            if (codecOutput != encoded[i])
+            {
+                std::cerr << "Codec output differs from cereal" << std::endl;
+                return EXIT_FAILURE;
+            }
+        }
+
+        const size_t iterations = 200;
+        std::vector<uint8_t> output;
+        output.reserve(16384);
+        chat::Message message;
+        chat::MessageView messageView;
+        size_t sink = 0;
+
+        double cerealEncode = measure(iterations, messageCount, [&](size_t i) { encodeCereal(messages[i], output); sink += output.size(); });
+        double codecEncode = measure(iterations, messageCount, [&](size_t i) { encodeCodec(messages[i], output); sink += output.size(); });
+        double frame = measure(iterations, messageCount, [&](size_t i) { chat::Frame f(messages[i]); sink += f.getSize(); });
+        double cerealDecode = measure(iterations, messageCount, [&](size_t i) { decodeCereal(encoded[i], message); sink += message.body.size(); });
+        double codecDecode = measure(iterations, messageCount, [&](size_t i) { decodeCodec(encoded[i], messageView); sink += messageView.body.size(); });
+        double codecDecodeCopy = measure(iterations, messageCount, [&](size_t i) {
+            decodeCodec(encoded[i], messageView);
+            message = messageView.toMessage();
+            sink += message.body.size();
+        });
+
+        std::cout << distribution.name << "\t" << cerealEncode << "\t" << codecEncode << "\t" << frame << "\t" <<
+            cerealDecode << "\t" << codecDecode << "\t" << codecDecodeCopy << std::endl;
+
+        if (!sink) std::cerr << std::endl; // keep the results alive
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,215 @@
+//
+//  Chat compression benchmark
+//
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include "Compression.hpp"
+#include "Frame.hpp"
+#include "Message.hpp"
+
+namespace
+{
+    const char* WORDS[] = {
+        "the", "and", "you", "that", "this", "with", "have", "just", "about", "what", "when", "deploy",
+        "build", "test", "meeting", "tomorrow", "today", "lunch", "thanks", "please", "think", "know",
+        "server", "client", "channel", "message", "latency", "looks", "good", "broken", "fixed", "again",
+        "review", "merge", "branch", "release", "bug", "issue", "can", "someone", "check", "why", "it's"
+    };
+
+    const char* NICKNAMES[] = {"alice", "bob", "carol", "dave", "erin", "frank", "grace", "heidi"};
+    const char* CHANNELS[] = {"#general", "#dev", "#ops", "#random"};
+
+    template <size_t N>
+    const char* pick(std::mt19937& random, const char* (&values)[N])
+    {
+        return values[std::uniform_int_distribution<size_t>(0, N - 1)(random)];
+    }
+
+    std::string sentence(std::mt19937& random, size_t words)
+    {
+        std::string text;
+        for (size_t i = 0; i < words; ++i)
+        {
+            if (i) text += ' ';
+            text += pick(random, WORDS);
+        }
+        return text;
+    }
+
+    chat::Message text(const std::string& nickname, const std::string& body, const std::string& channel)
+    {
+        chat::Message message;
+        message.type = chat::Message::Type::TEXT;
+        message.nickname = nickname;
+        message.body = body;
+        message.channel = channel;
+        message.timestamp = 1700000000000;
+        return message;
+    }
+
+    // the kinds of traffic the server sees, every one of them on its own and mixed
+    std::vector<std::vector<chat::Message>> generate(std::mt19937& random, size_t count)
+    {
+        std::vector<std::vector<chat::Message>> corpora(5);
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            std::string nickname = pick(random, NICKNAMES);
+            std::string channel = pick(random, CHANNELS);
+
+            chat::Message status;
+            status.type = chat::Message::Type::STATUS;
+            status.nickname = nickname;
+            status.body = nickname + (i % 2 ? " joined " : " left ") + channel;
+            status.channel = channel;
+            corpora[0].push_back(status);
+
+            std::string build = std::to_string(10000 + i);
+            corpora[1].push_back(text("ci-bot", "[ci] build #" + build + " of chat/master " +
+                                      (i % 5 ? "passed" : "failed") + " in " + std::to_string(i % 9 + 1) + "m" +
+                                      std::to_string(i % 60) + "s: https://ci.example.com/chat/builds/" + build,
+                                      "#dev"));
+
+            corpora[2].push_back(text(nickname, sentence(random, std::uniform_int_distribution<size_t>(3, 20)(random)), channel));
+            corpora[3].push_back(text(nickname, sentence(random, 120), channel));
+        }
+
+        for (size_t i = 0; i < count; ++i)
+            corpora[4].push_back(corpora[i % 4][i]);
+
+        return corpora;
+    }
+
+    struct Result
+    {
+        double rawBytes = 0.0; // per message
+        double sentBytes = 0.0;
+        double compressTime = 0.0; // ns per message
+        double inflateTime = 0.0;
+    };
+
+    // what the server does for a recipient with the deflate feature: payloads from the threshold on
+    // are compressed and sent compressed if that is smaller
+    Result run(const std::vector<chat::FramePtr>& frames, int level, bool dictionary, size_t threshold)
+    {
+        const size_t rounds = 5;
+
+        chat::Deflater deflater(level, dictionary);
+        chat::Inflater inflater(dictionary);
+        std::vector<uint8_t> compressed;
+        std::vector<char> inflated;
+
+        Result result;
+        size_t rawBytes = 0;
+        size_t sentBytes = 0;
+
+        auto start = std::chrono::steady_clock::now();
+        for (size_t round = 0; round < rounds; ++round)
+        {
+            rawBytes = sentBytes = 0;
+
+            for (const chat::FramePtr& frame : frames)
+            {
+                rawBytes += frame->getSize();
+
+                compressed.clear();
+                if (threshold && frame->getPayloadSize() >= threshold &&
+                    deflater.compress(frame->getPayload(), frame->getPayloadSize(), compressed) &&
+                    compressed.size() + 1 < frame->getPayloadSize())
+                    sentBytes += chat::Frame::HEADER_SIZE + 1 + compressed.size();
+                else
+                    sentBytes += frame->getSize();
+            }
+        }
+        auto end = std::chrono::steady_clock::now();
+        result.compressTime = std::chrono::duration<double, std::nano>(end - start).count() / (rounds * frames.size());
+
+        // the receiving side
+        std::vector<std::vector<uint8_t>> compressedFrames;
+        for (const chat::FramePtr& frame : frames)
+        {
+            compressed.clear();
+            if (threshold && frame->getPayloadSize() >= threshold &&
+                deflater.compress(frame->getPayload(), frame->getPayloadSize(), compressed))
+                compressedFrames.push_back(compressed);
+        }
+
+        start = std::chrono::steady_clock::now();
+        for (size_t round = 0; round < rounds; ++round)
+            for (const std::vector<uint8_t>& frame : compressedFrames)
+                inflater.decompress(frame.data(), frame.size(), inflated, chat::Frame::MAX_PAYLOAD_SIZE);
+        end = std::chrono::steady_clock::now();
+        result.inflateTime = std::chrono::duration<double, std::nano>(end - start).count() / (rounds * frames.size());
+
+        result.rawBytes = static_cast<double>(rawBytes) / frames.size();
+        result.sentBytes = static_cast<double>(sentBytes) / frames.size();
+
+        return result;
+    }
+
+    void print(const char* corpus, const char* configuration, size_t threshold, const Result& result)
+    {
+        double saved = result.rawBytes - result.sentBytes;
+
+        std::cout << corpus << "\t" << configuration << "\t" << threshold << "\t" <<
+            result.rawBytes << "\t" << result.sentBytes << "\t" << saved / result.rawBytes * 100.0 << "\t" <<
+            result.compressTime << "\t" << result.inflateTime << "\t";
+
+        if (saved > 0.0) std::cout << result.compressTime / saved;
+        else std::cout << "-";
+
+        std::cout << std::endl;
+    }
+}
+
+int main()
+{
+    const size_t count = 20000;
+    const char* corpusNames[] = {"status", "bot", "chat", "paragraph", "mixed"};
+
+    std::mt19937 random(42);
+    std::vector<std::vector<chat::Message>> corpora = generate(random, count);
+
+    struct Configuration
+    {
+        const char* name;
+        int level;
+        bool dictionary;
+    };
+
+    const Configuration configurations[] = {
+        {"level 1", 1, false},
+        {"level 6", 6, false},
+        {"level 1 + dictionary", 1, true},
+        {"level 6 + dictionary", 6, true}
+    };
+
+    std::cout << "corpus\tcompression\tthreshold\traw bytes/msg\tsent bytes/msg\tsaved %\t"
+        "compress ns/msg\tinflate ns/msg\tcompress ns/saved byte" << std::endl;
+
+    for (size_t i = 0; i < corpora.size(); ++i)
+    {
+        std::vector<chat::FramePtr> frames;
+        for (const chat::Message& message : corpora[i])
+            frames.push_back(std::make_shared<const chat::Frame>(message));
+
+        for (const Configuration& configuration : configurations)
+            print(corpusNames[i], configuration.name, 1,
+                  run(frames, configuration.level, configuration.dictionary, 1));
+    }
+
+    // the threshold trades the CPU spent on small messages against their few saved bytes
+    std::vector<chat::FramePtr> mixed;
+    for (const chat::Message& message : corpora[4])
+        mixed.push_back(std::make_shared<const chat::Frame>(message));
+
+    for (size_t threshold : {64, 128, 256, 512})
+        print("mixed", "level 6 + dictionary", threshold, run(mixed, chat::COMPRESSION_LEVEL, true, threshold));
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,199 @@
+//
+//  Chat metrics overhead benchmark
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <deque>
+#include <iostream>
+#include <vector>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "Frame.hpp"
+#include "Message.hpp"
+#include "MessageCodec.hpp"
+#include "Metrics.hpp"
+
+namespace
+{
+    struct Recipient
+    {
+        std::deque<chat::FramePtr> outputQueue;
+        size_t outputQueueSize = 0;
+    };
+
+    // times the scope only when instrumented
+    template <bool enabled>
+    struct OptionalTimer
+    {
+        explicit OptionalTimer(chat::SampledHistogram&) {}
+        OptionalTimer(chat::Histogram&, bool) {}
+        bool isTiming() const { return false; }
+    };
+
+    template <>
+    struct OptionalTimer<true>
+    {
+        explicit OptionalTimer(chat::SampledHistogram& histogram): timer(histogram) {}
+        OptionalTimer(chat::Histogram& histogram, bool timed): timer(histogram, timed) {}
+        bool isTiming() const { return timer.isTiming(); }
+        chat::ScopedTimer timer;
+    };
+
+    // the server's hot path for one read: read the bytes, decode the messages, re-encode every one
+    // of them once and queue the frame for all the recipients, then write every recipient's queue
+    // with a single gathered write (the reads and writes go to /dev/zero and /dev/null)
+    template <bool instrumented>
+    void handleRead(int inputFd, int outputFd, const std::vector<uint8_t>& input, size_t messageCount,
+                    std::vector<Recipient>& recipients, chat::Metrics& metrics)
+    {
+        std::vector<uint8_t> received(input.size());
+        if (::read(inputFd, received.data(), received.size()) < 0) std::abort();
+
+        OptionalTimer<instrumented> receiveTimer(metrics.receiveTime);
+        metrics.timing = receiveTimer.isTiming();
+        if (instrumented)
+        {
+            metrics.bytesReceived += input.size();
+            metrics.messagesReceived += messageCount;
+        }
+
+        const char* position = reinterpret_cast<const char*>(input.data());
+
+        for (size_t i = 0; i < messageCount; ++i)
+        {
+            size_t frameSize = static_cast<size_t>(static_cast<uint8_t>(position[0]) << 8 | static_cast<uint8_t>(position[1]));
+            position += chat::Frame::HEADER_SIZE;
+
+            OptionalTimer<instrumented> handleTimer(metrics.handleTime, metrics.timing);
+
+            chat::MessageView view;
+            chat::MessageCodec::decode(position, frameSize, view);
+            position += frameSize;
+
+            chat::Message message = view.toMessage();
+
+            OptionalTimer<instrumented> broadcastTimer(metrics.broadcastTime, metrics.timing);
+            if (instrumented) ++metrics.messagesBroadcast;
+
+            chat::FramePtr frame = std::make_shared<const chat::Frame>(message);
+            for (Recipient& recipient : recipients)
+            {
+                recipient.outputQueue.push_back(frame);
+                recipient.outputQueueSize += frame->getSize();
+            }
+        }
+
+        metrics.timing = false;
+
+        std::vector<iovec> outputBuffers;
+
+        for (Recipient& recipient : recipients)
+        {
+            outputBuffers.clear();
+            for (const chat::FramePtr& frame : recipient.outputQueue)
+            {
+                outputBuffers.push_back(iovec{const_cast<uint8_t*>(frame->getData()), chat::Frame::HEADER_SIZE});
+                outputBuffers.push_back(iovec{const_cast<uint8_t*>(frame->getPayload()), frame->getPayloadSize()});
+            }
+
+            if (::writev(outputFd, outputBuffers.data(), static_cast<int>(outputBuffers.size())) < 0) std::abort();
+
+            if (instrumented)
+            {
+                ++metrics.writes;
+                metrics.bytesSent += recipient.outputQueueSize;
+                metrics.framesSent += recipient.outputQueue.size();
+                metrics.writeFrames.record(recipient.outputQueue.size());
+            }
+
+            recipient.outputQueue.clear();
+            recipient.outputQueueSize = 0;
+        }
+    }
+
+    template <class F>
+    double measure(size_t iterations, F f)
+    {
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < iterations; ++i) f();
+        auto end = std::chrono::steady_clock::now();
+
+        return std::chrono::duration<double, std::nano>(end - start).count() / iterations;
+    }
+}
+
+int main()
+{
+    const size_t messagesPerRead = 4;
+    const size_t rounds = 101;
+
+    chat::Message message;
+    message.type = chat::Message::Type::TEXT;
+    message.nickname = "benchmark";
+    message.body = std::string(64, 'x');
+
+    std::vector<uint8_t> input;
+    for (size_t i = 0; i < messagesPerRead; ++i)
+    {
+        chat::Frame frame(message);
+        input.insert(input.end(), frame.getData(), frame.getData() + frame.getSize());
+    }
+
+    int inputFd = ::open("/dev/zero", O_RDONLY);
+    int outputFd = ::open("/dev/null", O_WRONLY);
+    if (inputFd == -1 || outputFd == -1)
+    {
+        std::cerr << "Failed to open /dev/zero or /dev/null" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::cout << "recipients\tplain ns/read\tinstrumented ns/read\toverhead %" << std::endl;
+
+    for (size_t recipientCount : {1, 10, 100, 1000})
+    {
+        std::vector<Recipient> recipients(recipientCount);
+        chat::Metrics metrics;
+        size_t iterations = std::max(static_cast<size_t>(20), static_cast<size_t>(100000) / recipientCount);
+
+        // the runs are paired and every pair is compared on its own, alternating which one goes first, so
+        // frequency scaling, cache effects and the other tenants of the machine hit both alike, and the
+        // median pair is reported
+        std::vector<double> plain(rounds);
+        std::vector<double> instrumented(rounds);
+        std::vector<double> overheads(rounds);
+
+        for (size_t round = 0; round < rounds; ++round)
+        {
+            auto runPlain = [&]() { return measure(iterations, [&]() { handleRead<false>(inputFd, outputFd, input, messagesPerRead, recipients, metrics); }); };
+            auto runInstrumented = [&]() { return measure(iterations, [&]() { handleRead<true>(inputFd, outputFd, input, messagesPerRead, recipients, metrics); }); };
+
+            if (round % 2)
+            {
+                instrumented[round] = runInstrumented();
+                plain[round] = runPlain();
+            }
+            else
+            {
+                plain[round] = runPlain();
+                instrumented[round] = runInstrumented();
+            }
+
+            overheads[round] = (instrumented[round] - plain[round]) / plain[round] * 100.0;
+        }
+
+        std::sort(plain.begin(), plain.end());
+        std::sort(instrumented.begin(), instrumented.end());
+        std::sort(overheads.begin(), overheads.end());
+
+        std::cout << recipientCount << "\t" << plain[rounds / 2] << "\t" << instrumented[rounds / 2] << "\t" <<
+            overheads[rounds / 2] << std::endl;
+    }
+
+    ::close(inputFd);
+    ::close(outputFd);
+
+    return EXIT_SUCCESS;
+}
@@ -4,19 +4,44 @@
 
 #pragma once
 
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <sys/stat.h>
 #include <unistd.h>
+#include <vector>
 #include <boost/asio.hpp>
-#include "cereal/archives/binary.hpp"
 #include "cereal/cereal.hpp"
 #include "spdlog/spdlog.h"
+#include "Config.hpp"
+#include "Frame.hpp"
+#include "FrameDecoder.hpp"
 #include "Message.hpp"
 
 namespace chat
 {
-    static const size_t BUFFER_SIZE = 1024;
+    static const size_t BUFFER_SIZE = 1024; // largest message without the varint feature
     static const size_t CONNECTION_TIMEOUT = 3;
-    static const size_t RECONNECT_INTERVAL = 5;
+    static const uint64_t RECONNECT_DELAY_MIN = 250; // milliseconds before the first reconnect, doubled for every next one
+    static const uint64_t RECONNECT_DELAY_MAX = 30000; // milliseconds, also how long a connection lasts to count as stable
+    static const size_t CHUNK_SIZE = 16 * 1024; // bytes of a file sent in a single chunk
+    static const size_t MAX_WRITE_FRAMES = 64; // frames gathered into a single write
+    static const size_t HELLO_ATTEMPTS = 3; // connections in a row closed on the hello before the client stops negotiating
+    static const uint64_t HEARTBEAT_MISSES = 3; // heartbeat intervals without traffic from the server after which it is taken for dead
+    static const size_t INPUT_BLOCK_SIZE = 64 * 1024; // bytes of the headless input read at a time
 
     class Client final
     {
@@ -24,16 +49,29 @@ namespace chat
         Client(const std::shared_ptr<spdlog::logger>& l,
             boost::asio::io_service& s,
             boost::asio::ip::tcp::endpoint endpoint,
-            const std::string n):
+            const std::string n,
+            const Config& c):
             logger(l),
             ioService(s),
             socket(s),
             nickname(n),
-            commandLine(ioService, ::dup(STDIN_FILENO)),
+            config(c),
+            commandLine(s),
+            input(s),
             connectDeadlineTimer(s),
             reconnectDeadlineTimer(s),
+            uploadTimer(s),
+            heartbeatTimer(s),
             signals(s, SIGINT, SIGTERM)
         {
+            std::random_device device;
+            random.seed(device());
+
+            if (config.inputPath.empty())
+                commandLine.assign(::dup(STDIN_FILENO));
+            else
+                openInput();
+
             connect(endpoint);
 
             signals.async_wait([this](const boost::system::error_code& error,
@@ -47,20 +85,122 @@ namespace chat
             });
         }
 
+        ~Client()
+        {
+            if (inputFile != -1) ::close(inputFile);
+        }
+
+        // queue the message, the frames queued while a write is in progress go out together in the next one
         void sendMessage(const Message& message)
         {
-            std::ostream outputStream(&outputBuffer);
-            cereal::BinaryOutputArchive archive(outputStream);
-            archive(message);
+            OutputFrame outputFrame;
+            outputFrame.frame = std::make_shared<const Frame>(message);
+            outputFrame.basic = !channelFields;
+
+            // servers without the channels feature take the messages in the original layout
+            if (!channelFields)
+            {
+                outputFrame.frame = outputFrame.frame->getBasicFrame();
+                if (!outputFrame.frame)
+                {
+                    logger->error("The server does not support this message");
+                    return;
+                }
+            }
 
-            uint16_t messageSize = ntohs(static_cast<uint16_t>(outputBuffer.size()));
-            socket.send(boost::asio::buffer(&messageSize, sizeof(messageSize)));
+            size_t payloadSize = outputFrame.frame->getPayloadSize();
 
-            size_t n = socket.send(outputBuffer.data());
-            outputBuffer.consume(n); // remove sent data from the buffer
+            if (!varint)
+            {
+                if (payloadSize > BUFFER_SIZE)
+                {
+                    logger->error("Message too long");
+                    return;
+                }
+            }
+            else
+            {
+                if (payloadSize > maxFrameSize)
+                {
+                    logger->error("Message too long, send it as a file with /send");
+                    return;
+                }
+
+                outputFrame.headerSize = Frame::encodeVarintHeader(payloadSize, outputFrame.header);
+            }
+
+            outputQueue.push_back(outputFrame);
+
+            if (!writing) write();
         }
 
     private:
+        // frame waiting to be written with its length prefix
+        struct OutputFrame
+        {
+            FramePtr frame;
+            uint8_t header[Frame::MAX_VARINT_HEADER_SIZE];
+            size_t headerSize = 0; // of the varint prefix, 0 for the frame's own 16-bit one
+            bool basic = false; // in the original layout
+        };
+
+        // the lines typed or read from the input are sent again if the connection drops before they are
+        // written, everything else is sent anew by the next login
+        static bool isInput(const OutputFrame& outputFrame)
+        {
+            Message::Type type = outputFrame.frame->getType();
+            return type == Message::Type::TEXT || type == Message::Type::DIRECT || type == Message::Type::MULTICAST;
+        }
+
+        void write()
+        {
+            writing = true;
+            writingFrames = std::min(outputQueue.size(), MAX_WRITE_FRAMES);
+            outputBuffers.clear();
+
+            // the queue's elements do not move while more are added, so the buffers can point into them
+            for (size_t i = 0; i < writingFrames; ++i)
+            {
+                const OutputFrame& outputFrame = outputQueue[i];
+
+                if (outputFrame.headerSize)
+                {
+                    outputBuffers.push_back(boost::asio::buffer(outputFrame.header, outputFrame.headerSize));
+                    outputBuffers.push_back(boost::asio::buffer(outputFrame.frame->getPayload(), outputFrame.frame->getPayloadSize()));
+                }
+                else
+                    outputBuffers.push_back(outputFrame.frame->buffer());
+            }
+
+            uint64_t current = connection;
+            boost::asio::async_write(socket, outputBuffers,
+                                     [this, current](const boost::system::error_code& error, std::size_t)
+            {
+                // the queue was dropped when the client reconnected
+                if (current != connection) return;
+
+                writing = false;
+
+                // the receive notices the broken connection
+                if (error) return;
+
+                messagesSent += writingFrames;
+                lastSend = std::chrono::steady_clock::now();
+                outputQueue.erase(outputQueue.begin(), outputQueue.begin() + static_cast<std::ptrdiff_t>(writingFrames));
+
+                if (!outputQueue.empty()) write();
+
+                // on a new connection the input waits for the login (or the resumed session)
+                if (inputPaused && !negotiating && !resuming && outputQueue.size() < config.sendWindow)
+                {
+                    inputPaused = false;
+                    readInput();
+                }
+
+                if (inputEnded && outputQueue.empty() && uploads.empty()) finishInput();
+            });
+        }
+
         void connect(boost::asio::ip::tcp::endpoint endpoint)
         {
             logger->info("Connecting");
@@ -81,34 +221,158 @@ namespace chat
                     connectDeadlineTimer.cancel();
                     reconnectDeadlineTimer.cancel();
 
-                    login();
-                    receive();
-                    readCommandLine();
+                    // the input queued for the previous connection goes out again after the login, the rest
+                    // is dropped, and the features are negotiated anew
+                    ++connection;
+                    keepUnsentInput();
+                    outputQueue.clear();
+                    writing = false;
+                    decoder = FrameDecoder(BUFFER_SIZE);
+                    decoder.setLayout(MessageCodec::Layout::BASIC);
+                    channelFields = false;
+                    varint = false;
+                    maxFrameSize = BUFFER_SIZE;
+                    resumable = false;
+                    resuming = false;
+                    loginRejected = false;
+                    heartbeatInterval = 0;
+                    heartbeatTimer.cancel();
+                    connectTime = std::chrono::steady_clock::now();
+                    lastSend = connectTime;
+                    lastReceive = connectTime;
+
+                    // ask for the large message support first, the login follows the reply
+                    if (negotiate)
+                        hello();
+                    else
+                        login();
+
+                    receive(endpoint);
                 }
                 else
                 {
                     connectDeadlineTimer.cancel();
-
-                    // wait 5 seconds for reconnect
-                    reconnectDeadlineTimer.expires_from_now(boost::posix_time::seconds(RECONNECT_INTERVAL));
-                    reconnectDeadlineTimer.async_wait([this, endpoint](const boost::system::error_code& error)
-                    {
-                        if (!error) // not boost::asio::error::operation_aborted
-                        {
-                            connect(endpoint);
-                        }
-                    });
+                    reconnect(endpoint, getReconnectDelay());
                 }
             });
         }
 
+        void reconnect(boost::asio::ip::tcp::endpoint endpoint, uint64_t delay)
+        {
+            logger->info("Reconnecting in {0} ms", delay);
+
+            reconnectDeadlineTimer.expires_from_now(boost::posix_time::milliseconds(static_cast<int64_t>(delay)));
+            reconnectDeadlineTimer.async_wait([this, endpoint](const boost::system::error_code& error)
+            {
+                if (!error) // not boost::asio::error::operation_aborted
+                    connect(endpoint);
+            });
+        }
+
+        // exponential backoff with jitter, so the clients dropped together do not all come back together
+        uint64_t getReconnectDelay()
+        {
+            uint64_t limit = RECONNECT_DELAY_MIN << std::min(reconnectAttempts, static_cast<size_t>(16));
+            if (limit > RECONNECT_DELAY_MAX) limit = RECONNECT_DELAY_MAX;
+            ++reconnectAttempts;
+
+            // at least half of the limit, so the delay still grows
+            return limit / 2 + random() % (limit / 2 + 1);
+        }
+
         void disconnect()
         {
             signals.cancel();
             connectDeadlineTimer.cancel();
             reconnectDeadlineTimer.cancel();
+            uploadTimer.cancel();
+            heartbeatTimer.cancel();
             socket.close();
             commandLine.close();
+            input.close();
+
+            if (!config.inputPath.empty())
+                logger->info("Sent {0} messages, received {1}", messagesSent, messagesReceived);
+        }
+
+        void hello()
+        {
+            negotiating = true;
+
+            Message message;
+            message.type = Message::Type::HELLO;
+            message.body = "channels varint deflate batch resume heartbeat";
+
+            sendMessage(message);
+        }
+
+        // the server's reply lists the accepted features and their limits
+        void handleHello(const std::string& features)
+        {
+            negotiating = false;
+            helloRejections = 0;
+
+            std::istringstream stream(features);
+            std::string feature;
+            while (stream >> feature)
+            {
+                if (feature == "channels")
+                    channelFields = true;
+                else if (feature == "varint")
+                    varint = true;
+                else if (feature == "deflate")
+                    decoder.setInflate();
+                else if (feature == "resume")
+                    resumable = true;
+                else if (feature.compare(0, 15, "max-frame-size=") == 0)
+                    maxFrameSize = std::stoul(feature.substr(15));
+                else if (feature.compare(0, 11, "chunk-rate=") == 0)
+                    chunkRate = std::stoul(feature.substr(11));
+                else if (feature.compare(0, 10, "heartbeat=") == 0)
+                    heartbeatInterval = std::stoul(feature.substr(10));
+            }
+
+            if (channelFields) decoder.setLayout(MessageCodec::Layout::CHANNELS);
+            if (varint) decoder.setVarint(maxFrameSize);
+            if (heartbeatInterval) heartbeat();
+
+            if (resumable && !resumeToken.empty())
+                resume();
+            else
+                login();
+        }
+
+        // a ping goes out only when the connection has been quiet for an interval, any other traffic keeps
+        // it alive just as well, and a server that stays silent for a few intervals is taken for dead
+        void heartbeat()
+        {
+            uint64_t current = connection;
+            heartbeatTimer.expires_from_now(boost::posix_time::milliseconds(static_cast<int64_t>(heartbeatInterval)));
+            heartbeatTimer.async_wait([this, current](const boost::system::error_code& error)
+            {
+                if (error || current != connection) return;
+
+                auto now = std::chrono::steady_clock::now();
+                std::chrono::milliseconds interval(heartbeatInterval);
+
+                if (now - lastReceive >= HEARTBEAT_MISSES * interval)
+                {
+                    // the pending receive fails and the connection is reestablished like any dropped one
+                    logger->info("The server stopped responding");
+                    boost::system::error_code ignored;
+                    socket.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ignored);
+                    return;
+                }
+
+                if (now - lastSend >= interval || now - lastReceive >= interval)
+                {
+                    Message message;
+                    message.type = Message::Type::PING;
+                    sendMessage(message);
+                }
+
+                heartbeat();
+            });
         }
 
         void login()
@@ -116,22 +380,173 @@ namespace chat
             Message message;
             message.type = Message::Type::LOGIN;
             message.nickname = nickname;
+            message.timestamp = lastTimestamp; // get the messages missed while disconnected
 
             sendMessage(message);
+
+            // rejoin the channels after a reconnect
+            for (const std::string& channel : channels)
+                sendChannelMessage(Message::Type::JOIN, channel, lastTimestamp);
+
+            resumeInput();
+            startInput();
+        }
+
+        // pick the session up where the last connection left it, the server keeps the channels and
+        // replays only the messages newer than the last one seen
+        void resume()
+        {
+            resuming = true;
+
+            Message message;
+            message.type = Message::Type::RESUME;
+            message.nickname = nickname;
+            message.body = resumeToken;
+            message.timestamp = lastTimestamp;
+
+            sendMessage(message);
+
+            startInput();
+        }
+
+        // the server's reply to the resume, or the token of a new session after the login
+        void handleResume(const std::string& token)
+        {
+            resumeToken = token;
+
+            if (!resuming) return;
+            resuming = false;
+
+            if (token.empty())
+            {
+                logger->info("The session can not be resumed, logging in");
+                login();
+            }
+            else
+            {
+                logger->info("Resumed the session");
+                resumeInput();
+            }
+        }
+
+        // keep the input the dropped connection did not write (the frames being written included, the
+        // server may not have read them), decoded so it can be encoded for the next connection
+        void keepUnsentInput()
+        {
+            size_t dropped = 0;
+
+            for (const OutputFrame& outputFrame : outputQueue)
+            {
+                if (!isInput(outputFrame))
+                {
+                    ++dropped;
+                    continue;
+                }
+
+                MessageView view;
+                MessageCodec::decode(reinterpret_cast<const char*>(outputFrame.frame->getPayload()),
+                                     outputFrame.frame->getPayloadSize(), view,
+                                     outputFrame.basic ? MessageCodec::Layout::BASIC : MessageCodec::Layout::CHANNELS);
+
+                Message message;
+                message.type = view.type;
+                message.body = view.body.to_string();
+                message.channel = view.channel.to_string();
+                for (const boost::string_ref& recipient : view.recipients)
+                    message.recipients.push_back(recipient.to_string());
+                unsentInput.push_back(message);
+            }
+
+            if (!unsentInput.empty())
+                logger->warn("{0} lines were not sent before the connection dropped, sending them after the login", unsentInput.size());
+            if (dropped)
+                logger->info("Dropped {0} messages queued for the previous connection", dropped);
+        }
+
+        // after a login on a new connection, the input the previous one did not write goes out first, then
+        // the input paused by a full send window goes on (the write that would have resumed it never completed)
+        void resumeInput()
+        {
+            for (const Message& message : unsentInput)
+                sendMessage(message);
+            unsentInput.clear();
+
+            if (inputPaused)
+            {
+                inputPaused = false;
+                readInput();
+            }
         }
 
-        void handleMessage(Message& message)
+        void startInput()
         {
+            if (!readingInput)
+            {
+                readingInput = true;
+
+                if (config.inputPath.empty())
+                    readCommandLine();
+                else
+                    readInput();
+            }
+        }
+
+        // since is the timestamp of the last message seen in the channel, 0 for the last few messages
+        void sendChannelMessage(Message::Type type, const std::string& channel, uint64_t since = 0)
+        {
+            Message message;
+            message.type = type;
+            message.channel = channel;
+            message.timestamp = since;
+
+            sendMessage(message);
+        }
+
+        void handleMessage(const MessageView& message)
+        {
+            // a rejected login is followed by the close, so anything else the server sends means it was not
+            // (servers that do not name the nickname in the reply to an accepted one)
+            if (message.type != Message::Type::LOGIN) loginRejected = false;
+
             switch (message.type)
             {
                 case Message::Type::LOGIN:
-                    logger->info(message.body);
+                    retryAfter = message.timestamp; // set if the server is too busy to take the login
+                    // only the reply to an accepted login names the nickname
+                    loginRejected = !retryAfter && message.nickname.empty();
+                    if (config.outputFormat == Config::OutputFormat::RECORDS)
+                        printMessage(message);
+                    else
+                        logger->info(message.body.to_string());
                     break;
                 case Message::Type::TEXT:
-                    std::cout << message.nickname << ": " << message.body << std::endl;
+                    lastTimestamp = std::max(lastTimestamp, message.timestamp);
+                    printMessage(message);
                     break;
                 case Message::Type::STATUS:
-                    std::cout << message.body << std::endl;
+                case Message::Type::DIRECT:
+                case Message::Type::MULTICAST:
+                case Message::Type::ERROR:
+                    printMessage(message);
+                    break;
+                case Message::Type::HELLO:
+                    handleHello(message.body.to_string());
+                    break;
+                case Message::Type::RESUME:
+                    handleResume(message.body.to_string());
+                    break;
+                case Message::Type::PING:
+                {
+                    Message pong;
+                    pong.type = Message::Type::PONG;
+                    sendMessage(pong);
+                    break;
+                }
+                case Message::Type::PONG:
+                    break;
+                case Message::Type::CHUNK:
+                    if (config.outputFormat == Config::OutputFormat::RECORDS) printMessage(message);
+                    receiveChunk(message);
                     break;
                 default:
                     logger->error("Invalid message received");
@@ -140,70 +555,330 @@ namespace chat
             }
         }
 
-        void receive()
+        // the output is flushed once per read, not per message
+        void printMessage(const MessageView& message)
+        {
+            ++messagesReceived;
+
+            switch (config.outputFormat)
+            {
+                case Config::OutputFormat::TEXT:
+                    if (message.type == Message::Type::DIRECT || message.type == Message::Type::MULTICAST)
+                    {
+                        std::cout << message.nickname << " ->";
+                        for (const boost::string_ref& recipient : message.recipients) std::cout << ' ' << recipient;
+                        std::cout << ": " << message.body << '\n';
+                        break;
+                    }
+                    if (!message.channel.empty()) std::cout << "[" << message.channel << "] ";
+                    if (message.type == Message::Type::TEXT) std::cout << message.nickname << ": ";
+                    std::cout << message.body << '\n';
+                    break;
+                case Config::OutputFormat::RECORDS:
+                    printRecord(message);
+                    break;
+                case Config::OutputFormat::QUIET:
+                    break;
+            }
+        }
+
+        // a JSON object per line, the chunks without their bytes
+        void printRecord(const MessageView& message)
+        {
+            static const char* TYPES[] = {"login", "text", "status", "join", "part", "hello", "chunk", "deflate", "batch",
+                "peer", "claim", "release", "resume", "ping", "pong", "direct", "multicast", "error"};
+            size_t type = static_cast<size_t>(message.type);
+
+            std::string record = "{\"received\":" + std::to_string(receiveTime) + ",\"type\":\"" +
+                (type < sizeof(TYPES) / sizeof(TYPES[0]) ? TYPES[type] : "unknown") + "\"";
+            if (message.timestamp) record += ",\"timestamp\":" + std::to_string(message.timestamp);
+            if (!message.nickname.empty()) appendField(record, "nickname", message.nickname);
+            if (!message.channel.empty()) appendField(record, "channel", message.channel);
+
+            if (!message.recipients.empty())
+            {
+                record += ",\"recipients\":[";
+                for (size_t i = 0; i < message.recipients.size(); ++i)
+                {
+                    if (i) record += ',';
+                    appendString(record, message.recipients[i]);
+                }
+                record += ']';
+            }
+
+            if (message.type == Message::Type::CHUNK)
+            {
+                appendField(record, "name", message.name);
+                record += ",\"transfer\":" + std::to_string(message.transfer) +
+                    ",\"offset\":" + std::to_string(message.offset) +
+                    ",\"length\":" + std::to_string(message.body.size()) +
+                    ",\"size\":" + std::to_string(message.size);
+            }
+            else
+                appendField(record, "body", message.body);
+
+            record += "}\n";
+            std::cout << record;
+        }
+
+        static void appendField(std::string& record, const char* name, boost::string_ref value)
+        {
+            record += ",\"";
+            record += name;
+            record += "\":";
+            appendString(record, value);
+        }
+
+        static void appendString(std::string& record, boost::string_ref value)
         {
-            boost::asio::streambuf::mutable_buffers_type buffers = inputBuffer.prepare(BUFFER_SIZE);
+            record += '"';
 
-            socket.async_receive(buffers,
-                                [this](const boost::system::error_code& error, std::size_t bytesTransferred)
+            for (char c : value)
+            {
+                switch (c)
+                {
+                    case '"': record += "\\\""; break;
+                    case '\\': record += "\\\\"; break;
+                    case '\n': record += "\\n"; break;
+                    case '\r': record += "\\r"; break;
+                    case '\t': record += "\\t"; break;
+                    default:
+                        if (static_cast<unsigned char>(c) < 0x20)
+                        {
+                            char escaped[8];
+                            std::snprintf(escaped, sizeof(escaped), "\\u%04x", static_cast<unsigned>(c));
+                            record += escaped;
+                        }
+                        else
+                            record += c;
+                        break;
+                }
+            }
+
+            record += '"';
+        }
+
+        // notices about the transfers go to the text output, or to the log if it is not text
+        void printNotice(const std::string& notice)
+        {
+            if (config.outputFormat == Config::OutputFormat::TEXT)
+                std::cout << notice << '\n';
+            else
+                logger->info(notice);
+        }
+
+        // start sending the file in chunks, paced to the server's chunk rate
+        void sendFile(const std::string& path)
+        {
+            if (!varint)
+            {
+                logger->error("The server does not support file transfers");
+                return;
+            }
+
+            std::unique_ptr<Upload> upload(new Upload());
+            upload->file.open(path, std::ios::binary | std::ios::ate);
+            if (!upload->file)
+            {
+                logger->error("Failed to open {0}", path);
+                return;
+            }
+
+            upload->transfer = ++lastTransfer;
+            upload->size = static_cast<uint64_t>(upload->file.tellg());
+            if (upload->size == 0)
+            {
+                logger->error("{0} is empty", path);
+                return;
+            }
+
+            upload->file.seekg(0);
+            upload->name = path.substr(path.find_last_of('/') + 1);
+            upload->channel = currentChannel;
+
+            bool idle = uploads.empty();
+            uploads.push_back(std::move(upload));
+            if (idle) sendChunk();
+        }
+
+        void sendChunk()
+        {
+            Upload& upload = *uploads.front();
+
+            Message message;
+            message.type = Message::Type::CHUNK;
+            message.channel = upload.channel;
+            message.transfer = upload.transfer;
+            message.offset = upload.offset;
+            message.size = upload.size;
+            message.name = upload.name;
+            message.body.resize(static_cast<size_t>(std::min(static_cast<uint64_t>(CHUNK_SIZE), upload.size - upload.offset)));
+
+            if (!upload.file.read(&message.body[0], static_cast<std::streamsize>(message.body.size())))
+            {
+                logger->error("Failed to read {0}", upload.name);
+                uploads.pop_front();
+            }
+            else
+            {
+                sendMessage(message);
+                upload.offset += message.body.size();
+
+                if (upload.offset == upload.size)
+                {
+                    logger->info("Sent {0} ({1} bytes)", upload.name, upload.size);
+                    uploads.pop_front();
+                }
+            }
+
+            if (uploads.empty()) return;
+
+            // the typed messages go out between the chunks
+            uploadTimer.expires_from_now(boost::posix_time::microseconds(
+                chunkRate ? static_cast<int64_t>(CHUNK_SIZE * 1000000 / chunkRate) : 0));
+            uploadTimer.async_wait([this](const boost::system::error_code& error)
+            {
+                if (!error && socket.is_open()) sendChunk();
+            });
+        }
+
+        void receiveChunk(const MessageView& message)
+        {
+            std::string channelPrefix = message.channel.empty() ? "" : "[" + message.channel.to_string() + "] ";
+
+            if (config.downloadDirectory.empty())
+            {
+                if (message.offset == 0)
+                    printNotice(channelPrefix + message.nickname.to_string() + " is sending " + message.name.to_string() +
+                        " (" + std::to_string(message.size) + " bytes), start with --downloads to receive files");
+                return;
+            }
+
+            auto key = std::make_pair(message.nickname.to_string(), message.transfer);
+            auto i = downloads.find(key);
+
+            if (message.offset == 0)
+            {
+                // never write outside the download directory
+                std::string name = message.name.to_string();
+                name = name.substr(name.find_last_of('/') + 1);
+                if (name.empty() || name == "." || name == "..") name = "download";
+
+                std::unique_ptr<Download> download(new Download());
+                download->path = config.downloadDirectory + "/" + name;
+                download->size = message.size;
+                download->file.open(download->path, std::ios::binary | std::ios::trunc);
+                if (!download->file)
+                {
+                    logger->error("Failed to create {0}", download->path);
+                    return;
+                }
+
+                i = downloads.insert(std::make_pair(key, std::move(download))).first;
+            }
+            else if (i == downloads.end())
+                return; // started before the connection
+
+            Download& download = *i->second;
+
+            if (message.offset != download.offset)
+            {
+                printNotice(channelPrefix + "Transfer of " + download.path + " from " + message.nickname.to_string() +
+                    " is incomplete");
+                downloads.erase(i);
+                return;
+            }
+
+            download.file.write(message.body.data(), static_cast<std::streamsize>(message.body.size()));
+            download.offset += message.body.size();
+
+            if (download.offset == download.size)
+            {
+                download.file.close();
+                printNotice(channelPrefix + message.nickname.to_string() + " sent " + download.path + " (" +
+                    std::to_string(download.size) + " bytes)");
+                downloads.erase(i);
+            }
+        }
+
+        void receive(boost::asio::ip::tcp::endpoint endpoint)
+        {
+            socket.async_receive(decoder.prepare(),
+                                 [this, endpoint](const boost::system::error_code& error, std::size_t bytesTransferred)
             {
                 if (error != boost::asio::error::operation_aborted)
                 {
                     if (error)
                     {
+                        // a busy server closes the connection after telling when to try again
+                        if (retryAfter)
+                        {
+                            negotiating = false;
+                            socket.close();
+                            reconnect(endpoint, retryAfter);
+                            retryAfter = 0;
+                            return;
+                        }
+
+                        // servers without feature negotiation close every connection on the hello, a connection
+                        // dropped for any other reason before the reply is only retried
+                        if (negotiating)
+                        {
+                            negotiating = false;
+
+                            if (++helloRejections >= HELLO_ATTEMPTS)
+                            {
+                                logger->info("The server does not support feature negotiation");
+                                negotiate = false;
+                                socket.close();
+                                connect(endpoint);
+                                return;
+                            }
+                        }
+
                         logger->info("Disconnected");
-                        disconnect();
+
+                        // the headless input is all sent, or the login was rejected
+                        if ((inputEnded && std::none_of(outputQueue.begin(), outputQueue.end(), isInput)) || loginRejected)
+                        {
+                            disconnect();
+                            return;
+                        }
+
+                        // a connection that lasted starts the backoff over
+                        if (std::chrono::steady_clock::now() - connectTime >= std::chrono::milliseconds(RECONNECT_DELAY_MAX))
+                            reconnectAttempts = 0;
+
+                        socket.close();
+                        reconnect(endpoint, getReconnectDelay());
                         return;
                     }
                     else
                     {
-                        logger->info("Received {0} bytes", bytesTransferred);
+                        logger->trace("Received {0} bytes", bytesTransferred);
 
-                        inputBuffer.commit(bytesTransferred);
+                        decoder.commit(bytesTransferred);
+                        lastReceive = std::chrono::steady_clock::now();
+                        receiveTime = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+                            std::chrono::system_clock::now().time_since_epoch()).count());
 
-                        while (inputBuffer.size() >= sizeof(uint16_t))
+                        try
                         {
-                            std::istream inputStream(&inputBuffer);
-
-                            if (!lastMessageSize)
-                            {
-                                uint16_t messageSize;
-                                inputStream.read(reinterpret_cast<char*>(&messageSize), sizeof(messageSize));
-                                lastMessageSize = htons(messageSize);
-                            }
-
-                            if (lastMessageSize > BUFFER_SIZE ||
-                                inputBuffer.size() > BUFFER_SIZE)
-                            {
-                                logger->error("Buffer too big");
-                                disconnect();
-                                return;
-                            }
-
-                            if (inputBuffer.size() >= lastMessageSize)
-                            {
-                                try
-                                {
-                                    cereal::BinaryInputArchive archive(inputStream);
-                                    Message message;
-                                    archive(message);
-
-                                    handleMessage(message);
-
-                                    lastMessageSize = 0;
-                                }
-                                catch (const std::exception& e)
-                                {
-                                    logger->error(e.what());
-                                    disconnect();
-                                    return;
-                                }
-                            }
-                            else
-                                break;
+                            MessageView message;
+                            while (socket.is_open() && decoder.decode(message))
+                                handleMessage(message);
+                        }
+                        catch (const std::exception& e)
+                        {
+                            std::cout.flush();
+                            logger->error(e.what());
+                            disconnect();
+                            return;
                         }
 
-                        receive();
+                        std::cout.flush();
+
+                        if (socket.is_open()) receive(endpoint);
                     }
                 }
             });
@@ -224,32 +899,256 @@ namespace chat
 
                     commandLineBuffer.consume(length);
 
-                    Message message;
-                    message.type = Message::Type::TEXT;
-                    message.body = line;
+                    handleLine(line);
+                    readCommandLine();
+                }
+            });
+        }
 
-                    sendMessage(message);
+        // a command or a message to send, typed or read from the headless input
+        void handleLine(const std::string& line)
+        {
+            if (line.compare(0, 6, "/send ") == 0)
+            {
+                sendFile(line.substr(6));
+            }
+            else if (line.compare(0, 6, "/join ") == 0)
+            {
+                currentChannel = line.substr(6);
+                channels.insert(currentChannel);
+                sendChannelMessage(Message::Type::JOIN, currentChannel);
+            }
+            else if (line.compare(0, 5, "/msg ") == 0)
+            {
+                sendDirectMessage(line.substr(5));
+            }
+            else if (line.compare(0, 6, "/part ") == 0)
+            {
+                std::string channel = line.substr(6);
+                channels.erase(channel);
+                if (channel == currentChannel) currentChannel.clear();
+                sendChannelMessage(Message::Type::PART, channel);
+            }
+            else
+            {
+                Message message;
+                message.type = Message::Type::TEXT;
+                message.body = line;
+                message.channel = currentChannel;
 
-                    readCommandLine();
+                sendMessage(message);
+            }
+        }
+
+        // "nickname text" goes to a single client, "nickname,nickname,... text" to all of them in a single message
+        void sendDirectMessage(const std::string& arguments)
+        {
+            size_t separator = arguments.find(' ');
+            if (separator == std::string::npos || separator == 0)
+            {
+                logger->error("Usage: /msg nickname[,nickname...] text");
+                return;
+            }
+
+            // the recipients are a field of their own, which the original layout does not have
+            if (!channelFields)
+            {
+                logger->error("The server does not support direct messages");
+                return;
+            }
+
+            Message message;
+            message.body = arguments.substr(separator + 1);
+
+            std::istringstream recipients(arguments.substr(0, separator));
+            std::string recipient;
+            while (std::getline(recipients, recipient, ','))
+                if (!recipient.empty()) message.recipients.push_back(recipient);
+
+            if (message.recipients.empty())
+            {
+                logger->error("Usage: /msg nickname[,nickname...] text");
+                return;
+            }
+
+            message.type = message.recipients.size() == 1 ? Message::Type::DIRECT : Message::Type::MULTICAST;
+            sendMessage(message);
+        }
+
+        // regular files can not be waited on, they are read directly since they never block
+        void openInput()
+        {
+            int fd = (config.inputPath == "-") ? ::dup(STDIN_FILENO) : ::open(config.inputPath.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0) throw std::runtime_error("Failed to open " + config.inputPath);
+
+            struct stat status;
+            if (::fstat(fd, &status) == 0 && S_ISREG(status.st_mode))
+                inputFile = fd;
+            else
+                input.assign(fd);
+
+            inputBlock.resize(INPUT_BLOCK_SIZE);
+        }
+
+        // read the headless input a block at a time and send its lines, as long as the send window has room
+        void readInput()
+        {
+            while (!inputEnded)
+            {
+                if (outputQueue.size() >= config.sendWindow)
+                {
+                    // the write completion reads on
+                    inputPaused = true;
+                    return;
+                }
+
+                size_t newline = inputBuffer.find('\n', inputPosition);
+                if (newline != std::string::npos)
+                {
+                    handleLine(inputBuffer.substr(inputPosition, newline - inputPosition));
+                    inputPosition = newline + 1;
+                    continue;
+                }
+
+                // the incomplete line at the end waits for the next block
+                inputBuffer.erase(0, inputPosition);
+                inputPosition = 0;
+
+                if (inputFile == -1) break;
+
+                ssize_t size = ::read(inputFile, inputBlock.data(), inputBlock.size());
+                if (size < 0 && errno == EINTR) continue;
+
+                if (size <= 0)
+                {
+                    if (size < 0) logger->error("Failed to read the input: {0}", std::strerror(errno));
+                    endInput();
+                    return;
+                }
+
+                inputBuffer.append(inputBlock.data(), static_cast<size_t>(size));
+            }
+
+            if (inputEnded) return;
+
+            input.async_read_some(boost::asio::buffer(inputBlock),
+                                  [this](const boost::system::error_code& error, std::size_t length)
+            {
+                if (error == boost::asio::error::operation_aborted) return;
+
+                if (error)
+                {
+                    if (error != boost::asio::error::eof) logger->error("Failed to read the input: {0}", error.message());
+                    endInput();
+                    return;
                 }
+
+                inputBuffer.append(inputBlock.data(), length);
+                readInput();
             });
         }
 
+        void endInput()
+        {
+            inputEnded = true;
+
+            // the last line may lack its newline
+            if (inputPosition < inputBuffer.size()) handleLine(inputBuffer.substr(inputPosition));
+            inputBuffer.clear();
+            inputPosition = 0;
+
+            if (outputQueue.empty() && uploads.empty()) finishInput();
+        }
+
+        // everything is written, the server closes the connection once it has read it all
+        void finishInput()
+        {
+            logger->info("Input sent, waiting for the server to close the connection");
+
+            boost::system::error_code ignored;
+            socket.shutdown(boost::asio::ip::tcp::socket::shutdown_send, ignored);
+        }
+
         std::shared_ptr<spdlog::logger> logger;
         boost::asio::io_service& ioService;
         boost::asio::ip::tcp::socket socket;
 
-        uint16_t lastMessageSize = 0;
-        boost::asio::streambuf inputBuffer;
-        boost::asio::streambuf outputBuffer;
+        struct Upload
+        {
+            std::ifstream file;
+            uint64_t transfer = 0;
+            uint64_t offset = 0;
+            uint64_t size = 0;
+            std::string name;
+            std::string channel;
+        };
+
+        struct Download
+        {
+            std::ofstream file;
+            std::string path;
+            uint64_t offset = 0;
+            uint64_t size = 0;
+        };
+
+        FrameDecoder decoder{BUFFER_SIZE};
+        bool negotiate = true; // send a hello after connecting
+        bool negotiating = false; // waiting for the hello reply
+        size_t helloRejections = 0; // connections in a row closed before the hello reply
+        bool channelFields = false; // the messages have the channel and the timestamp
+        bool varint = false; // varint length prefixes, large messages and chunks
+        size_t maxFrameSize = BUFFER_SIZE;
+        size_t chunkRate = 0; // bytes a second the server reads chunks at, 0 for no limit
+        uint64_t retryAfter = 0; // milliseconds a busy server asked to wait before reconnecting
+        bool resumable = false; // session resume negotiated
+        bool resuming = false; // waiting for the resume reply
+        bool loginRejected = false; // on this connection, the client exits instead of reconnecting when it drops
+        std::string resumeToken; // of the session, empty until the server hands one out
+        size_t reconnectAttempts = 0; // since the last stable connection
+        std::chrono::steady_clock::time_point connectTime;
+        uint64_t heartbeatInterval = 0; // milliseconds, 0 if the server does not take heartbeats
+        std::chrono::steady_clock::time_point lastSend; // of the last write on this connection
+        std::chrono::steady_clock::time_point lastReceive; // of the last read on this connection
+        std::minstd_rand random;
 
         std::string nickname;
+        std::set<std::string> channels;
+        std::string currentChannel; // where the text goes, everyone if empty
+        uint64_t lastTimestamp = 0; // of the newest message received
+
+        Config config;
+        std::deque<std::unique_ptr<Upload>> uploads;
+        uint64_t lastTransfer = 0;
+        std::map<std::pair<std::string, uint64_t>, std::unique_ptr<Download>> downloads; // by sender and transfer
 
         boost::asio::posix::stream_descriptor commandLine;
         boost::asio::streambuf commandLineBuffer;
+        bool readingInput = false; // from the command line or the headless input, started with the first login
+
+        // headless input
+        boost::asio::posix::stream_descriptor input; // pipe or terminal
+        int inputFile = -1; // or regular file
+        std::vector<char> inputBlock;
+        std::string inputBuffer; // lines not sent yet
+        size_t inputPosition = 0; // of the first line not sent yet
+        bool inputPaused = false; // until the send window has room
+        bool inputEnded = false;
+
+        std::deque<OutputFrame> outputQueue;
+        std::vector<Message> unsentInput; // by the last connection, sent again after the next login
+        std::vector<boost::asio::const_buffer> outputBuffers;
+        size_t writingFrames = 0; // frames at the front of the queue that are being written
+        bool writing = false;
+        uint64_t connection = 0; // incremented on every connect, the writes of earlier connections are ignored
+
+        uint64_t receiveTime = 0; // microseconds since epoch of the last read
+        uint64_t messagesSent = 0;
+        uint64_t messagesReceived = 0;
 
         boost::asio::deadline_timer connectDeadlineTimer;
         boost::asio::deadline_timer reconnectDeadlineTimer;
+        boost::asio::deadline_timer uploadTimer;
+        boost::asio::deadline_timer heartbeatTimer;
 
         boost::asio::signal_set signals;
     };
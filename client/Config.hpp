@@ -0,0 +1,29 @@
+//
+//  Chat client
+//
+
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+namespace chat
+{
+    struct Config
+    {
+        // how the received messages are printed
+        enum class OutputFormat
+        {
+            TEXT, // "[channel] nickname: body" lines
+            RECORDS, // a JSON object per message with the time it was received
+            QUIET // nothing, only the totals once the client is done
+        };
+
+        std::string downloadDirectory; // received files are saved here, they are ignored if empty
+        OutputFormat outputFormat = OutputFormat::TEXT;
+
+        // headless mode, for bots and bulk senders
+        std::string inputPath; // file or pipe with a message (or command) per line, "-" for the standard input, interactive if empty
+        size_t sendWindow = 1024; // messages queued but not yet written, the input is read only below it
+    };
+}
@@ -2,6 +2,7 @@
 //  Chat client
 //
 
+#include <algorithm>
 #include <cstdlib>
 #include <iostream>
 #include <unordered_map>
@@ -20,6 +21,20 @@ int main(int argc, const char * argv[])
         args::ValueFlag<uint16_t> port(parser, "port", "Port number to connect to", {'p', "port"}, args::Options::Required);
         args::ValueFlag<std::string> nickname(parser, "nickname", "Nicname of the user", {'n', "nickname"}, args::Options::Required);
 
+        chat::Config config;
+
+        args::ValueFlag<std::string> downloads(parser, "directory", "Directory to save the received files to", {"downloads"});
+        args::ValueFlag<std::string> input(parser, "path", "Run headless, sending the lines of the file or pipe (- for the standard input)", {"input"});
+        args::ValueFlag<size_t> sendWindow(parser, "messages", "Messages queued but not yet written before the input is paused", {"window"}, config.sendWindow);
+
+        std::unordered_map<std::string, chat::Config::OutputFormat> outputFormats {
+            {"text", chat::Config::OutputFormat::TEXT},
+            {"records", chat::Config::OutputFormat::RECORDS},
+            {"quiet", chat::Config::OutputFormat::QUIET}
+        };
+
+        args::MapFlag<std::string, chat::Config::OutputFormat> outputFormat(parser, "format", "How the received messages are printed (text, records or quiet)", {"output"}, outputFormats, config.outputFormat);
+
         std::unordered_map<std::string, spdlog::level::level_enum> map {
             {"trace", spdlog::level::trace},
             {"debug", spdlog::level::debug},
@@ -65,12 +80,17 @@ int main(int argc, const char * argv[])
         {
             console->set_level(logLevel.Get());
 
+            config.downloadDirectory = downloads.Get();
+            config.inputPath = input.Get();
+            config.sendWindow = std::max(sendWindow.Get(), static_cast<size_t>(1));
+            config.outputFormat = outputFormat.Get();
+
             boost::asio::io_service ioService;
             boost::asio::ip::tcp::resolver resolver(ioService);
             boost::asio::ip::tcp::resolver::query query(address.Get(), std::to_string(port.Get()));
             auto endpointIterator = resolver.resolve(query);
 
-            chat::Client client(console, ioService, endpointIterator->endpoint(), nickname.Get());
+            chat::Client client(console, ioService, endpointIterator->endpoint(), nickname.Get(), config);
 
             ioService.run();
         }
@@ -0,0 +1,132 @@
+//
+//  Chat
+//
+
+#pragma once
+
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+#include <zlib.h>
+
+namespace chat
+{
+    // Preset dictionary of the strings chat traffic repeats: the server's status lines, bot notifications,
+    // common words and the zero bytes of the 64-bit string sizes. Deflate finds matches at the end of the
+    // dictionary cheapest, so the most frequent strings come last.
+    static const char COMPRESSION_DICTIONARY[] =
+        "https://github.com/ https://www. .com/ .org/ .html .png .jpg "
+        "error: warning: exception failed passed succeeded deployed released merged opened closed "
+        "pull request build #commit master main release version staging production "
+        "[bot] [ci] [alert] [deploy] resolved firing "
+        "thanks thank you please sorry yes no ok okay lol :) :D "
+        "what when where why how who can you could would should will just about this that with have from "
+        "I'm it's don't can't the and for are but not all any one our out you "
+        " disconnected due to inactivity Logged in with nickname  is unavailable"
+        " left # joined #"
+        "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0";
+
+    static const int COMPRESSION_LEVEL = 6;
+    // messages are small: a 2 KiB window holds the dictionary and a typical message, and the smaller
+    // tables are cheaper to reset for every message
+    static const int COMPRESSION_WINDOW_BITS = 11;
+    static const int COMPRESSION_MEMORY_LEVEL = 4;
+
+    // Raw deflate of a single payload with the preset dictionary. Every payload is compressed on its own,
+    // without a streaming context, so one compressed frame can be sent to all the recipients.
+    class Deflater final
+    {
+    public:
+        explicit Deflater(int level = COMPRESSION_LEVEL, bool dictionary = true):
+            useDictionary(dictionary)
+        {
+            if (deflateInit2(&stream, level, Z_DEFLATED, -COMPRESSION_WINDOW_BITS, COMPRESSION_MEMORY_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK)
+                throw std::runtime_error("Failed to initialize deflate");
+        }
+
+        ~Deflater()
+        {
+            deflateEnd(&stream);
+        }
+
+        Deflater(const Deflater&) = delete;
+        Deflater& operator=(const Deflater&) = delete;
+
+        // appends the compressed bytes to the output, returns false if they would not be smaller
+        bool compress(const uint8_t* input, size_t size, std::vector<uint8_t>& output)
+        {
+            deflateReset(&stream);
+            if (useDictionary)
+                deflateSetDictionary(&stream, reinterpret_cast<const Bytef*>(COMPRESSION_DICTIONARY),
+                                     sizeof(COMPRESSION_DICTIONARY) - 1);
+
+            size_t offset = output.size();
+            output.resize(offset + size);
+
+            stream.next_in = const_cast<Bytef*>(input);
+            stream.avail_in = static_cast<uInt>(size);
+            stream.next_out = output.data() + offset;
+            stream.avail_out = static_cast<uInt>(size);
+
+            // running out of output space means the compressed bytes are not smaller
+            if (deflate(&stream, Z_FINISH) != Z_STREAM_END)
+            {
+                output.resize(offset);
+                return false;
+            }
+
+            output.resize(offset + stream.total_out);
+            return true;
+        }
+
+    private:
+        z_stream stream = z_stream();
+        bool useDictionary;
+    };
+
+    class Inflater final
+    {
+    public:
+        explicit Inflater(bool dictionary = true):
+            useDictionary(dictionary)
+        {
+            if (inflateInit2(&stream, -COMPRESSION_WINDOW_BITS) != Z_OK)
+                throw std::runtime_error("Failed to initialize inflate");
+        }
+
+        ~Inflater()
+        {
+            inflateEnd(&stream);
+        }
+
+        Inflater(const Inflater&) = delete;
+        Inflater& operator=(const Inflater&) = delete;
+
+        // decompresses into the start of the output and returns the size, at most maxSize
+        size_t decompress(const uint8_t* input, size_t size, std::vector<char>& output, size_t maxSize)
+        {
+            inflateReset(&stream);
+            if (useDictionary)
+                inflateSetDictionary(&stream, reinterpret_cast<const Bytef*>(COMPRESSION_DICTIONARY),
+                                     sizeof(COMPRESSION_DICTIONARY) - 1);
+
+            // one more byte than allowed tells a too large payload from one of exactly maxSize
+            if (output.size() < maxSize + 1) output.resize(maxSize + 1);
+
+            stream.next_in = const_cast<Bytef*>(input);
+            stream.avail_in = static_cast<uInt>(size);
+            stream.next_out = reinterpret_cast<Bytef*>(output.data());
+            stream.avail_out = static_cast<uInt>(maxSize + 1);
+
+            int result = inflate(&stream, Z_FINISH);
+            if (result != Z_STREAM_END)
+                throw std::runtime_error(stream.avail_out == 0 ? "Buffer too big" : "Invalid compressed frame");
+
+            return stream.total_out;
+        }
+
+    private:
+        z_stream stream = z_stream();
+        bool useDictionary;
+    };
+}
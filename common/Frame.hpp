@@ -0,0 +1,217 @@
+//
+//  Chat
+//
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+#include <boost/asio/buffer.hpp>
+#include "Compression.hpp"
+#include "Message.hpp"
+#include "MessageCodec.hpp"
+
+namespace chat
+{
+    class Frame;
+    typedef std::shared_ptr<const Frame> FramePtr;
+
+    // Immutable wire frame (16-bit big endian length prefix followed by the payload).
+    // Frames are encoded once and shared between all the recipients of a message. Connections that
+    // negotiated the varint feature replace the prefix with a varint one when the frame is written,
+    // which also allows payloads that do not fit in 16 bits. Connections without the channels feature
+    // get the frame in the original layout instead.
+    class Frame final
+    {
+    public:
+        static const size_t HEADER_SIZE = sizeof(uint16_t);
+        static const size_t MAX_VARINT_HEADER_SIZE = 5; // 32-bit sizes
+        static const size_t MAX_PAYLOAD_SIZE = 16 * 1024 * 1024;
+
+        explicit Frame(const Message& message)
+        {
+            encode(message);
+        }
+
+        // encodes the views' bytes straight into the frame (e.g. relayed chunks)
+        explicit Frame(const MessageView& message)
+        {
+            encode(message);
+        }
+
+        // BATCH frame of the frames' payloads: the type byte, the 64-bit count, then every payload after
+        // its 64-bit size. The frames are kept for the connections without the batch feature.
+        explicit Frame(std::vector<FramePtr> frames):
+            parts(std::move(frames))
+        {
+            size_t payloadSize = sizeof(uint8_t) + sizeof(uint64_t);
+            for (const FramePtr& part : parts)
+                payloadSize += sizeof(uint64_t) + part->getPayloadSize();
+
+            if (payloadSize > MAX_PAYLOAD_SIZE)
+                throw std::runtime_error("Message too big");
+
+            data.resize(HEADER_SIZE + payloadSize);
+            writeHeader(payloadSize);
+
+            uint8_t* output = data.data() + HEADER_SIZE;
+            *output++ = static_cast<uint8_t>(Message::Type::BATCH);
+            output = writeSize(output, parts.size());
+
+            for (const FramePtr& part : parts)
+            {
+                output = writeSize(output, part->getPayloadSize());
+                output = std::copy(part->getPayload(), part->getPayload() + part->getPayloadSize(), output);
+            }
+        }
+
+        // frame of an already encoded payload (e.g. read back from the message log)
+        Frame(const uint8_t* payload, size_t payloadSize):
+            data(HEADER_SIZE + payloadSize)
+        {
+            if (payloadSize > MAX_PAYLOAD_SIZE)
+                throw std::runtime_error("Message too big");
+
+            writeHeader(payloadSize);
+            std::copy(payload, payload + payloadSize, data.begin() + HEADER_SIZE);
+        }
+
+        // writes the varint length prefix (7 bits a byte, least significant first) and returns its size
+        static size_t encodeVarintHeader(size_t payloadSize, uint8_t* output)
+        {
+            size_t size = 0;
+            while (payloadSize >= 0x80)
+            {
+                output[size++] = static_cast<uint8_t>(payloadSize) | 0x80;
+                payloadSize >>= 7;
+            }
+            output[size++] = static_cast<uint8_t>(payloadSize);
+
+            return size;
+        }
+
+        Frame(const Frame&) = delete;
+        Frame& operator=(const Frame&) = delete;
+
+        inline const uint8_t* getData() const { return data.data(); }
+        inline size_t getSize() const { return data.size(); }
+
+        inline const uint8_t* getPayload() const { return data.data() + HEADER_SIZE; }
+        inline size_t getPayloadSize() const { return data.size() - HEADER_SIZE; }
+
+        inline Message::Type getType() const { return static_cast<Message::Type>(data[HEADER_SIZE]); }
+
+        // the frames of a batch
+        inline const std::vector<FramePtr>& getParts() const { return parts; }
+
+        // the 16-bit prefix holds the size, so the frame can go to connections without the varint feature
+        inline bool hasLegacyHeader() const { return getPayloadSize() <= UINT16_MAX; }
+
+        // the DEFLATE frame of the payload, compressed by the first connection that asks for it and shared
+        // by all the others, null if compressing does not make it smaller
+        const Frame* getCompressed() const
+        {
+            std::call_once(compressOnce, [this]()
+            {
+                // deflate streams are large to set up, so every thread keeps one
+                static thread_local Deflater deflater;
+                static thread_local std::vector<uint8_t> payload;
+
+                payload.assign(1, static_cast<uint8_t>(Message::Type::DEFLATE));
+                if (deflater.compress(getPayload(), getPayloadSize(), payload) && payload.size() < getPayloadSize())
+                    compressed.reset(new Frame(payload.data(), payload.size()));
+            });
+
+            return compressed.get();
+        }
+
+        // the frame in the original layout (without the channel and the timestamp), encoded by the first
+        // connection that asks for it and shared by all the others, null for the types the connections
+        // in that layout do not know (they close the connection on them)
+        FramePtr getBasicFrame() const
+        {
+            std::call_once(basicOnce, [this]()
+            {
+                if (!isBasicType(getType())) return;
+
+                MessageView message;
+                MessageCodec::decode(reinterpret_cast<const char*>(getPayload()), getPayloadSize(), message);
+
+                std::shared_ptr<Frame> frame(new Frame());
+                frame->encode(message, MessageCodec::Layout::BASIC);
+                basic = std::move(frame);
+            });
+
+            return basic;
+        }
+
+        inline boost::asio::const_buffer buffer() const
+        {
+            return boost::asio::buffer(data);
+        }
+
+    private:
+        Frame() = default;
+
+        // the original types, and the ones of the feature negotiation that come before the layout switches
+        // or without it
+        static bool isBasicType(Message::Type type)
+        {
+            switch (type)
+            {
+                case Message::Type::LOGIN:
+                case Message::Type::TEXT:
+                case Message::Type::STATUS:
+                case Message::Type::HELLO:
+                case Message::Type::PING:
+                case Message::Type::PONG:
+                    return true;
+                default:
+                    return false;
+            }
+        }
+
+        template <class M>
+        void encode(const M& message, MessageCodec::Layout layout = MessageCodec::Layout::CHANNELS)
+        {
+            size_t payloadSize = MessageCodec::getEncodedSize(message, layout);
+            if (payloadSize > MAX_PAYLOAD_SIZE)
+                throw std::runtime_error("Message too big");
+
+            data.resize(HEADER_SIZE + payloadSize);
+            writeHeader(payloadSize);
+            MessageCodec::encode(message, data.data() + HEADER_SIZE, layout);
+        }
+
+        static uint8_t* writeSize(uint8_t* output, size_t size)
+        {
+            uint64_t value = size; // native byte order, like the message strings
+            std::memcpy(output, &value, sizeof(value));
+            return output + sizeof(value);
+        }
+
+        // larger payloads keep a zero prefix, they are only written with the varint one
+        void writeHeader(size_t payloadSize)
+        {
+            if (payloadSize > UINT16_MAX) payloadSize = 0;
+
+            data[0] = static_cast<uint8_t>(payloadSize >> 8);
+            data[1] = static_cast<uint8_t>(payloadSize);
+        }
+
+        std::vector<uint8_t> data;
+        std::vector<FramePtr> parts;
+
+        mutable std::once_flag compressOnce;
+        mutable std::unique_ptr<const Frame> compressed;
+
+        mutable std::once_flag basicOnce;
+        mutable FramePtr basic;
+    };
+
+}
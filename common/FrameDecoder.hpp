@@ -0,0 +1,297 @@
+//
+//  Chat
+//
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <boost/asio/buffer.hpp>
+#include "Compression.hpp"
+#include "Frame.hpp"
+#include "Message.hpp"
+#include "MessageCodec.hpp"
+
+namespace chat
+{
+    // Splits the received bytes into frames and decodes them in place without copying.
+    // The bytes are kept in a contiguous buffer, and only the tail of an incomplete frame is ever moved
+    // back to its start. Views returned by decode stay valid until the next call to decode, prepare or append.
+    // The buffer is allocated on the first receive, or lent by the owner and given back once everything
+    // received is decoded. It grows only while a frame larger than it is being received.
+    // Compressed frames are inflated into a separate buffer and decoded from there, and the messages
+    // of a batch are returned one by one.
+    class FrameDecoder final
+    {
+    public:
+        static const size_t HEADER_SIZE = sizeof(uint16_t);
+
+        explicit FrameDecoder(size_t maxSize):
+            maxFrameSize(maxSize),
+            initialSize(2 * (HEADER_SIZE + maxSize))
+        {
+        }
+
+        // switch to varint length prefixes, frames up to maxSize (the buffer grows to fit them)
+        void setVarint(size_t maxSize)
+        {
+            varint = true;
+            maxFrameSize = maxSize;
+        }
+
+        // decode the messages in the layout (the original one until the channels feature is negotiated)
+        void setLayout(MessageCodec::Layout newLayout)
+        {
+            layout = newLayout;
+        }
+
+        // accept DEFLATE frames
+        void setInflate()
+        {
+            inflater.reset(new Inflater());
+        }
+
+        // true while received bytes wait to be decoded (in the buffer or in a batch)
+        inline bool isPending() const
+        {
+            return readPosition != writePosition || batchPosition != batchEnd;
+        }
+
+        // true while the messages of a batch are being returned
+        inline bool isDecodingBatch() const
+        {
+            return batchPosition != batchEnd;
+        }
+
+        // the received bytes not decoded yet, from the start of a frame unless a batch is being decoded
+        std::string getPending() const
+        {
+            if (readPosition == writePosition) return std::string();
+            return std::string(buffer.data() + readPosition, writePosition - readPosition);
+        }
+
+        inline bool hasBuffer() const
+        {
+            return !buffer.empty();
+        }
+
+        // bytes of the buffers held
+        inline size_t getBufferSize() const
+        {
+            return buffer.capacity() + inflated.capacity();
+        }
+
+        // lend a buffer to receive into, used if the decoder holds none
+        void provideBuffer(std::vector<char>& spare)
+        {
+            if (hasBuffer()) return;
+
+            buffer.swap(spare);
+            if (buffer.size() < initialSize) buffer.resize(initialSize);
+        }
+
+        // give the buffer back once everything received is decoded, returns false while bytes are pending
+        bool releaseBuffer(std::vector<char>& spare)
+        {
+            if (!hasBuffer() || isPending()) return false;
+
+            compact(); // shrinks the buffer of a large frame
+            spare.swap(buffer);
+            std::vector<char>().swap(buffer);
+            return true;
+        }
+
+        // returns the free space at the end of the buffer to receive into
+        boost::asio::mutable_buffers_1 prepare()
+        {
+            batchPosition = batchEnd = nullptr; // the messages of a batch are all decoded before receiving more
+
+            compact();
+
+            // twice the frame, like the initial buffer, so compacting always leaves room for it
+            if (buffer.size() < std::max(requiredSize, initialSize)) buffer.resize(std::max(requiredSize, initialSize));
+
+            return boost::asio::buffer(buffer.data() + writePosition, buffer.size() - writePosition);
+        }
+
+        // copies bytes received into memory the decoder does not own, which can arrive while the
+        // messages decoded before are still pending, so the buffer grows to take them all
+        void append(const char* data, size_t size)
+        {
+            // a batch still being decoded points into the buffer
+            bool batchPending = batchPosition != batchEnd;
+            if (!batchPending) compact();
+
+            size_t required = std::max(std::max(requiredSize, initialSize), writePosition + size);
+            if (buffer.size() < required)
+            {
+                const char* previous = buffer.data();
+                buffer.resize(required);
+
+                if (batchPending && batchPosition >= previous && batchPosition < previous + writePosition)
+                {
+                    batchPosition = buffer.data() + (batchPosition - previous);
+                    batchEnd = buffer.data() + (batchEnd - previous);
+                }
+            }
+
+            std::memcpy(buffer.data() + writePosition, data, size);
+            writePosition += size;
+        }
+
+        void commit(size_t size)
+        {
+            writePosition += size;
+        }
+
+        // decodes the next complete frame, returns false if more data is needed
+        bool decode(MessageView& message)
+        {
+            if (batchPosition != batchEnd) return decodeBatched(message);
+
+            requiredSize = 0;
+
+            size_t available = writePosition - readPosition;
+            const uint8_t* frame = reinterpret_cast<const uint8_t*>(buffer.data() + readPosition);
+            size_t headerSize;
+            size_t frameSize;
+
+            if (varint)
+            {
+                if (!decodeVarint(frame, available, headerSize, frameSize)) return false;
+            }
+            else
+            {
+                if (available < HEADER_SIZE) return false;
+
+                headerSize = HEADER_SIZE;
+                frameSize = static_cast<size_t>(frame[0] << 8 | frame[1]);
+            }
+
+            if (frameSize > maxFrameSize)
+                throw std::runtime_error("Buffer too big");
+
+            if (available < headerSize + frameSize)
+            {
+                requiredSize = 2 * (headerSize + frameSize);
+                return false;
+            }
+
+            const char* payload = buffer.data() + readPosition + headerSize;
+            readPosition += headerSize + frameSize;
+
+            if (inflater && frameSize && static_cast<Message::Type>(payload[0]) == Message::Type::DEFLATE)
+            {
+                frameSize = inflater->decompress(reinterpret_cast<const uint8_t*>(payload) + 1, frameSize - 1,
+                                                 inflated, maxFrameSize);
+                payload = inflated.data();
+            }
+
+            if (frameSize && static_cast<Message::Type>(payload[0]) == Message::Type::BATCH)
+            {
+                uint64_t count;
+                if (frameSize < sizeof(uint8_t) + sizeof(count))
+                    throw std::runtime_error("Frame truncated");
+
+                std::memcpy(&count, payload + sizeof(uint8_t), sizeof(count));
+                if (count == 0)
+                    throw std::runtime_error("Empty batch");
+
+                batchPosition = payload + sizeof(uint8_t) + sizeof(count);
+                batchEnd = payload + frameSize;
+                return decodeBatched(message);
+            }
+
+            MessageCodec::decode(payload, frameSize, message, layout);
+
+            return true;
+        }
+
+    private:
+        // the next message of the batch being decoded
+        bool decodeBatched(MessageView& message)
+        {
+            uint64_t size;
+            if (static_cast<size_t>(batchEnd - batchPosition) < sizeof(size))
+                throw std::runtime_error("Frame truncated");
+
+            std::memcpy(&size, batchPosition, sizeof(size));
+            batchPosition += sizeof(size);
+
+            if (static_cast<uint64_t>(batchEnd - batchPosition) < size || size == 0)
+                throw std::runtime_error("Frame truncated");
+
+            const char* payload = batchPosition;
+            batchPosition += size;
+
+            // batches are not nested
+            if (static_cast<Message::Type>(payload[0]) == Message::Type::BATCH)
+                throw std::runtime_error("Invalid batch");
+
+            MessageCodec::decode(payload, static_cast<size_t>(size), message, layout);
+            return true;
+        }
+
+        // moves the tail of an incomplete frame back to the start of the buffer
+        void compact()
+        {
+            if (readPosition == writePosition)
+            {
+                readPosition = writePosition = 0;
+
+                // give back the memory of a large frame
+                if (buffer.size() > initialSize)
+                {
+                    buffer.resize(initialSize);
+                    buffer.shrink_to_fit();
+                }
+            }
+            else if (buffer.size() - writePosition < buffer.size() / 2 || buffer.size() < requiredSize)
+            {
+                std::memmove(buffer.data(), buffer.data() + readPosition, writePosition - readPosition);
+                writePosition -= readPosition;
+                readPosition = 0;
+            }
+        }
+
+        static bool decodeVarint(const uint8_t* data, size_t available, size_t& headerSize, size_t& value)
+        {
+            value = 0;
+
+            for (headerSize = 0; headerSize < available; )
+            {
+                uint8_t byte = data[headerSize];
+                value |= static_cast<size_t>(byte & 0x7F) << (7 * headerSize);
+                ++headerSize;
+
+                if (!(byte & 0x80)) return true;
+
+                if (headerSize == Frame::MAX_VARINT_HEADER_SIZE)
+                    throw std::runtime_error("Invalid frame size");
+            }
+
+            return false;
+        }
+
+        size_t maxFrameSize;
+        size_t initialSize;
+        std::vector<char> buffer;
+        size_t readPosition = 0;
+        size_t writePosition = 0;
+        size_t requiredSize = 0; // buffer size needed for the incomplete frame
+        bool varint = false;
+        MessageCodec::Layout layout = MessageCodec::Layout::CHANNELS;
+
+        std::unique_ptr<Inflater> inflater;
+        std::vector<char> inflated;
+
+        // the rest of the batch being decoded, in the receive buffer or the inflated one
+        const char* batchPosition = nullptr;
+        const char* batchEnd = nullptr;
+    };
+}
@@ -0,0 +1,111 @@
+//
+//  Chat
+//
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+namespace chat
+{
+    // Log-linear histogram of non-negative values (HDR style). Every power of two range is split into
+    // 64 buckets, so a recorded value is off by at most 1/64 and recording is a couple of instructions.
+    class Histogram final
+    {
+    public:
+        static const unsigned SUB_BUCKET_BITS = 6;
+        static const uint64_t SUB_BUCKET_COUNT = 1 << SUB_BUCKET_BITS;
+
+        Histogram():
+            counts((64 - SUB_BUCKET_BITS + 1) * SUB_BUCKET_COUNT)
+        {
+        }
+
+        void record(uint64_t value)
+        {
+            ++counts[getIndex(value)];
+            ++count;
+            sum += value;
+            minimum = std::min(minimum, value);
+            maximum = std::max(maximum, value);
+        }
+
+        void merge(const Histogram& other)
+        {
+            for (size_t i = 0; i < counts.size(); ++i)
+                counts[i] += other.counts[i];
+
+            count += other.count;
+            sum += other.sum;
+            minimum = std::min(minimum, other.minimum);
+            maximum = std::max(maximum, other.maximum);
+        }
+
+        void reset()
+        {
+            std::fill(counts.begin(), counts.end(), 0);
+            count = sum = maximum = 0;
+            minimum = UINT64_MAX;
+        }
+
+        inline uint64_t getCount() const { return count; }
+        inline uint64_t getSum() const { return sum; }
+        inline uint64_t getMin() const { return count ? minimum : 0; }
+        inline uint64_t getMax() const { return maximum; }
+        inline double getMean() const { return count ? static_cast<double>(sum) / count : 0.0; }
+
+        // value below which the given fraction (0 to 1) of the recorded values are
+        uint64_t getPercentile(double fraction) const
+        {
+            if (!count) return 0;
+
+            uint64_t target = static_cast<uint64_t>(fraction * count + 0.5);
+            if (target < 1) target = 1;
+
+            uint64_t seen = 0;
+            for (size_t i = 0; i < counts.size(); ++i)
+            {
+                seen += counts[i];
+                if (seen >= target) return std::min(getUpperBound(i), maximum);
+            }
+
+            return maximum;
+        }
+
+        // number of values less than or equal to the bound
+        uint64_t getCountBelow(uint64_t bound) const
+        {
+            uint64_t result = 0;
+            for (size_t i = 0; i < counts.size() && getUpperBound(i) <= bound; ++i)
+                result += counts[i];
+
+            return result;
+        }
+
+    private:
+        static size_t getIndex(uint64_t value)
+        {
+            if (value < SUB_BUCKET_COUNT) return static_cast<size_t>(value);
+
+            unsigned shift = 63 - static_cast<unsigned>(__builtin_clzll(value)) - SUB_BUCKET_BITS;
+            return static_cast<size_t>(shift * SUB_BUCKET_COUNT + (value >> shift));
+        }
+
+        static uint64_t getUpperBound(size_t index)
+        {
+            if (index < SUB_BUCKET_COUNT * 2) return index;
+
+            unsigned shift = static_cast<unsigned>(index / SUB_BUCKET_COUNT) - 1;
+            uint64_t subBucket = index % SUB_BUCKET_COUNT + SUB_BUCKET_COUNT;
+            return ((subBucket + 1) << shift) - 1;
+        }
+
+        std::vector<uint64_t> counts;
+        uint64_t count = 0;
+        uint64_t sum = 0;
+        uint64_t minimum = UINT64_MAX;
+        uint64_t maximum = 0;
+    };
+}
@@ -0,0 +1,117 @@
+//
+//  Chat
+//
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include "spdlog/spdlog.h"
+#if defined(SPDLOG_VER_MAJOR) && SPDLOG_VER_MAJOR >= 1
+#include "spdlog/async.h"
+#include "spdlog/sinks/stdout_color_sinks.h"
+#endif
+
+// Log call sites below this level are compiled out (0 trace, 1 debug, 2 info)
+#ifndef CHAT_LOG_LEVEL
+#define CHAT_LOG_LEVEL 2
+#endif
+
+#if CHAT_LOG_LEVEL <= 0
+#define CHAT_LOG_TRACE(logger, ...) (logger)->trace(__VA_ARGS__)
+#else
+#define CHAT_LOG_TRACE(logger, ...) (void)0
+#endif
+
+#if CHAT_LOG_LEVEL <= 1
+#define CHAT_LOG_DEBUG(logger, ...) (logger)->debug(__VA_ARGS__)
+#else
+#define CHAT_LOG_DEBUG(logger, ...) (void)0
+#endif
+
+// Logs at most perSecond lines a second from this call site and reports how many were suppressed,
+// the arguments are not evaluated for suppressed lines
+#define CHAT_LOG_LIMITED(logger, level, perSecond, ...) \
+    do \
+    { \
+        if ((logger)->should_log(level)) \
+        { \
+            static chat::LogRateLimit logRateLimit(perSecond); \
+            uint64_t logSuppressed; \
+            if (logRateLimit.allow(logSuppressed)) \
+            { \
+                if (logSuppressed) (logger)->log(level, "{0} similar lines suppressed", logSuppressed); \
+                (logger)->log(level, __VA_ARGS__); \
+            } \
+        } \
+    } \
+    while (false)
+
+namespace chat
+{
+    // Lines allowed per second for one call site, shared by all the threads
+    class LogRateLimit final
+    {
+    public:
+        explicit LogRateLimit(uint32_t perSecond): limit(perSecond) {}
+
+        LogRateLimit(const LogRateLimit&) = delete;
+        LogRateLimit& operator=(const LogRateLimit&) = delete;
+
+        // suppressed is set to the number of lines dropped since the last allowed one
+        bool allow(uint64_t& suppressed)
+        {
+            uint64_t now = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::seconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count());
+
+            uint64_t start = windowStart.load(std::memory_order_relaxed);
+            if (now != start && windowStart.compare_exchange_strong(start, now, std::memory_order_relaxed))
+                count.store(0, std::memory_order_relaxed);
+
+            if (count.fetch_add(1, std::memory_order_relaxed) < limit)
+            {
+                suppressed = dropped.exchange(0, std::memory_order_relaxed);
+                return true;
+            }
+
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+
+    private:
+        uint32_t limit;
+        std::atomic<uint64_t> windowStart{0};
+        std::atomic<uint32_t> count{0};
+        std::atomic<uint64_t> dropped{0};
+    };
+
+    // Console logger, with async set the lines are formatted and written by a background thread
+    // and dropped when its queue is full, so logging never blocks the caller
+    inline std::shared_ptr<spdlog::logger> createConsoleLogger(const std::string& name, bool async, size_t queueSize)
+    {
+#if defined(SPDLOG_VER_MAJOR) && SPDLOG_VER_MAJOR >= 1
+        if (async)
+        {
+            spdlog::init_thread_pool(queueSize, 1);
+            return spdlog::create_async_nb<spdlog::sinks::stdout_color_sink_mt>(name);
+        }
+#else
+        if (async) spdlog::set_async_mode(queueSize, spdlog::async_overflow_policy::discard_log_msg);
+#endif
+
+        return spdlog::stdout_color_mt(name);
+    }
+
+    // writes out the queued lines of the async loggers
+    inline void shutdownLogging()
+    {
+#if defined(SPDLOG_VER_MAJOR) && SPDLOG_VER_MAJOR >= 1
+        spdlog::shutdown();
+#else
+        spdlog::drop_all();
+#endif
+    }
+}
@@ -4,8 +4,12 @@
 
 #pragma once
 
+#include <cstdint>
 #include <string>
+#include <vector>
+#include <boost/utility/string_ref.hpp>
 #include "cereal/types/string.hpp"
+#include "cereal/types/vector.hpp"
 
 namespace chat
 {
@@ -13,19 +17,78 @@ namespace chat
     {
         enum class Type: uint8_t
         {
-            LOGIN,
+            LOGIN, // the server's reply names the nickname only if the login was accepted
             TEXT,
-            STATUS
+            STATUS,
+            JOIN,
+            PART,
+            HELLO, // features requested by the client (space separated), the reply lists the accepted ones
+            CHUNK, // slice of a transfer, only after the varint feature is negotiated
+            DEFLATE, // payload of another message compressed with the preset dictionary, only after the deflate feature is negotiated
+            BATCH, // payloads of several messages, only after the batch feature is negotiated
+            PEER, // server-to-server link handshake with the server's name as the nickname and the cluster's secret as the body
+            CLAIM, // server-to-server nickname claim, the reply's body is "accepted" or "rejected"
+            RELEASE, // server-to-server release of a claimed nickname
+            RESUME, // session resume, only after the resume feature is negotiated: the client's request has the session's token and the last timestamp seen, the server's reply (and the message after a login) the token, empty if there is no session to resume
+            PING, // heartbeat of an idle connection, only after the heartbeat feature is negotiated
+            PONG, // reply to a PING
+            DIRECT, // text to a single client, the only one of the recipients
+            MULTICAST, // text to all the recipients
+            ERROR // the server's reply to a message it could not carry out, with the reason as the body (and the channel the message was for, if any, as the channel)
         };
 
         Type type;
         std::string nickname;
         std::string body;
+        std::string channel; // empty for messages to everyone
+        uint64_t timestamp = 0; // milliseconds since epoch, unique per server (the last one seen for LOGIN, JOIN and RESUME, the request id for CLAIM, the milliseconds to wait before retrying in the LOGIN reply of a busy server)
+
+        // chunks only, the body holds the slice's bytes
+        uint64_t transfer = 0; // identifies the transfer among the sender's ones
+        uint64_t offset = 0; // of the slice in the transferred data
+        uint64_t size = 0; // of all the transferred data
+        std::string name; // of the transferred file
+
+        // direct and multicast messages only
+        std::vector<std::string> recipients; // nicknames
 
         template <class Archive>
         void serialize(Archive& archive)
         {
-            archive(type, nickname, body);
+            archive(type, nickname, body, channel, timestamp);
+            if (type == Type::CHUNK) archive(transfer, offset, size, name);
+            if (type == Type::DIRECT || type == Type::MULTICAST) archive(recipients);
+        }
+    };
+
+    // Message decoded in place, the strings point into the receive buffer
+    struct MessageView
+    {
+        Message::Type type;
+        boost::string_ref nickname;
+        boost::string_ref body;
+        boost::string_ref channel;
+        uint64_t timestamp = 0;
+        uint64_t transfer = 0;
+        uint64_t offset = 0;
+        uint64_t size = 0;
+        boost::string_ref name;
+        std::vector<boost::string_ref> recipients;
+
+        Message toMessage() const
+        {
+            Message message;
+            message.type = type;
+            message.nickname = nickname.to_string();
+            message.body = body.to_string();
+            message.channel = channel.to_string();
+            message.timestamp = timestamp;
+            message.transfer = transfer;
+            message.offset = offset;
+            message.size = size;
+            message.name = name.to_string();
+            for (const boost::string_ref& recipient : recipients) message.recipients.push_back(recipient.to_string());
+            return message;
         }
     };
 }
@@ -0,0 +1,185 @@
+//
+//  Chat
+//
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include "Message.hpp"
+
+namespace chat
+{
+    // Encodes and decodes messages without streams or archives, in exactly the layout cereal's binary
+    // archive produces for Message::serialize: the type byte at offset 0, then every string as a 64-bit
+    // size followed by its bytes, then the timestamp (all in native byte order). Chunks are followed
+    // by their transfer fields, direct and multicast messages by the number of their recipients (64-bit)
+    // and the recipients. Messages and message views are encoded alike.
+    // Connections that have not negotiated the channels feature use the original layout, which ends
+    // after the body.
+    class MessageCodec final
+    {
+    public:
+        enum class Layout
+        {
+            BASIC, // the type, the nickname and the body
+            CHANNELS // all the fields, after the channels feature is negotiated
+        };
+
+        template <class M>
+        static size_t getEncodedSize(const M& message, Layout layout = Layout::CHANNELS)
+        {
+            size_t size = sizeof(uint8_t) +
+                sizeof(uint64_t) + message.nickname.size() +
+                sizeof(uint64_t) + message.body.size();
+
+            if (layout == Layout::BASIC) return size;
+
+            size += sizeof(uint64_t) + message.channel.size() +
+                sizeof(uint64_t);
+
+            if (message.type == Message::Type::CHUNK)
+                size += 3 * sizeof(uint64_t) + sizeof(uint64_t) + message.name.size();
+
+            if (hasRecipients(message.type))
+            {
+                size += sizeof(uint64_t);
+                for (const auto& recipient : message.recipients)
+                    size += sizeof(uint64_t) + recipient.size();
+            }
+
+            return size;
+        }
+
+        // writes getEncodedSize bytes to the output and returns the end of them
+        template <class M>
+        static uint8_t* encode(const M& message, uint8_t* output, Layout layout = Layout::CHANNELS)
+        {
+            *output++ = static_cast<uint8_t>(message.type);
+            output = writeString(output, message.nickname);
+            output = writeString(output, message.body);
+
+            if (layout == Layout::BASIC) return output;
+
+            output = writeString(output, message.channel);
+            output = writeValue(output, message.timestamp);
+
+            if (message.type == Message::Type::CHUNK)
+            {
+                output = writeValue(output, message.transfer);
+                output = writeValue(output, message.offset);
+                output = writeValue(output, message.size);
+                output = writeString(output, message.name);
+            }
+
+            if (hasRecipients(message.type))
+            {
+                output = writeValue(output, static_cast<uint64_t>(message.recipients.size()));
+                for (const auto& recipient : message.recipients)
+                    output = writeString(output, recipient);
+            }
+
+            return output;
+        }
+
+        // the views point into the payload
+        static void decode(const char* payload, size_t size, MessageView& message, Layout layout = Layout::CHANNELS)
+        {
+            const char* position = payload;
+            const char* end = payload + size;
+
+            uint8_t type;
+            readValue(position, end, type);
+            message.type = static_cast<Message::Type>(type);
+            readString(position, end, message.nickname);
+            readString(position, end, message.body);
+
+            if (layout == Layout::BASIC)
+            {
+                message.channel.clear();
+                message.timestamp = 0;
+            }
+            else
+            {
+                readString(position, end, message.channel);
+                readValue(position, end, message.timestamp);
+            }
+
+            if (message.type == Message::Type::CHUNK && layout == Layout::CHANNELS)
+            {
+                readValue(position, end, message.transfer);
+                readValue(position, end, message.offset);
+                readValue(position, end, message.size);
+                readString(position, end, message.name);
+            }
+            else
+            {
+                message.transfer = message.offset = message.size = 0;
+                message.name.clear();
+            }
+
+            message.recipients.clear();
+            if (hasRecipients(message.type) && layout == Layout::CHANNELS)
+            {
+                uint64_t count;
+                readValue(position, end, count);
+
+                // every recipient takes at least its size, so a made up count is caught before anything is reserved
+                if (count > static_cast<uint64_t>(end - position) / sizeof(uint64_t))
+                    throw std::runtime_error("Frame truncated");
+
+                message.recipients.resize(static_cast<size_t>(count));
+                for (boost::string_ref& recipient : message.recipients)
+                    readString(position, end, recipient);
+            }
+
+            if (position != end)
+                throw std::runtime_error("Invalid frame size");
+        }
+
+    private:
+        static bool hasRecipients(Message::Type type)
+        {
+            return type == Message::Type::DIRECT || type == Message::Type::MULTICAST;
+        }
+
+        template <class T>
+        static uint8_t* writeValue(uint8_t* output, T value)
+        {
+            std::memcpy(output, &value, sizeof(T));
+            return output + sizeof(T);
+        }
+
+        template <class S>
+        static uint8_t* writeString(uint8_t* output, const S& value)
+        {
+            output = writeValue(output, static_cast<uint64_t>(value.size()));
+            std::memcpy(output, value.data(), value.size());
+            return output + value.size();
+        }
+
+        template <class T>
+        static void readValue(const char*& position, const char* end, T& value)
+        {
+            if (static_cast<size_t>(end - position) < sizeof(T))
+                throw std::runtime_error("Frame truncated");
+
+            std::memcpy(&value, position, sizeof(T)); // native byte order, like cereal's binary archive
+            position += sizeof(T);
+        }
+
+        static void readString(const char*& position, const char* end, boost::string_ref& value)
+        {
+            uint64_t size;
+            readValue(position, end, size);
+
+            if (static_cast<uint64_t>(end - position) < size)
+                throw std::runtime_error("Frame truncated");
+
+            value = boost::string_ref(position, static_cast<size_t>(size));
+            position += size;
+        }
+    };
+}
@@ -0,0 +1,213 @@
+//
+//  Chat server
+//
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <mutex>
+#include <random>
+#include <unordered_map>
+#include <boost/asio/ip/address.hpp>
+#include "Config.hpp"
+
+namespace chat
+{
+    // Tokens refilled at a constant rate up to the burst, every admitted event takes one
+    struct TokenBucket
+    {
+        double tokens;
+        std::chrono::steady_clock::time_point time; // of the last refill
+
+        // refills the tokens and takes one if there is one, otherwise returns the milliseconds until there is
+        uint64_t take(std::chrono::steady_clock::time_point now, double rate, double burst)
+        {
+            tokens = std::min(burst, tokens + rate * std::chrono::duration<double>(now - time).count());
+            time = now;
+
+            if (tokens >= 1.0)
+            {
+                tokens -= 1.0;
+                return 0;
+            }
+
+            return static_cast<uint64_t>(std::ceil((1.0 - tokens) * 1000.0 / rate));
+        }
+
+        // no event taken for as long as the burst takes to refill
+        bool isFull(std::chrono::steady_clock::time_point now, double rate, double burst) const
+        {
+            return tokens + rate * std::chrono::duration<double>(now - time).count() >= burst;
+        }
+    };
+
+    // Admission control of the accepts and the logins, so a storm of reconnecting clients (e.g. when a load
+    // balancer flaps) can not starve the established sessions of event loop time. Every kind of event has a
+    // token bucket for the whole server and one for every source address, shared by all the shards.
+    class Admission final
+    {
+    public:
+        enum class Kind
+        {
+            CONNECTION,
+            LOGIN,
+            COUNT
+        };
+
+        explicit Admission(const Config& config):
+            burstTime(config.admissionBurst)
+        {
+            setLimit(Kind::CONNECTION, config.acceptRate, config.sourceAcceptRate);
+            setLimit(Kind::LOGIN, config.loginRate, config.sourceLoginRate);
+
+            auto now = std::chrono::steady_clock::now();
+            for (size_t i = 0; i < static_cast<size_t>(Kind::COUNT); ++i)
+                buckets[i] = TokenBucket{limits[i].burst, now};
+        }
+
+        Admission(const Admission&) = delete;
+        Admission& operator=(const Admission&) = delete;
+
+        inline bool isLimited(Kind kind) const
+        {
+            return limits[static_cast<size_t>(kind)].rate > 0.0;
+        }
+
+        inline bool isLimitingSources(Kind kind) const
+        {
+            return sourceLimits[static_cast<size_t>(kind)].rate > 0.0;
+        }
+
+        // takes a token of the server's bucket, or returns the milliseconds to wait for one
+        uint64_t admit(Kind kind)
+        {
+            if (!isLimited(kind)) return 0;
+
+            const Limit& limit = limits[static_cast<size_t>(kind)];
+
+            std::lock_guard<std::mutex> lock(mutex);
+            return buckets[static_cast<size_t>(kind)].take(std::chrono::steady_clock::now(), limit.rate, limit.burst);
+        }
+
+        // takes a token of the source's bucket, or returns the milliseconds to wait for one
+        uint64_t admitSource(Kind kind, const boost::asio::ip::address& address)
+        {
+            if (!isLimitingSources(kind)) return 0;
+
+            auto now = std::chrono::steady_clock::now();
+
+            std::lock_guard<std::mutex> lock(mutex);
+
+            // the sources that are back within their rates are forgotten once the table doubles
+            if (sources.size() >= pruneSize)
+            {
+                pruneSources(now);
+                pruneSize = 2 * sources.size();
+                if (pruneSize < MIN_PRUNE_SIZE) pruneSize = MIN_PRUNE_SIZE;
+            }
+
+            auto i = sources.find(getKey(address));
+            if (i == sources.end())
+            {
+                Source source;
+                for (size_t k = 0; k < static_cast<size_t>(Kind::COUNT); ++k)
+                    source.buckets[k] = TokenBucket{sourceLimits[k].burst, now};
+
+                i = sources.insert(std::make_pair(getKey(address), source)).first;
+            }
+
+            const Limit& limit = sourceLimits[static_cast<size_t>(kind)];
+            return i->second.buckets[static_cast<size_t>(kind)].take(now, limit.rate, limit.burst);
+        }
+
+        // the hint given to a client turned away: the wait plus a random part of the burst time,
+        // so the clients turned away together do not all come back together
+        uint64_t getRetryAfter(uint64_t wait)
+        {
+            if (!burstTime) return wait;
+
+            std::lock_guard<std::mutex> lock(mutex);
+            return wait + random() % burstTime;
+        }
+
+    private:
+        static const size_t MIN_PRUNE_SIZE = 1024;
+
+        typedef std::array<uint8_t, 16> Key; // IPv6, or IPv4-mapped IPv6
+
+        struct KeyHash
+        {
+            size_t operator()(const Key& key) const
+            {
+                // FNV-1a
+                uint64_t hash = 14695981039346656037ULL;
+                for (uint8_t byte : key)
+                {
+                    hash ^= byte;
+                    hash *= 1099511628211ULL;
+                }
+                return static_cast<size_t>(hash);
+            }
+        };
+
+        struct Limit
+        {
+            double rate = 0.0; // a second, 0 for no limit
+            double burst = 0.0; // tokens the bucket holds
+        };
+
+        struct Source
+        {
+            TokenBucket buckets[static_cast<size_t>(Kind::COUNT)];
+        };
+
+        void setLimit(Kind kind, size_t rate, size_t sourceRate)
+        {
+            // a bucket holds the tokens of the burst time, and at least one
+            limits[static_cast<size_t>(kind)].rate = static_cast<double>(rate);
+            limits[static_cast<size_t>(kind)].burst = std::max(1.0, static_cast<double>(rate * burstTime) / 1000.0);
+            sourceLimits[static_cast<size_t>(kind)].rate = static_cast<double>(sourceRate);
+            sourceLimits[static_cast<size_t>(kind)].burst = std::max(1.0, static_cast<double>(sourceRate * burstTime) / 1000.0);
+        }
+
+        static Key getKey(const boost::asio::ip::address& address)
+        {
+            return address.is_v4() ?
+                boost::asio::ip::make_address_v6(boost::asio::ip::v4_mapped, address.to_v4()).to_bytes() :
+                address.to_v6().to_bytes();
+        }
+
+        void pruneSources(std::chrono::steady_clock::time_point now)
+        {
+            for (auto i = sources.begin(); i != sources.end(); )
+            {
+                bool full = true;
+                for (size_t k = 0; k < static_cast<size_t>(Kind::COUNT); ++k)
+                {
+                    const Limit& limit = sourceLimits[k];
+                    if (limit.rate > 0.0 && !i->second.buckets[k].isFull(now, limit.rate, limit.burst))
+                        full = false;
+                }
+
+                if (full)
+                    i = sources.erase(i);
+                else
+                    ++i;
+            }
+        }
+
+        size_t burstTime; // milliseconds
+        Limit limits[static_cast<size_t>(Kind::COUNT)];
+        Limit sourceLimits[static_cast<size_t>(Kind::COUNT)];
+
+        std::mutex mutex;
+        TokenBucket buckets[static_cast<size_t>(Kind::COUNT)];
+        std::unordered_map<Key, Source, KeyHash> sources;
+        size_t pruneSize = MIN_PRUNE_SIZE;
+        std::minstd_rand random;
+    };
+}
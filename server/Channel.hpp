@@ -0,0 +1,50 @@
+//
+//  Chat server
+//
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+namespace chat
+{
+    // Members of a channel kept in a dense array. Members remember their index, so adding and removing
+    // a member is constant time and fan-out touches only the members.
+    template <class T>
+    class Channel final
+    {
+    public:
+        explicit Channel(const std::string& n): name(n) {}
+
+        inline const std::string& getName() const { return name; }
+        inline const std::vector<T*>& getMembers() const { return members; }
+        inline bool isEmpty() const { return members.empty(); }
+
+        // returns the index of the new member
+        size_t add(T* member)
+        {
+            members.push_back(member);
+            return members.size() - 1;
+        }
+
+        // moves the last member into the removed member's place and returns it (or nullptr if there was none)
+        T* remove(size_t index)
+        {
+            T* moved = nullptr;
+
+            if (index + 1 != members.size())
+            {
+                moved = members.back();
+                members[index] = moved;
+            }
+
+            members.pop_back();
+            return moved;
+        }
+
+    private:
+        std::string name;
+        std::vector<T*> members;
+    };
+}
@@ -4,17 +4,87 @@
 
 #pragma once
 
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <sstream>
+#include <vector>
 #include <boost/asio.hpp>
-#include <boost/asio/deadline_timer.hpp>
 #include <boost/bind.hpp>
-#include "cereal/archives/binary.hpp"
+#ifdef CHAT_IO_URING
+#include <cerrno>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+#include "Channel.hpp"
+#include "IoRing.hpp"
 #include "Server.hpp"
+#include "Shard.hpp"
+#include "Frame.hpp"
+#include "FrameDecoder.hpp"
+#include "Handoff.hpp"
+#include "History.hpp"
+#include "Log.hpp"
 #include "Message.hpp"
+#include "Metrics.hpp"
+#include "TimingWheel.hpp"
 
 namespace chat
 {
-    static const size_t BUFFER_SIZE = 1024;
-    static const size_t INACTIVITY_TIMEOUT = 10;
+    static const size_t BUFFER_SIZE = 1024; // largest message of the clients without the varint feature
+    static const size_t HEARTBEAT_MISSES = 3; // heartbeat intervals without traffic after which a client is dropped
+    static const size_t MAX_WRITE_FRAMES = 64; // frames gathered into a single write
+    static const size_t MAX_WRITE_CHUNK_BYTES = 64 * 1024; // chunk bytes gathered into a single write
+    static const size_t REPLAY_FRAMES = 64; // history frames queued at a time
+    static const uint32_t LOG_LINES_PER_SECOND = 10; // per call site, the rest are suppressed
+
+    // Frame queued for a client
+    struct OutputFrame
+    {
+        FramePtr frame;
+        std::chrono::steady_clock::time_point queueTime;
+        // features the client had negotiated when the frame was queued
+        bool varint;
+        bool deflate;
+    };
+
+    // Send queues and write buffers of a client. A client holds them only while it has frames to send,
+    // the shard keeps the drained ones for the next client that needs them.
+    struct ClientOutput
+    {
+        std::deque<OutputFrame> queue;
+        std::deque<OutputFrame> chunkQueue;
+        std::vector<boost::asio::const_buffer> buffers;
+        std::vector<uint8_t> headers; // varint prefixes of the frames being written
+#ifdef CHAT_IO_URING
+        std::vector<iovec> iovecs; // the output buffers of the ring's send
+        msghdr message;
+#endif
+
+        void clear()
+        {
+            queue.clear();
+            chunkQueue.clear();
+            buffers.clear();
+            headers.clear();
+#ifdef CHAT_IO_URING
+            iovecs.clear();
+#endif
+        }
+
+        // estimated, the queues' blocks are counted by the frames in them
+        size_t getMemoryUsage() const
+        {
+            size_t memory = sizeof(*this) + (queue.size() + chunkQueue.size()) * sizeof(OutputFrame) +
+                buffers.capacity() * sizeof(boost::asio::const_buffer) + headers.capacity();
+#ifdef CHAT_IO_URING
+            memory += iovecs.capacity() * sizeof(iovec);
+#endif
+            return memory;
+        }
+    };
 
     class Client final
     {
@@ -22,18 +92,49 @@ namespace chat
         Client(const std::shared_ptr<spdlog::logger>& l,
                boost::asio::io_service& service,
                Server& serv,
-               boost::asio::ip::tcp::socket sock):
+               Shard& sh,
+               boost::asio::ip::tcp::socket sock,
+               IoRing* r = nullptr,
+               int f = -1):
             logger(l),
             ioService(service),
             server(serv),
+            shard(sh),
             socket(std::move(sock)),
-            inputDeadlineTimer(service)
+            ring(r),
+            fd(f),
+            inactivityTimer([this]() { handleInactivity(); }),
+            receiveTimer([this]() { processInput(); })
+        {
+            CHAT_LOG_LIMITED(logger, spdlog::level::info, LOG_LINES_PER_SECOND, "Client connected");
+
+            // clients speak the original layout until they negotiate the channels feature
+            decoder.setLayout(MessageCodec::Layout::BASIC);
+        }
+
+        ~Client()
         {
-            logger->info("Client connected");
+            // the session of a client that can resume was parked instead
+            if ((loggedIn && !resumable) || claiming) server.releaseNickname(nickname);
+
+            closeDescriptor();
+        }
+
+        // called by the shard once the client has its handle
+        void start()
+        {
+            // the socket is read only once it is readable, and then must not block
+            boost::system::error_code ignored;
+            if (!ring) socket.non_blocking(true, ignored);
 
             receive();
         }
 
+        inline bool isOpen() const
+        {
+            return ring ? fd != -1 : socket.is_open();
+        }
+
         inline bool isLoggedIn() const
         {
             return loggedIn;
@@ -44,186 +145,1458 @@ namespace chat
             return nickname;
         }
 
-        void sendMessage(const Message& message)
+        inline size_t getOutputQueueSize() const { return outputQueueSize + chunkQueueSize; }
+
+        // an idle client holds no buffer, only the wait for its input
+        inline bool isIdle() const { return !decoder.hasBuffer() && !output; }
+
+        // bytes of the session and the buffers it holds
+        size_t getMemoryUsage() const
+        {
+            return sizeof(Client) + decoder.getBufferSize() + (output ? output->getMemoryUsage() : 0) +
+                memberships.capacity() * sizeof(Membership) + replays.capacity() * sizeof(HistoryCursor);
+        }
+
+        inline SlotHandle getHandle() const { return handle; }
+        inline void setHandle(SlotHandle newHandle) { handle = newHandle; }
+
+        inline size_t getLoggedInIndex() const { return loggedInIndex; }
+        inline void setLoggedInIndex(size_t index) { loggedInIndex = index; }
+
+        // channel the client is a member of and its index in the channel
+        struct Membership
+        {
+            Channel<Client>* channel;
+            size_t index;
+        };
+
+        inline const std::vector<Membership>& getMemberships() const { return memberships; }
+
+        // clients join only a few channels, so a linear search is the fastest
+        size_t* getMembershipIndex(const Channel<Client>& channel)
+        {
+            for (Membership& membership : memberships)
+                if (membership.channel == &channel) return &membership.index;
+
+            return nullptr;
+        }
+
+        // everyone is a member of the channel without a name
+        bool isMember(const std::string& name) const
         {
-            std::ostream outputStream(&outputBuffer);
-            cereal::BinaryOutputArchive archive(outputStream);
-            archive(message);
+            if (name.empty()) return true;
 
-            uint16_t length = ntohs(static_cast<uint16_t>(outputBuffer.size()));
-            socket.send(boost::asio::buffer(&length, sizeof(length)));
+            for (const Membership& membership : memberships)
+                if (membership.channel->getName() == name) return true;
 
-            size_t n = socket.send(outputBuffer.data());
-            outputBuffer.consume(n); // remove sent data from the buffer
+            return false;
         }
 
-    private:
-        void disconnect()
+        void addMembership(Channel<Client>& channel, size_t index)
+        {
+            memberships.push_back(Membership{&channel, index});
+        }
+
+        void removeMembership(const Channel<Client>& channel)
+        {
+            for (auto i = memberships.begin(); i != memberships.end(); ++i)
+            {
+                if (i->channel == &channel)
+                {
+                    memberships.erase(i);
+                    break;
+                }
+            }
+        }
+
+        void sendMessage(const Message& message)
+        {
+            sendFrame(std::make_shared<const Frame>(message));
+        }
+
+        void sendFrame(const FramePtr& frame)
         {
-            socket.close();
-            ioService.post([this]() { server.removeClient(*this); });
+            if (!isOpen() || closing) return;
+
+            Message::Type type = frame->getType();
+
+            // clients without the batch feature get the messages of a batch one by one
+            if (type == Message::Type::BATCH && !batch)
+            {
+                for (const FramePtr& part : frame->getParts())
+                    sendFrame(part);
+                return;
+            }
+
+            // clients without the channels feature get the frame without the fields they cannot decode
+            if (!channelFields)
+            {
+                FramePtr basicFrame = frame->getBasicFrame();
+                if (basicFrame) queueFrame(basicFrame);
+                return;
+            }
+
+            queueFrame(frame);
         }
 
-        void login(const std::string& newNickname)
+        // called once the nickname is claimed on this server and, with a federation, on the peers
+        void completeLogin(bool accepted)
         {
-            if (server.isNicknameAvailable(newNickname))
+            claiming = false;
+
+            if (accepted)
             {
-                logger->info("{0} logged in", newNickname);
+                CHAT_LOG_LIMITED(logger, spdlog::level::info, LOG_LINES_PER_SECOND, "{0} logged in", nickname);
 
                 loggedIn = true;
-                nickname = newNickname;
+                shard.addLoggedInClient(*this);
 
                 Message reply;
                 reply.type = Message::Type::LOGIN;
-                reply.body = "Logged in with nickname " + newNickname;
+                reply.nickname = nickname; // only the reply to an accepted login names the nickname
+                reply.body = "Logged in with nickname " + nickname;
                 sendMessage(reply);
+
+                if (resumable) sendResumeToken();
+
+                requestHistory(std::string(), loginSince);
             }
             else
             {
-                logger->error("Nickname {0} unavailable", newNickname);
+                server.releaseNickname(nickname);
 
-                Message reply;
-                reply.type = Message::Type::LOGIN;
-                reply.body = "Nickname " + newNickname + " is unavailable";
-                sendMessage(reply);
+                std::string rejected;
+                rejected.swap(nickname);
+                rejectLogin(rejected);
+            }
+        }
+
+        // called by the shard for a client handed over by the previous process, instead of start
+        void resume(const ClientState& state)
+        {
+            boost::system::error_code ignored;
+            if (!ring) socket.non_blocking(true, ignored);
+
+            helloReceived = state.helloReceived;
+            deflate = state.deflate;
+            batch = state.batch;
+            heartbeat = state.heartbeat;
+            resumable = state.resumable;
+            resumeToken = state.resumeToken;
+            if (state.channelFields)
+            {
+                channelFields = true;
+                decoder.setLayout(MessageCodec::Layout::CHANNELS);
+            }
+            if (state.varint)
+            {
+                varint = true;
+                decoder.setVarint(server.getConfig().maxFrameSize);
+            }
+
+            if (state.loggedIn)
+            {
+                if (!server.claimNickname(state.nickname, Session{shard.getIndex(), handle, 0, resumeToken, channelFields}))
+                {
+                    CHAT_LOG_LIMITED(logger, spdlog::level::err, LOG_LINES_PER_SECOND, "Nickname {0} of a client handed over is taken", state.nickname);
+                    disconnect(DisconnectReason::PROTOCOL);
+                    return;
+                }
+
+                nickname = state.nickname;
+                loggedIn = true;
+                shard.addLoggedInClient(*this);
+
+                for (const std::string& channel : state.channels)
+                    shard.joinChannel(*this, channel);
+            }
 
-                disconnect();
+            // the frames the previous process had received but not handled yet come first
+            if (!state.pending.empty())
+            {
+                acquireBuffer();
+                decoder.append(state.pending.data(), state.pending.size());
             }
+
+            processInput();
         }
 
-        void handleMessage(const Message& message)
+        // stop reading for a hot restart, the writes in flight and the queued frames still go out
+        void pauseForHandoff()
         {
-            switch (message.type)
+            handingOff = true;
+            inactivityTimer.cancel();
+            receiveTimer.cancel();
+
+            // cancelling the socket's wait would cancel its write too, so the wait just reads nothing once it fires
+            pauseReceive();
+        }
+
+        // the handoff failed, read again (the bytes received meanwhile wait in the decoder or the socket)
+        void cancelHandoff()
+        {
+            if (!handingOff) return;
+
+            handingOff = false;
+            processInput();
+        }
+
+        // nothing in flight and nothing queued, so the socket can change hands between two frames
+        inline bool isReadyForHandoff() const
+        {
+            return isOpen() && !closing && !writing && !hasOutput() && !receiving &&
+                !claiming && !admitting && replays.empty() && !decoder.isDecodingBatch();
+        }
+
+        // give the socket and the session up for the process taking over, the client is closed after
+        HandoffRecord handOff()
+        {
+            HandoffRecord record;
+            record.kind = HandoffRecord::Kind::CLIENT;
+            record.state.nickname = nickname;
+            record.state.loggedIn = loggedIn;
+            record.state.helloReceived = helloReceived;
+            record.state.channelFields = channelFields;
+            record.state.varint = varint;
+            record.state.deflate = deflate;
+            record.state.batch = batch;
+            record.state.heartbeat = heartbeat;
+            record.state.resumable = resumable;
+            record.state.resumeToken = resumeToken;
+            record.state.channels = getChannelNames();
+            record.state.pending = decoder.getPending();
+
+            // the connection itself stays up, only this process's descriptor goes
+            if (ring)
             {
-                case Message::Type::LOGIN:
-                    login(message.nickname);
-                    break;
-                case Message::Type::TEXT:
-                    if (loggedIn)
+                record.fd = fd;
+                fd = -1;
+            }
+            else
+                record.fd = socket.release();
+
+            scheduleRemoval();
+            return record;
+        }
+
+        // called by the shard before the client is removed, the session of a client that can resume outlives the connection
+        void park()
+        {
+            if (loggedIn && resumable)
+                server.parkSession(nickname, Session{shard.getIndex(), handle, 0, resumeToken, channelFields}, getChannelNames());
+        }
+
+        // called by the shard once the queued login is within the login rate
+        void resumeLogin()
+        {
+            admitting = false;
+
+            std::string newNickname;
+            newNickname.swap(nickname);
+            claimNickname(newNickname, loginSince);
+
+            // the messages received after the login waited for the admission
+            if (isOpen()) processInput();
+        }
+
+        boost::asio::ip::address getAddress() const
+        {
+            boost::asio::ip::tcp::endpoint endpoint;
+#ifdef CHAT_IO_URING
+            if (ring)
+            {
+                socklen_t size = static_cast<socklen_t>(endpoint.capacity());
+                if (::getpeername(fd, endpoint.data(), &size) == 0) endpoint.resize(size);
+                return endpoint.address();
+            }
+#endif
+            boost::system::error_code ignored;
+            endpoint = socket.remote_endpoint(ignored);
+            return endpoint.address();
+        }
+
+        // called by the shard to write the frames queued since the write was scheduled
+        void flush()
+        {
+            writeScheduled = false;
+
+            if (isOpen() && !writing && hasOutput())
+                write();
+        }
+
+        // called by the shard for the completions of the client's io_uring submissions
+        void handleRingCompletion(RingOperation operation, int result, uint32_t flags, const char* buffer)
+        {
+#ifdef CHAT_IO_URING
+            switch (operation)
+            {
+                case RingOperation::RECEIVE:
+                    if (!(flags & IORING_CQE_F_MORE)) receiving = false;
+                    if (!isOpen()) return;
+
+                    if (result > 0)
                     {
-                        logger->info("{0} sent message: {1}", nickname, message.body);
+                        CHAT_LOG_TRACE(logger, "Received {0} bytes", result);
 
-                        Message textMessage;
-                        textMessage.type = Message::Type::TEXT;
-                        textMessage.nickname = nickname;
-                        textMessage.body = message.body;
-                        server.broadcastMessage(textMessage);
+                        // copied out of the shared buffer, which goes back to the ring right after
+                        acquireBuffer();
+                        decoder.append(buffer, static_cast<size_t>(result));
+                        shard.getMetrics().bytesReceived += static_cast<size_t>(result);
+
+                        if (!receivePaused) processInput();
+                    }
+                    else if (result == -ENOBUFS || result == -ECANCELED)
+                    {
+                        // the buffers ran out or the receive was paused, the kernel keeps the data until it is armed again
+                        if (!receivePaused) receive();
                     }
                     else
                     {
-                        logger->error("User not logged in");
-                        disconnect();
+                        CHAT_LOG_LIMITED(logger, spdlog::level::info, LOG_LINES_PER_SECOND, "Disconnected");
+                        disconnect(DisconnectReason::ERROR);
+                    }
+                    break;
+                case RingOperation::SEND:
+                    // a client disconnected during the write is removed once the kernel is done with its buffers
+                    if (!isOpen())
+                    {
+                        writing = false;
+                        scheduleRemoval();
+                        return;
+                    }
+
+                    if (result <= 0)
+                    {
+                        handleWritten(boost::system::error_code(result ? -result : EPIPE, boost::system::system_category()), 0);
+                        return;
                     }
+
+                    sendRemaining(static_cast<size_t>(result));
                     break;
                 default:
-                    logger->error("Invalid message received");
-                    disconnect();
                     break;
             }
+#else
+            (void)operation; (void)result; (void)flags; (void)buffer;
+#endif
         }
 
-        void receive()
+    private:
+        void scheduleWrite()
+        {
+            // let the frames queued during this event loop turn (or the coalescing window) go out together
+            if (!writing && !writeScheduled)
+            {
+                writeScheduled = true;
+                shard.scheduleWrite(handle);
+            }
+        }
+
+        // queues the frame, already in the client's layout
+        void queueFrame(const FramePtr& frame)
         {
-            boost::asio::streambuf::mutable_buffers_type buffers = inputBuffer.prepare(BUFFER_SIZE);
+            Message::Type type = frame->getType();
 
-            inputDeadlineTimer.expires_from_now(boost::posix_time::seconds(INACTIVITY_TIMEOUT));
-            checkDeadline();
+            // clients without the varint feature can decode neither chunks nor large messages
+            if (!varint && (type == Message::Type::CHUNK || frame->getPayloadSize() > BUFFER_SIZE)) return;
 
-            socket.async_receive(buffers,
-                                 [this](const boost::system::error_code& error, std::size_t bytesTransferred)
+            if (type == Message::Type::CHUNK)
             {
-                if (error != boost::asio::error::operation_aborted)
-                {
-                    if (error)
-                    {
-                        logger->info("Disconnected");
-                        disconnect();
-                        return;
-                    }
-                    else
-                    {
-                        logger->info("Received {0} bytes", bytesTransferred);
+                queueChunk(frame);
+                return;
+            }
 
-                        inputBuffer.commit(bytesTransferred);
+            const Config& config = server.getConfig();
+            auto now = std::chrono::steady_clock::now();
 
-                        while (inputBuffer.size() >= sizeof(uint16_t))
+            if (outputQueueSize >= config.sendHighWatermark)
+            {
+                if (!slow) CHAT_LOG_LIMITED(logger, spdlog::level::warn, LOG_LINES_PER_SECOND, "{0} is not reading fast enough", getName());
+                slow = true;
+            }
+
+            if (slow)
+            {
+                switch (config.slowConsumerPolicy)
+                {
+                    case Config::SlowConsumerPolicy::DROP_OLDEST:
+                        // the frames at the front are being written, so they can not be dropped
+                        while (output && output->queue.size() > writingFrames &&
+                               outputQueueSize + frame->getSize() > config.sendHighWatermark)
                         {
-                            std::istream inputStream(&inputBuffer);
-
-                            if (!lastMessageSize)
-                            {
-                                uint16_t messageSize;
-                                inputStream.read(reinterpret_cast<char*>(&messageSize), sizeof(messageSize));
-                                lastMessageSize = htons(messageSize);
-                            }
-
-                            if (lastMessageSize > BUFFER_SIZE ||
-                                inputBuffer.size() > BUFFER_SIZE)
-                            {
-                                logger->error("Buffer too big");
-                                disconnect();
-                                return;
-                            }
-
-                            if (inputBuffer.size() >= lastMessageSize)
-                            {
-                                try
-                                {
-                                    cereal::BinaryInputArchive archive(inputStream);
-                                    Message message;
-                                    archive(message);
-
-                                    handleMessage(message);
-
-                                    lastMessageSize = 0;
-                                }
-                                catch (const std::exception& e)
-                                {
-                                    logger->error(e.what());
-                                    disconnect();
-                                    return;
-                                }
-                            }
-                            else
-                                break;
+                            auto oldest = output->queue.begin() + static_cast<std::ptrdiff_t>(writingFrames);
+                            outputQueueSize -= oldest->frame->getSize();
+                            output->queue.erase(oldest);
+                            ++droppedFrames;
+                            ++shard.getMetrics().framesDropped;
                         }
-
-                        receive();
-                    }
+                        break;
+                    case Config::SlowConsumerPolicy::DROP_NEW:
+                        ++droppedFrames;
+                        ++shard.getMetrics().framesDropped;
+                        return;
+                    case Config::SlowConsumerPolicy::DISCONNECT:
+                        if (outputQueueSize + frame->getSize() > config.sendQueueLimit ||
+                            (output && !output->queue.empty() &&
+                             now - output->queue.front().queueTime > std::chrono::milliseconds(config.sendQueueAge)))
+                        {
+                            CHAT_LOG_LIMITED(logger, spdlog::level::err, LOG_LINES_PER_SECOND, "{0} disconnected, send queue limit exceeded", getName());
+                            disconnect(DisconnectReason::SLOW_CONSUMER);
+                            return;
+                        }
+                        break;
                 }
-            });
+            }
+
+            if (!output) output = shard.acquireOutput();
+            output->queue.push_back(OutputFrame{frame, now, varint, deflate});
+            outputQueueSize += frame->getSize();
+
+            scheduleWrite();
         }
 
-        void checkDeadline()
+        // chunks have their own queue, so a large transfer never delays the chat messages by more than
+        // a write, and the slow consumer policy applies only to the chat messages
+        void queueChunk(const FramePtr& frame)
         {
-            inputDeadlineTimer.async_wait([this](const boost::system::error_code& error)
+            // the sender does not get its own chunks back
+            MessageView chunk;
+            MessageCodec::decode(reinterpret_cast<const char*>(frame->getPayload()), frame->getPayloadSize(), chunk);
+            if (chunk.nickname == nickname) return;
+
+            // the recipient notices the missing slice and abandons the transfer
+            if (chunkQueueSize + frame->getSize() > server.getConfig().chunkQueueLimit)
             {
-                if (!error) // not boost::asio::error::operation_aborted
-                {
-                    logger->info("{0} disconnected due to inactivity", nickname.empty() ? "Client" : nickname);
+                CHAT_LOG_LIMITED(logger, spdlog::level::warn, LOG_LINES_PER_SECOND, "Dropped a chunk for {0}, chunk queue limit exceeded", getName());
+                ++shard.getMetrics().framesDropped;
+                return;
+            }
 
-                    Message statusMessage;
-                    statusMessage.type = Message::Type::STATUS;
-                    statusMessage.nickname = nickname;
-                    statusMessage.body = (nickname.empty() ? "Client" : nickname) + " disconnected due to inactivity";
-                    server.broadcastMessage(statusMessage);
+            if (!output) output = shard.acquireOutput();
+            output->chunkQueue.push_back(OutputFrame{frame, std::chrono::steady_clock::now(), true, deflate});
+            chunkQueueSize += frame->getSize();
+
+            scheduleWrite();
+        }
+
+        inline std::string getName() const
+        {
+            return nickname.empty() ? "Client" : nickname;
+        }
+
+        inline bool hasOutput() const
+        {
+            return output && (!output->queue.empty() || !output->chunkQueue.empty());
+        }
+
+        // borrow a receive buffer from the shard for the bytes about to be received
+        void acquireBuffer()
+        {
+            if (decoder.hasBuffer()) return;
+
+            std::vector<char> buffer = shard.acquireBuffer();
+            decoder.provideBuffer(buffer);
+        }
+
+        // give the receive buffer back once all the received bytes are handled
+        void releaseBuffer()
+        {
+            std::vector<char> buffer;
+            if (decoder.releaseBuffer(buffer)) shard.releaseBuffer(std::move(buffer));
+        }
+
+        // give the send queues back once all the frames are written
+        void releaseOutput()
+        {
+            if (output && !writing && !hasOutput()) shard.releaseOutput(std::move(output));
+        }
+
+        void disconnect(DisconnectReason reason)
+        {
+            if (!isOpen()) return;
+
+            ++shard.getMetrics().disconnects[static_cast<size_t>(reason)];
+
+            inactivityTimer.cancel();
+            receiveTimer.cancel();
+
+            if (ring)
+            {
+                closeDescriptor();
+
+                // the kernel may still read the buffers of the write, its completion removes the client
+                if (writing) return;
+            }
+            else
+                socket.close();
+
+            scheduleRemoval();
+        }
+
+        void scheduleRemoval()
+        {
+            // the client may already be gone when the handler runs, so capture only its handle
+            Shard& clientShard = shard;
+            SlotHandle clientHandle = handle;
+            ioService.post([&clientShard, clientHandle]() { clientShard.removeClient(clientHandle); });
+        }
 
-                    disconnect();
+        void closeDescriptor()
+        {
+#ifdef CHAT_IO_URING
+            if (fd == -1) return;
+
+            // fails the ring's pending operations on the socket, closing alone does not
+            ::shutdown(fd, SHUT_RDWR);
+            ::close(fd);
+            fd = -1;
+#endif
+        }
+
+        // disconnect after all the queued frames are sent
+        void close()
+        {
+            if (hasOutput())
+                closing = true;
+            else
+                disconnect(DisconnectReason::CLOSED);
+        }
+
+        void addOutputBuffers(const OutputFrame& outputFrame)
+        {
+            const Frame* frame = outputFrame.frame.get();
+
+            // the frame is compressed once for all the recipients that support it
+            size_t threshold = server.getConfig().compressionThreshold;
+            if (outputFrame.deflate && threshold && frame->getPayloadSize() >= threshold)
+            {
+                if (const Frame* compressed = frame->getCompressed())
+                {
+                    Metrics& metrics = shard.getMetrics();
+                    ++metrics.framesCompressed;
+                    metrics.compressionSavedBytes += frame->getPayloadSize() - compressed->getPayloadSize();
+                    frame = compressed;
                 }
+            }
+
+            if (outputFrame.varint)
+            {
+                std::vector<uint8_t>& headers = output->headers;
+                size_t offset = headers.size();
+                headers.resize(offset + Frame::MAX_VARINT_HEADER_SIZE);
+                size_t headerSize = Frame::encodeVarintHeader(frame->getPayloadSize(), headers.data() + offset);
+                headers.resize(offset + headerSize);
+
+                output->buffers.push_back(boost::asio::buffer(headers.data() + offset, headerSize));
+            }
+            else
+                output->buffers.push_back(boost::asio::buffer(frame->getData(), Frame::HEADER_SIZE));
+
+            output->buffers.push_back(boost::asio::buffer(frame->getPayload(), frame->getPayloadSize()));
+        }
+
+        void write()
+        {
+            // gather as many queued frames as possible into a single write, the chat messages first and
+            // then the chunks up to a byte limit, the length prefix and the payload of every frame go
+            // in separate buffers
+            writing = true;
+            writingFrames = std::min(output->queue.size(), MAX_WRITE_FRAMES);
+
+            const std::deque<OutputFrame>& chunkQueue = output->chunkQueue;
+            size_t chunkBytes = 0;
+            for (writingChunks = 0;
+                 writingChunks < chunkQueue.size() && writingFrames + writingChunks < MAX_WRITE_FRAMES &&
+                 chunkBytes < MAX_WRITE_CHUNK_BYTES;
+                 ++writingChunks)
+                chunkBytes += chunkQueue[writingChunks].frame->getSize();
+
+            // the varint prefixes are built in place, so the buffer must not move during the write
+            output->buffers.clear();
+            output->headers.clear();
+            output->headers.reserve((writingFrames + writingChunks) * Frame::MAX_VARINT_HEADER_SIZE);
+
+            for (size_t i = 0; i < writingFrames; ++i)
+                addOutputBuffers(output->queue[i]);
+
+            for (size_t i = 0; i < writingChunks; ++i)
+                addOutputBuffers(chunkQueue[i]);
+
+#ifdef CHAT_IO_URING
+            if (ring)
+            {
+                writeRing();
+                return;
+            }
+#endif
+
+            // a write cut short by a disconnect can complete after the client is removed
+            Shard& clientShard = shard;
+            SlotHandle clientHandle = handle;
+
+            boost::asio::async_write(socket, output->buffers,
+                                     [this, &clientShard, clientHandle](const boost::system::error_code& error, std::size_t bytesTransferred)
+            {
+                if (clientShard.getClient(clientHandle) != this) return;
+
+                if (error != boost::asio::error::operation_aborted)
+                    handleWritten(error, bytesTransferred);
             });
         }
 
-        std::shared_ptr<spdlog::logger> logger;
-        boost::asio::io_service& ioService;
-        Server& server;
-        boost::asio::ip::tcp::socket socket;
+#ifdef CHAT_IO_URING
+        // the same gathered write as a single sendmsg submission
+        void writeRing()
+        {
+            output->iovecs.clear();
+            for (const boost::asio::const_buffer& outputBuffer : output->buffers)
+            {
+                iovec vector;
+                vector.iov_base = const_cast<void*>(boost::asio::buffer_cast<const void*>(outputBuffer));
+                vector.iov_len = boost::asio::buffer_size(outputBuffer);
+                output->iovecs.push_back(vector);
+            }
+
+            sentIovecs = 0;
+            bytesWritten = 0;
+            sendRing();
+        }
+
+        void sendRing()
+        {
+            msghdr& message = output->message;
+            std::memset(&message, 0, sizeof(message));
+            message.msg_iov = output->iovecs.data() + sentIovecs;
+            message.msg_iovlen = output->iovecs.size() - sentIovecs;
+
+            ring->send(fd, &message, Shard::getRingUserData(handle, RingOperation::SEND));
+        }
+
+        // a send can be cut short like a write, the rest is sent before the write completes
+        void sendRemaining(size_t sent)
+        {
+            std::vector<iovec>& iovecs = output->iovecs;
+            bytesWritten += sent;
+
+            while (sentIovecs < iovecs.size() && sent >= iovecs[sentIovecs].iov_len)
+                sent -= iovecs[sentIovecs++].iov_len;
+
+            if (sentIovecs == iovecs.size())
+            {
+                handleWritten(boost::system::error_code(), bytesWritten);
+                return;
+            }
+
+            iovec& partial = iovecs[sentIovecs];
+            partial.iov_base = static_cast<char*>(partial.iov_base) + sent;
+            partial.iov_len -= sent;
+            sendRing();
+        }
+#endif
+
+        void handleWritten(const boost::system::error_code& error, std::size_t bytesTransferred)
+        {
+            writing = false;
+
+            if (error)
+            {
+                writingFrames = 0;
+                writingChunks = 0;
+                CHAT_LOG_LIMITED(logger, spdlog::level::info, LOG_LINES_PER_SECOND, "Disconnected");
+                disconnect(DisconnectReason::ERROR);
+                return;
+            }
+
+            Metrics& metrics = shard.getMetrics();
+            ++metrics.writes;
+            metrics.bytesSent += bytesTransferred;
+            metrics.framesSent += writingFrames + writingChunks;
+            metrics.writeFrames.record(writingFrames + writingChunks);
+
+            for (; writingFrames > 0; --writingFrames)
+            {
+                outputQueueSize -= output->queue.front().frame->getSize();
+                output->queue.pop_front();
+            }
+
+            for (; writingChunks > 0; --writingChunks)
+            {
+                chunkQueueSize -= output->chunkQueue.front().frame->getSize();
+                output->chunkQueue.pop_front();
+            }
+
+            if (slow && outputQueueSize <= server.getConfig().sendLowWatermark)
+            {
+                if (droppedFrames) CHAT_LOG_LIMITED(logger, spdlog::level::warn, LOG_LINES_PER_SECOND, "Dropped {0} frames for {1}", droppedFrames, getName());
+                slow = false;
+                droppedFrames = 0;
+            }
+
+            // queue more history only once the previous part is mostly written
+            if (!replays.empty() && outputQueueSize <= server.getConfig().sendLowWatermark)
+                replay();
+
+            if (hasOutput())
+                write();
+            else if (closing)
+                disconnect(DisconnectReason::CLOSED);
+            else
+                releaseOutput();
+        }
+
+        void login(const std::string& newNickname, uint64_t since)
+        {
+            if (loggedIn || claiming || admitting)
+            {
+                rejectLogin(newNickname);
+                return;
+            }
+
+            // the nickname is claimed only once the login is admitted, the client's next messages wait for it
+            uint64_t retryAfter = 0;
+            switch (shard.admitLogin(*this, retryAfter))
+            {
+                case LoginAdmission::ADMITTED:
+                    claimNickname(newNickname, since);
+                    break;
+                case LoginAdmission::QUEUED:
+                    admitting = true;
+                    nickname = newNickname;
+                    loginSince = since;
+                    break;
+                case LoginAdmission::REJECTED:
+                    turnAway(retryAfter);
+                    break;
+            }
+        }
+
+        void claimNickname(const std::string& newNickname, uint64_t since)
+        {
+            if (resumable) resumeToken = server.createResumeToken();
+
+            // a parked session's nickname is still claimed on the peers
+            bool parked = false;
+            if (!server.claimNickname(newNickname, Session{shard.getIndex(), handle, 0, resumeToken, channelFields}, &parked))
+            {
+                rejectLogin(newNickname);
+                return;
+            }
+
+            nickname = newNickname;
+            loginSince = since;
+
+            Federation* federation = server.getFederation();
+            if (!federation || parked)
+            {
+                completeLogin(true);
+                return;
+            }
+
+            // the nickname must be free on the peers too, the client's next messages wait for their answers
+            claiming = true;
+
+            Shard& clientShard = shard;
+            SlotHandle clientHandle = handle;
+            federation->claimNickname(newNickname, [&clientShard, clientHandle](bool accepted)
+            {
+                clientShard.getIoService().post([&clientShard, clientHandle, accepted]()
+                {
+                    Client* client = clientShard.getClient(clientHandle);
+                    if (!client) return;
+
+                    // the messages received after the login waited for the answers
+                    client->completeLogin(accepted);
+                    if (client->isOpen()) client->processInput();
+                });
+            });
+        }
+
+        // take the session over from its last connection (or its parked state), without claiming the nickname again
+        void resumeSession(const std::string& newNickname, const std::string& token, uint64_t since)
+        {
+            if (!resumable || loggedIn || claiming || admitting)
+            {
+                CHAT_LOG_LIMITED(logger, spdlog::level::err, LOG_LINES_PER_SECOND, "Unexpected resume");
+                disconnect(DisconnectReason::PROTOCOL);
+                return;
+            }
+
+            Session previous;
+            std::vector<std::string> channels;
+            if (!server.resumeSession(newNickname, token, Session{shard.getIndex(), handle, 0, token, channelFields}, previous, channels))
+            {
+                // the client logs in instead
+                sendResumeToken();
+                return;
+            }
+
+            nickname = newNickname;
+            resumeToken = token;
+            loginSince = since;
+
+            if (previous.handle == SlotHandle())
+            {
+                completeResume(true, channels);
+                return;
+            }
+
+            // the server has not noticed yet that the last connection dropped, it is closed and its channels
+            // taken over, the client's next messages wait for them
+            claiming = true;
+
+            Shard& clientShard = shard;
+            SlotHandle clientHandle = handle;
+            Shard& previousShard = server.getShard(previous.shard);
+            SlotHandle previousHandle = previous.handle;
+            previousShard.getIoService().post([&clientShard, clientHandle, &previousShard, previousHandle]()
+            {
+                Client* previousClient = previousShard.getClient(previousHandle);
+                bool found = previousClient != nullptr;
+                std::vector<std::string> previousChannels;
+                if (found) previousChannels = previousClient->supersede();
+
+                clientShard.getIoService().post([&clientShard, clientHandle, found, previousChannels]()
+                {
+                    Client* client = clientShard.getClient(clientHandle);
+                    if (!client) return;
+
+                    client->completeResume(found, previousChannels);
+                    if (client->isOpen()) client->processInput();
+                });
+            });
+        }
+
+        void completeResume(bool resumed, const std::vector<std::string>& channels)
+        {
+            claiming = false;
+
+            // the last connection was gone before its channels could be taken over
+            if (!resumed)
+            {
+                server.releaseNickname(nickname);
+                nickname.clear();
+                resumeToken.clear();
+                sendResumeToken();
+                return;
+            }
+
+            CHAT_LOG_LIMITED(logger, spdlog::level::info, LOG_LINES_PER_SECOND, "{0} resumed its session", nickname);
+            ++shard.getMetrics().sessionsResumed;
+
+            loggedIn = true;
+            shard.addLoggedInClient(*this);
+
+            // the members of the channels were never told that the client left
+            for (const std::string& channel : channels)
+                shard.joinChannel(*this, channel);
+
+            sendResumeToken();
+
+            // only the messages missed while disconnected, as far as the history goes back
+            requestHistory(std::string(), loginSince);
+            for (const std::string& channel : channels)
+                requestHistory(channel, loginSince);
+        }
+
+        // called on the shard of the connection a resuming client left behind, its session belongs to the new one
+        std::vector<std::string> supersede()
+        {
+            CHAT_LOG_LIMITED(logger, spdlog::level::info, LOG_LINES_PER_SECOND, "{0} resumed on another connection", nickname);
+
+            // the nickname is not released when the client is removed
+            claiming = false;
+
+            std::vector<std::string> channels = getChannelNames();
+            disconnect(DisconnectReason::CLOSED);
+            return channels;
+        }
+
+        // the token to resume the session with, empty if there is none
+        void sendResumeToken()
+        {
+            Message message;
+            message.type = Message::Type::RESUME;
+            message.nickname = nickname;
+            message.body = resumeToken;
+            sendMessage(message);
+        }
+
+        std::vector<std::string> getChannelNames() const
+        {
+            std::vector<std::string> channels;
+            channels.reserve(memberships.size());
+            for (const Membership& membership : memberships)
+                channels.push_back(membership.channel->getName());
+            return channels;
+        }
+
+        void rejectLogin(const std::string& rejectedNickname)
+        {
+            CHAT_LOG_LIMITED(logger, spdlog::level::err, LOG_LINES_PER_SECOND, "Nickname {0} unavailable", rejectedNickname);
+
+            Message reply;
+            reply.type = Message::Type::LOGIN;
+            reply.body = "Nickname " + rejectedNickname + " is unavailable";
+            sendMessage(reply);
+
+            close();
+        }
+
+        // the login reply tells the client when to retry, then the connection is closed
+        void turnAway(uint64_t retryAfter)
+        {
+            CHAT_LOG_LIMITED(logger, spdlog::level::warn, LOG_LINES_PER_SECOND, "Login turned away, retry in {0} ms", retryAfter);
+
+            sendMessage(Shard::createBusyReply(retryAfter));
+            close();
+        }
+
+        void handleMessage(const MessageView& message)
+        {
+            Metrics& metrics = shard.getMetrics();
+            ScopedTimer timer(metrics.handleTime, metrics.timing);
+
+            if (!loggedIn && message.type != Message::Type::LOGIN && message.type != Message::Type::HELLO &&
+                message.type != Message::Type::RESUME && message.type != Message::Type::PING)
+            {
+                CHAT_LOG_LIMITED(logger, spdlog::level::err, LOG_LINES_PER_SECOND, "User not logged in");
+                disconnect(DisconnectReason::PROTOCOL);
+                return;
+            }
+
+            switch (message.type)
+            {
+                case Message::Type::HELLO:
+                    hello(message.body.to_string());
+                    break;
+                case Message::Type::LOGIN:
+                    login(message.nickname.to_string(), message.timestamp);
+                    break;
+                case Message::Type::RESUME:
+                    resumeSession(message.nickname.to_string(), message.body.to_string(), message.timestamp);
+                    break;
+                case Message::Type::PING:
+                {
+                    // the reply shows the client that the server is alive, the ping itself has already
+                    // rearmed the client's timeout like any other traffic
+                    ++metrics.heartbeats;
+
+                    Message pong;
+                    pong.type = Message::Type::PONG;
+                    sendMessage(pong);
+                    break;
+                }
+                case Message::Type::CHUNK:
+                    relayChunk(message);
+                    break;
+                case Message::Type::TEXT:
+                {
+                    // only the members write to a channel, which also keeps its history from being made up
+                    std::string channel = message.channel.to_string();
+                    if (!isMember(channel))
+                    {
+                        Message reply;
+                        reply.type = Message::Type::ERROR;
+                        reply.channel = channel;
+                        reply.body = "Not a member of " + channel;
+                        sendMessage(reply);
+                        break;
+                    }
+
+                    CHAT_LOG_LIMITED(logger, spdlog::level::info, LOG_LINES_PER_SECOND, "{0} sent message: {1}", nickname, message.body.to_string());
+
+                    Message textMessage;
+                    textMessage.type = Message::Type::TEXT;
+                    textMessage.nickname = nickname;
+                    textMessage.body = message.body.to_string();
+                    textMessage.channel = channel;
+                    shard.broadcastMessage(textMessage);
+                    break;
+                }
+                case Message::Type::DIRECT:
+                case Message::Type::MULTICAST:
+                    sendDirectMessage(message);
+                    break;
+                case Message::Type::JOIN:
+                case Message::Type::PART:
+                {
+                    if (message.channel.empty())
+                    {
+                        CHAT_LOG_LIMITED(logger, spdlog::level::err, LOG_LINES_PER_SECOND, "Invalid channel");
+                        disconnect(DisconnectReason::PROTOCOL);
+                        break;
+                    }
+
+                    std::string channel = message.channel.to_string();
+                    bool join = message.type == Message::Type::JOIN;
+
+                    if (join ? shard.joinChannel(*this, channel) : shard.partChannel(*this, channel))
+                    {
+                        CHAT_LOG_LIMITED(logger, spdlog::level::info, LOG_LINES_PER_SECOND, "{0} {1} {2}", nickname, join ? "joined" : "left", channel);
+
+                        if (join) requestHistory(channel, message.timestamp);
+
+                        Message statusMessage;
+                        statusMessage.type = Message::Type::STATUS;
+                        statusMessage.nickname = nickname;
+                        statusMessage.body = nickname + (join ? " joined " : " left ") + channel;
+                        statusMessage.channel = channel;
+                        shard.broadcastMessage(statusMessage);
+
+                        // the leaving client does not get the channel's messages anymore
+                        if (!join) sendMessage(statusMessage);
+                    }
+                    break;
+                }
+                default:
+                    CHAT_LOG_LIMITED(logger, spdlog::level::err, LOG_LINES_PER_SECOND, "Invalid message received");
+                    disconnect(DisconnectReason::PROTOCOL);
+                    break;
+            }
+        }
+
+        // negotiate the connection's features, before the login
+        void hello(const std::string& features)
+        {
+            if (loggedIn || helloReceived)
+            {
+                CHAT_LOG_LIMITED(logger, spdlog::level::err, LOG_LINES_PER_SECOND, "Unexpected hello");
+                disconnect(DisconnectReason::PROTOCOL);
+                return;
+            }
+
+            helloReceived = true;
+
+            const Config& config = server.getConfig();
+            bool channelsRequested = false;
+            bool varintRequested = false;
+            bool deflateRequested = false;
+            bool batchRequested = false;
+            bool resumeRequested = false;
+            bool heartbeatRequested = false;
+
+            std::istringstream stream(features);
+            std::string feature;
+            while (stream >> feature)
+            {
+                if (feature == "channels") channelsRequested = true;
+                else if (feature == "varint") varintRequested = true;
+                else if (feature == "deflate") deflateRequested = config.compressionThreshold != 0;
+                else if (feature == "batch") batchRequested = true;
+                else if (feature == "resume") resumeRequested = config.resumeTimeout != 0;
+                else if (feature == "heartbeat") heartbeatRequested = config.heartbeatInterval != 0;
+            }
+
+            // batches can be larger than the clients without the varint feature accept, and resuming
+            // sends the timestamp of the last message received, which only the channels layout has
+            batchRequested = batchRequested && varintRequested && channelsRequested;
+            resumeRequested = resumeRequested && channelsRequested;
+
+            Message reply;
+            reply.type = Message::Type::HELLO;
+            if (channelsRequested)
+                reply.body = "channels";
+            if (varintRequested)
+                reply.body += (reply.body.empty() ? "varint max-frame-size=" : " varint max-frame-size=") +
+                    std::to_string(config.maxFrameSize) + " chunk-rate=" + std::to_string(config.chunkRate);
+            if (deflateRequested)
+                reply.body += reply.body.empty() ? "deflate" : " deflate";
+            if (batchRequested)
+                reply.body += " batch";
+            if (resumeRequested)
+                reply.body += reply.body.empty() ? "resume" : " resume";
+            if (heartbeatRequested)
+                reply.body += (reply.body.empty() ? "heartbeat=" : " heartbeat=") + std::to_string(config.heartbeatInterval);
+            sendMessage(reply);
+
+            // the reply still has the old prefix and layout and is not compressed, the client switches once
+            // it reads it and sends nothing else before
+            if (channelsRequested)
+            {
+                channelFields = true;
+                decoder.setLayout(MessageCodec::Layout::CHANNELS);
+            }
+
+            if (varintRequested)
+            {
+                varint = true;
+                decoder.setVarint(config.maxFrameSize);
+            }
+
+            deflate = deflateRequested;
+            batch = batchRequested;
+            resumable = resumeRequested;
+            heartbeat = heartbeatRequested;
+        }
+
+        // the message reaches only its recipients, which are not recorded in the history, and the sender is
+        // told which of them are not online or can not decode it
+        void sendDirectMessage(const MessageView& message)
+        {
+            std::vector<std::string> recipients = Server::getRecipients(message);
+            if (recipients.empty())
+            {
+                CHAT_LOG_LIMITED(logger, spdlog::level::err, LOG_LINES_PER_SECOND, "Invalid recipients");
+                disconnect(DisconnectReason::PROTOCOL);
+                return;
+            }
+
+            Message reply;
+            reply.type = Message::Type::ERROR;
+
+            if (recipients.size() > server.getConfig().maxRecipients)
+            {
+                reply.body = "Too many recipients";
+                sendMessage(reply);
+                return;
+            }
+
+            CHAT_LOG_LIMITED(logger, spdlog::level::debug, LOG_LINES_PER_SECOND, "{0} sent message to {1}", nickname, joinNicknames(recipients));
+
+            Message directMessage;
+            directMessage.type = message.type;
+            directMessage.nickname = nickname;
+            directMessage.body = message.body.to_string();
+            directMessage.recipients = recipients;
+            directMessage.timestamp = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::system_clock::now().time_since_epoch()).count());
+
+            std::vector<std::string> unreachable;
+            std::vector<std::string> offline = shard.sendDirectMessage(directMessage, recipients, unreachable);
+
+            if (!offline.empty())
+            {
+                reply.body = offline.size() == 1 ? offline.front() + " is not online" : "Not online: " + joinNicknames(offline);
+                sendMessage(reply);
+            }
+
+            if (!unreachable.empty())
+            {
+                reply.body = unreachable.size() == 1 ? unreachable.front() + " can not receive direct messages" :
+                    "Can not receive direct messages: " + joinNicknames(unreachable);
+                sendMessage(reply);
+            }
+        }
+
+        static std::string joinNicknames(const std::vector<std::string>& nicknames)
+        {
+            std::string joined;
+            for (const std::string& name : nicknames)
+            {
+                if (!joined.empty()) joined += ' ';
+                joined += name;
+            }
+            return joined;
+        }
+
+        // chunks are relayed one by one as they arrive, never reassembled or stored
+        void relayChunk(const MessageView& message)
+        {
+            if (!varint || !channelFields || message.body.empty() || message.offset > message.size ||
+                message.body.size() > message.size - message.offset)
+            {
+                CHAT_LOG_LIMITED(logger, spdlog::level::err, LOG_LINES_PER_SECOND, "Invalid chunk");
+                disconnect(DisconnectReason::PROTOCOL);
+                return;
+            }
+
+            MessageView chunk = message;
+            chunk.nickname = nickname;
+            chunk.timestamp = 0;
+            shard.broadcastMessage(chunk);
+
+            // spend the chunk rate, the reads pause while it is exhausted
+            size_t chunkRate = server.getConfig().chunkRate;
+            if (chunkRate)
+            {
+                auto now = std::chrono::steady_clock::now();
+                int64_t elapsed = std::chrono::duration_cast<std::chrono::microseconds>(now - chunkCreditTime).count();
+                int64_t rate = static_cast<int64_t>(chunkRate);
+
+                chunkCredit = std::min(rate, chunkCredit + elapsed * rate / 1000000) - static_cast<int64_t>(chunk.body.size());
+                chunkCreditTime = now;
+            }
+        }
+
+        // replay the channel's messages since the timestamp (or the last few if it is 0)
+        void requestHistory(const std::string& channel, uint64_t since)
+        {
+            bool idle = replays.empty();
+            replays.push_back(server.getHistory().seek(channel, since));
+
+            if (idle) replay();
+        }
+
+        // queue the next part of the requested history, the rest follows as the client reads it
+        void replay()
+        {
+            while (!replays.empty() && isOpen())
+            {
+                std::vector<FramePtr> frames;
+                bool more;
+
+                // runs from the write completion, so a bad log record must drop only this client
+                try
+                {
+                    more = server.getHistory().read(replays.front(), frames, REPLAY_FRAMES);
+                }
+                catch (const std::exception& e)
+                {
+                    CHAT_LOG_LIMITED(logger, spdlog::level::err, LOG_LINES_PER_SECOND, "Failed to replay the history: {0}", e.what());
+                    disconnect(DisconnectReason::ERROR);
+                    return;
+                }
+
+                for (const FramePtr& frame : frames)
+                    sendFrame(frame);
+
+                if (!more) replays.erase(replays.begin());
+
+                // the write completion continues the replay
+                if (!frames.empty()) return;
+
+                // nothing matched in the scanned part of the log, continue in the next event loop turn
+                if (more)
+                {
+                    Shard& clientShard = shard;
+                    SlotHandle clientHandle = handle;
+                    ioService.post([&clientShard, clientHandle]()
+                    {
+                        if (Client* client = clientShard.getClient(clientHandle)) client->replay();
+                    });
+                    return;
+                }
+            }
+        }
+
+        void receive()
+        {
+            if (handingOff) return;
+
+            // any traffic shows the connection is alive, the heartbeats only stand in for it
+            const Config& config = server.getConfig();
+            size_t timeout = heartbeat ? HEARTBEAT_MISSES * config.heartbeatInterval : config.inactivityTimeout;
+            if (timeout) shard.getTimingWheel().arm(inactivityTimer, std::chrono::milliseconds(timeout));
+
+            // nothing is left to decode, the client waits for its input without a buffer
+            releaseBuffer();
+
+#ifdef CHAT_IO_URING
+            if (ring)
+            {
+                // a single submission keeps receiving into the ring's buffers until it is cancelled
+                receivePaused = false;
+                if (!receiving)
+                {
+                    ring->receive(fd, Shard::getRingUserData(handle, RingOperation::RECEIVE));
+                    receiving = true;
+                }
+                return;
+            }
+#endif
+
+            // a wait left pending by a handoff that failed reads again once it fires
+            if (waiting) return;
+
+            // wait for the socket to become readable and borrow a buffer only then
+            waiting = true;
+            socket.async_wait(boost::asio::ip::tcp::socket::wait_read,
+                              [this](const boost::system::error_code& error)
+            {
+                // aborted only once the client is closed, and possibly gone
+                if (error != boost::asio::error::operation_aborted)
+                {
+                    waiting = false;
+
+                    if (error)
+                    {
+                        CHAT_LOG_LIMITED(logger, spdlog::level::info, LOG_LINES_PER_SECOND, "Disconnected");
+                        disconnect(DisconnectReason::ERROR);
+                        return;
+                    }
+
+                    if (!handingOff) readInput();
+                }
+            });
+        }
+
+        // read what the readable socket holds (the socket is non-blocking)
+        void readInput()
+        {
+            acquireBuffer();
+
+            boost::system::error_code error;
+            std::size_t bytesTransferred = socket.read_some(decoder.prepare(), error);
+
+            if (error == boost::asio::error::would_block)
+            {
+                receive();
+                return;
+            }
+
+            if (error)
+            {
+                CHAT_LOG_LIMITED(logger, spdlog::level::info, LOG_LINES_PER_SECOND, "Disconnected");
+                disconnect(DisconnectReason::ERROR);
+                return;
+            }
+
+            CHAT_LOG_TRACE(logger, "Received {0} bytes", bytesTransferred);
+
+            decoder.commit(bytesTransferred);
+            shard.getMetrics().bytesReceived += bytesTransferred;
+
+            processInput();
+        }
+
+        // handle the received messages and receive more, unless a login waits for its admission or the peers
+        void processInput()
+        {
+            // the bytes received from now on go to the process taking over
+            if (handingOff) return;
+
+            Metrics& metrics = shard.getMetrics();
+            size_t handled = 0; // counted once per read
+
+            try
+            {
+                ScopedTimer timer(metrics.receiveTime);
+                metrics.timing = timer.isTiming();
+
+                MessageView message;
+                while (isOpen() && !claiming && !admitting && decoder.decode(message))
+                {
+                    ++handled;
+                    handleMessage(message);
+                }
+
+                metrics.timing = false;
+                metrics.messagesReceived += handled;
+            }
+            catch (const std::exception& e)
+            {
+                metrics.timing = false;
+                metrics.messagesReceived += handled;
+                CHAT_LOG_LIMITED(logger, spdlog::level::err, LOG_LINES_PER_SECOND, "{0}", e.what());
+                disconnect(DisconnectReason::PROTOCOL);
+                return;
+            }
+
+            if (!isOpen()) return;
+
+            if (claiming || admitting)
+            {
+                pauseReceive();
+                return;
+            }
+
+            // a client sending chunks faster than the chunk rate is read again once it is
+            // back within the rate, TCP flow control slows it down in the meantime
+            if (chunkCredit < 0)
+            {
+                int64_t delay = -chunkCredit * 1000 / static_cast<int64_t>(server.getConfig().chunkRate) + 1;
+                shard.getTimingWheel().arm(receiveTimer, std::chrono::milliseconds(delay));
+                pauseReceive();
+            }
+            else
+                receive();
+        }
+
+        // stop the ring's receive until receive is called again, the bytes it completes until then wait in the decoder
+        void pauseReceive()
+        {
+#ifdef CHAT_IO_URING
+            if (!ring || receivePaused) return;
+
+            receivePaused = true;
+            if (receiving)
+                ring->cancel(Shard::getRingUserData(handle, RingOperation::RECEIVE),
+                             Shard::getRingUserData(handle, RingOperation::CANCEL));
+#endif
+        }
+
+        void handleInactivity()
+        {
+            if (heartbeat)
+            {
+                CHAT_LOG_LIMITED(logger, spdlog::level::info, LOG_LINES_PER_SECOND, "{0} disconnected, heartbeats stopped", getName());
+
+                // the session is parked for the client to resume, the others are told once it expires
+                if (!resumable)
+                {
+                    Message statusMessage;
+                    statusMessage.type = Message::Type::STATUS;
+                    statusMessage.nickname = nickname;
+                    statusMessage.body = getName() + " disconnected";
+                    shard.broadcastMessage(statusMessage);
+                }
+
+                disconnect(DisconnectReason::HEARTBEAT);
+                return;
+            }
+
+            CHAT_LOG_LIMITED(logger, spdlog::level::info, LOG_LINES_PER_SECOND, "{0} disconnected due to inactivity", getName());
+
+            Message statusMessage;
+            statusMessage.type = Message::Type::STATUS;
+            statusMessage.nickname = nickname;
+            statusMessage.body = getName() + " disconnected due to inactivity";
+            shard.broadcastMessage(statusMessage);
+
+            disconnect(DisconnectReason::INACTIVITY);
+        }
+
+        std::shared_ptr<spdlog::logger> logger;
+        boost::asio::io_service& ioService;
+        Server& server;
+        Shard& shard;
+        boost::asio::ip::tcp::socket socket;
+        IoRing* ring; // the socket is unused if the shard does its I/O through io_uring
+        int fd; // connection of the ring, -1 once closed
+
+        TimingWheel::Timer inactivityTimer;
+        TimingWheel::Timer receiveTimer; // resumes the reads paused by the chunk rate
+        bool receiving = false; // the ring's receive is armed
+        bool waiting = false; // the socket's wait for input is pending
+        bool receivePaused = false;
+        FrameDecoder decoder{BUFFER_SIZE};
+        bool helloReceived = false;
+        bool channelFields = false; // channels feature negotiated, the messages have the channel and the timestamp
+        bool varint = false; // varint length prefixes, large messages and chunks negotiated
+        bool deflate = false; // compressed frames negotiated
+        bool batch = false; // batch frames negotiated
+        bool resumable = false; // session resume negotiated, the session is parked when the connection drops
+        bool heartbeat = false; // heartbeats negotiated, the client is dropped only once they stop, not when it is quiet
+
+        std::unique_ptr<ClientOutput> output; // only while frames are queued or being written
+        size_t outputQueueSize = 0; // bytes
+        size_t chunkQueueSize = 0; // bytes
+        size_t writingFrames = 0; // frames at the front of the queue that are being written
+        size_t writingChunks = 0; // chunks at the front of the chunk queue that are being written
+#ifdef CHAT_IO_URING
+        size_t sentIovecs = 0;
+        size_t bytesWritten = 0;
+#endif
+        size_t droppedFrames = 0;
+        bool writing = false;
+        bool writeScheduled = false;
+        bool slow = false;
+        bool closing = false;
+
+        int64_t chunkCredit = 0; // bytes of chunks that can be read before pausing, refilled at the chunk rate
+        std::chrono::steady_clock::time_point chunkCreditTime = std::chrono::steady_clock::now();
 
-        boost::asio::deadline_timer inputDeadlineTimer;
-        uint16_t lastMessageSize = 0;
-        boost::asio::streambuf inputBuffer;
-        boost::asio::streambuf outputBuffer;
+        std::vector<HistoryCursor> replays; // history requested by the client
 
+        SlotHandle handle;
+        size_t loggedInIndex = 0;
+        std::vector<Membership> memberships;
         bool loggedIn = false;
+        bool claiming = false; // waiting for the peers to answer the claim of the nickname
+        bool admitting = false; // the login waits in the shard's queue for the login rate, its nickname is not claimed yet
+        bool handingOff = false; // reads stopped for a hot restart
+        uint64_t loginSince = 0;
         std::string nickname;
+        std::string resumeToken; // identifies the session to resume, with the nickname
     };
 }
@@ -0,0 +1,99 @@
+//
+//  Chat server
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace chat
+{
+    struct Config
+    {
+        // what to do with a client that does not read its messages fast enough
+        enum class SlowConsumerPolicy
+        {
+            DROP_OLDEST, // drop the oldest queued frames to make room for new ones
+            DROP_NEW, // drop new frames until the queue drains below the low watermark
+            DISCONNECT // disconnect the client once the queue limit or age is exceeded
+        };
+
+        // how the event loops do their socket I/O
+        enum class IoBackend
+        {
+            ASIO, // readiness notifications (epoll on Linux) and a system call for every read and write
+            IO_URING // completions of multishot accepts and receives, batched submissions (Linux 6.0)
+        };
+
+        size_t threads = 1; // event loops, one per thread
+        bool pinThreads = false; // pin every event loop thread to its own CPU
+        size_t timerTick = 100; // milliseconds, resolution of the connection timeouts
+        size_t inactivityTimeout = 10000; // milliseconds without traffic after which a client without heartbeats is disconnected, 0 to never
+        size_t heartbeatInterval = 15000; // milliseconds between the heartbeats of an idle client (which is dropped after missing a few), 0 to not offer heartbeats
+        IoBackend ioBackend = IoBackend::ASIO; // falls back to asio if io_uring is unavailable
+        size_t ringBuffers = 1024; // receive buffers shared by the connections of an event loop (io_uring)
+
+        // admission control, so a storm of reconnecting clients can not starve the established sessions
+        size_t acceptRate = 0; // connections a second, more are turned away with a hint when to retry, 0 for no limit
+        size_t sourceAcceptRate = 0; // connections a second from a single address, 0 for no limit
+        size_t loginRate = 0; // logins a second, more wait in the pending login queue, 0 for no limit
+        size_t sourceLoginRate = 0; // logins a second from a single address, more are turned away, 0 for no limit
+        size_t admissionBurst = 1000; // milliseconds of the rates that can be admitted at once
+        size_t pendingLogins = 1024; // logins waiting for the login rate per event loop, more are turned away
+
+        // send queue
+        size_t sendHighWatermark = 256 * 1024; // bytes, the slow consumer policy applies above it
+        size_t sendLowWatermark = 64 * 1024; // bytes, the client is no longer slow below it
+        size_t sendQueueLimit = 1024 * 1024; // bytes
+        size_t sendQueueAge = 30000; // milliseconds
+        SlowConsumerPolicy slowConsumerPolicy = SlowConsumerPolicy::DISCONNECT;
+        size_t coalesceWindow = 0; // microseconds to wait for more frames before writing, 0 to write at the end of the event loop turn
+
+        // broadcast batching
+        size_t batchWindow = 0; // microseconds to collect a channel's messages into a single frame, 0 to send every message on its own
+        size_t batchSize = 64; // messages after which a batch is sent without waiting for the window
+
+        // direct messages
+        size_t maxRecipients = 256; // nicknames a multicast message can be addressed to
+
+        // large payloads (clients that negotiated the varint feature)
+        size_t maxFrameSize = 1024 * 1024; // bytes of a single message, larger data is sent in chunks
+        size_t chunkQueueLimit = 8 * 1024 * 1024; // bytes of chunks queued for a client, newer chunks are dropped above it
+        size_t chunkRate = 4 * 1024 * 1024; // bytes a second of chunks read from a client, 0 for no limit
+
+        // compression (clients that negotiated the deflate feature)
+        size_t compressionThreshold = 128; // bytes, smaller messages are sent uncompressed, 0 to never compress
+
+        // session resume (clients that negotiated the resume feature)
+        size_t resumeTimeout = 30000; // milliseconds a dropped client's session is kept for it to resume, 0 to never resume
+
+        // federation, every pair of servers needs one link, so every server lists only the servers to dial
+        std::string nodeName; // identifies the server to its peers, unique in the cluster
+        uint16_t peerPort = 0; // port the links of the other servers are accepted on, none if 0
+        std::string peerAddress = "127.0.0.1"; // address the peer port is bound to, another one only with a secret
+        std::string peerSecret; // shared by the servers of the cluster, the links that do not present it are dropped
+        std::vector<std::string> peers; // host:port of the servers to link to
+        size_t peerQueueLimit = 16 * 1024 * 1024; // bytes queued for a peer, the link is dropped and redialed above it
+        size_t peerReconnect = 1000; // milliseconds between the attempts to dial a peer
+
+        // hot restart, a new process takes the listening sockets and the clients over from the running one
+        std::string handoffPath; // Unix domain socket to take over from (if a server listens on it) and to listen on, none if empty
+        size_t handoffTimeout = 2000; // milliseconds the writes in flight get to finish, the clients still writing are dropped
+
+        // history
+        size_t historySize = 100; // messages kept in memory per channel
+        size_t historyReplay = 20; // messages sent on login and join
+        size_t historyLimit = 1000; // messages sent to a client that asks for everything since its last message
+        std::string logPath; // append-only message log, none if empty
+        size_t logCapacity = 1024 * 1024 * 1024; // bytes
+        size_t logSyncInterval = 100; // milliseconds between the log flushes to disk
+
+        // metrics
+        std::string metricsFile; // file the metrics are periodically written to, none if empty
+        size_t metricsInterval = 10000; // milliseconds between the metrics file updates
+        uint16_t adminPort = 0; // local port the metrics are served on, none if 0
+    };
+}
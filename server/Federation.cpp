@@ -0,0 +1,315 @@
+//
+//  Chat server
+//
+
+#include <algorithm>
+#include <stdexcept>
+#include "Federation.hpp"
+#include "Peer.hpp"
+#include "Server.hpp"
+
+namespace chat
+{
+    Federation::Federation(const std::shared_ptr<spdlog::logger>& l,
+                           boost::asio::io_service& s,
+                           Server& serv):
+        logger(l),
+        ioService(s),
+        work(new boost::asio::io_service::work(s)),
+        server(serv)
+    {
+        start();
+    }
+
+    Federation::~Federation()
+    {
+    }
+
+    void Federation::start()
+    {
+        const Config& config = server.getConfig();
+        stopped = false;
+
+        if (config.peerPort)
+        {
+            boost::asio::ip::tcp::endpoint endpoint(boost::asio::ip::make_address(config.peerAddress), config.peerPort);
+
+            // the links can claim and release any nickname, so only the servers that know the secret are let in
+            if (!endpoint.address().is_loopback() && config.peerSecret.empty())
+                throw std::runtime_error("Accepting the links of the other servers on " + config.peerAddress + " needs a peer secret");
+
+            acceptor.reset(new boost::asio::ip::tcp::acceptor(ioService));
+            acceptor->open(endpoint.protocol());
+            acceptor->set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
+            acceptor->bind(endpoint);
+            acceptor->listen();
+
+            accept();
+        }
+
+        boost::asio::ip::tcp::resolver resolver(ioService);
+
+        for (const std::string& address : config.peers)
+        {
+            size_t separator = address.rfind(':');
+            if (separator == std::string::npos)
+                throw std::runtime_error("Invalid peer address " + address);
+
+            boost::asio::ip::tcp::resolver::query query(address.substr(0, separator), address.substr(separator + 1));
+            std::shared_ptr<Peer> peer = std::make_shared<Peer>(logger, ioService, *this, address, resolver.resolve(query)->endpoint());
+
+            peers.push_back(peer);
+            peer->start();
+        }
+
+        logger->info("Federation started (node: {0}, peer address: {1}, peer port: {2}, peers: {3})",
+                     config.nodeName, config.peerAddress, config.peerPort, config.peers.size());
+    }
+
+    const Config& Federation::getConfig() const
+    {
+        return server.getConfig();
+    }
+
+    void Federation::accept()
+    {
+        std::shared_ptr<boost::asio::ip::tcp::socket> socket = std::make_shared<boost::asio::ip::tcp::socket>(ioService);
+
+        acceptor->async_accept(*socket, [this, socket](boost::system::error_code error)
+        {
+            if (!error)
+            {
+                std::shared_ptr<Peer> peer = std::make_shared<Peer>(logger, ioService, *this, std::move(*socket));
+                peers.push_back(peer);
+                peer->start();
+
+                accept();
+            }
+        });
+    }
+
+    void Federation::relayFrame(const FramePtr& frame)
+    {
+        relayFrame(frame, std::vector<uint64_t>());
+    }
+
+    void Federation::relayFrame(const FramePtr& frame, std::vector<uint64_t> links)
+    {
+        relays.push(Relay{frame, std::move(links)});
+
+        // wake the federation's thread up only if it is not already going to process the queue
+        if (!relayScheduled.exchange(true))
+            ioService.post([this]() { processRelays(); });
+    }
+
+    void Federation::processRelays()
+    {
+        relayScheduled.store(false);
+
+        // the same frame goes to every peer, however many of its clients it is for
+        Relay relay;
+        while (relays.pop(relay))
+        {
+            for (size_t i = 0; i < peers.size(); ++i)
+            {
+                if (relay.links.empty() ||
+                    std::find(relay.links.begin(), relay.links.end(), peers[i]->getId()) != relay.links.end())
+                    peers[i]->sendFrame(relay.frame);
+            }
+        }
+    }
+
+    void Federation::claimNickname(const std::string& nickname, std::function<void(bool)> callback)
+    {
+        ioService.post([this, nickname, callback]()
+        {
+            uint64_t request = nextRequest++;
+            Claim& claim = claims[request];
+            claim.callback = callback;
+
+            for (const auto& peer : peers)
+                if (peer->isEstablished()) claim.links.push_back(peer->getId());
+
+            if (claim.links.empty())
+            {
+                claims.erase(request);
+                callback(true);
+                return;
+            }
+
+            for (const auto& peer : peers)
+                if (peer->isEstablished()) peer->sendClaim(nickname, request);
+        });
+    }
+
+    void Federation::releaseNickname(const std::string& nickname)
+    {
+        ioService.post([this, nickname]()
+        {
+            for (const auto& peer : peers)
+                if (peer->isEstablished()) peer->sendRelease(nickname);
+        });
+    }
+
+    void Federation::claimLocalNicknames()
+    {
+        ioService.post([this]()
+        {
+            std::vector<std::string> nicknames = server.getLocalNicknames();
+
+            for (const auto& peer : peers)
+                if (peer->isEstablished())
+                    for (const std::string& nickname : nicknames) peer->sendClaim(nickname, 0);
+        });
+    }
+
+    void Federation::completeClaim(uint64_t link, uint64_t request, bool accepted)
+    {
+        auto i = claims.find(request);
+        if (i == claims.end()) return;
+
+        Claim& claim = i->second;
+        auto l = std::find(claim.links.begin(), claim.links.end(), link);
+        if (l == claim.links.end()) return;
+
+        claim.links.erase(l);
+        if (!accepted) claim.rejected = true;
+
+        if (claim.links.empty())
+        {
+            std::function<void(bool)> callback = std::move(claim.callback);
+            bool rejected = claim.rejected;
+            claims.erase(i);
+
+            callback(!rejected);
+        }
+    }
+
+    bool Federation::establish(Peer& peer)
+    {
+        const std::string& name = peer.getName();
+
+        if (name == getConfig().nodeName)
+        {
+            logger->error("Peer {0} has the name of this server", name);
+            return false;
+        }
+
+        for (const auto& other : peers)
+        {
+            if (other.get() != &peer && other->isEstablished() && other->getName() == name)
+            {
+                logger->error("Duplicate link to {0}, every pair of servers needs only one", name);
+                return false;
+            }
+        }
+
+        peer.setId(nextLink++);
+        logger->info("Linked to {0}", name);
+
+        // the peer learns about the clients logged in while the link was down, the answers need no waiting for
+        for (const std::string& nickname : server.getLocalNicknames())
+            peer.sendClaim(nickname, 0);
+
+        return true;
+    }
+
+    void Federation::handleMessage(Peer& peer, const MessageView& message)
+    {
+        switch (message.type)
+        {
+            case Message::Type::TEXT:
+                // stamped and stored like the messages of this server's clients
+                server.deliverFrame(server.getHistory().record(message.toMessage()), message.channel.to_string());
+                break;
+            case Message::Type::STATUS:
+            case Message::Type::CHUNK:
+                server.deliverFrame(std::make_shared<const Frame>(message), message.channel.to_string());
+                break;
+            case Message::Type::DIRECT:
+            case Message::Type::MULTICAST:
+            {
+                // the recipients logged in on other servers get it from the sender's server, which is not told
+                // about the ones here that can not take it
+                std::vector<std::string> unreachable;
+                server.sendDirectFrame(std::make_shared<const Frame>(message), Server::getRecipients(message), nullptr, unreachable);
+                break;
+            }
+            case Message::Type::CLAIM:
+            {
+                std::string nickname = message.nickname.to_string();
+
+                if (message.body.empty())
+                {
+                    bool accepted = server.claimNickname(nickname, Session{0, SlotHandle(), peer.getId(), std::string(), false});
+
+                    if (!accepted && !message.timestamp)
+                        logger->warn("{0} is logged in on both this server and {1}", nickname, peer.getName());
+
+                    peer.sendClaimReply(nickname, message.timestamp, accepted);
+                }
+                else
+                    completeClaim(peer.getId(), message.timestamp, message.body == "accepted");
+                break;
+            }
+            case Message::Type::RELEASE:
+                server.releasePeerNickname(message.nickname.to_string(), peer.getId());
+                break;
+            default:
+                logger->error("Invalid message from peer {0}", peer.getName());
+                peer.disconnect();
+                break;
+        }
+    }
+
+    void Federation::removePeer(Peer& peer)
+    {
+        uint64_t link = peer.getId();
+
+        if (link)
+        {
+            server.releasePeerNicknames(link);
+
+            // the peer can not answer anymore, its claims are decided without it
+            std::vector<uint64_t> requests;
+            for (const auto& claim : claims) requests.push_back(claim.first);
+            for (uint64_t request : requests) completeClaim(link, request, true);
+        }
+
+        // accepted links are not redialed, they are forgotten once the current handler is done with them
+        if (!peer.isDialed())
+        {
+            Peer* removed = &peer;
+            ioService.post([this, removed]()
+            {
+                peers.erase(std::remove_if(peers.begin(), peers.end(),
+                                           [removed](const std::shared_ptr<Peer>& p) { return p.get() == removed; }),
+                            peers.end());
+            });
+        }
+    }
+
+    void Federation::stop()
+    {
+        if (stopped) return;
+        stopped = true;
+
+        if (acceptor) acceptor->close();
+        acceptor.reset();
+
+        for (const auto& peer : peers) peer->close();
+        peers.clear();
+
+        // the claims waiting for the peers are decided without them
+        std::unordered_map<uint64_t, Claim> waiting;
+        waiting.swap(claims);
+        for (const auto& claim : waiting)
+            claim.second.callback(!claim.second.rejected);
+    }
+
+    void Federation::close()
+    {
+        stop();
+        work.reset();
+    }
+}
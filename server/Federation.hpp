@@ -0,0 +1,109 @@
+//
+//  Chat server
+//
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <boost/asio.hpp>
+#include "spdlog/spdlog.h"
+#include "Config.hpp"
+#include "Frame.hpp"
+#include "Message.hpp"
+#include "Queue.hpp"
+
+namespace chat
+{
+    class Peer;
+    class Server;
+
+    // Links this server to the other servers of the cluster. Every frame broadcast on this server is
+    // relayed once to every peer, which delivers it to its own clients, and the nicknames are claimed
+    // on all the linked peers before a login succeeds. Runs on its own event loop, so a slow peer link
+    // never holds up the shards.
+    class Federation final
+    {
+    public:
+        Federation(const std::shared_ptr<spdlog::logger>& l,
+                   boost::asio::io_service& s,
+                   Server& serv);
+        ~Federation();
+
+        Federation(const Federation&) = delete;
+        Federation& operator=(const Federation&) = delete;
+
+        inline boost::asio::io_service& getIoService() const
+        {
+            return ioService;
+        }
+
+        const Config& getConfig() const;
+
+        // hand a frame broadcast on this server to all the peers (can be called from any thread)
+        void relayFrame(const FramePtr& frame);
+        // hand a direct frame to the peers with the links its recipients are logged in through
+        void relayFrame(const FramePtr& frame, std::vector<uint64_t> links);
+
+        // ask all the linked peers whether the nickname is free, the callback runs on the federation's thread
+        void claimNickname(const std::string& nickname, std::function<void(bool)> callback);
+        // tell the peers the nickname claimed on this server is free again (can be called from any thread)
+        void releaseNickname(const std::string& nickname);
+        // claim the nicknames of all the clients of this server again on the linked peers, after the clients
+        // handed over to a process that failed to take them are back (can be called from any thread)
+        void claimLocalNicknames();
+
+        // called by the peers from the federation's thread
+        bool establish(Peer& peer);
+        void handleMessage(Peer& peer, const MessageView& message);
+        void removePeer(Peer& peer);
+
+        // open the peer port and dial the peers (called from the federation's thread after a stop)
+        void start();
+        // close the peer port and the links, the event loop keeps running so the links can be started again
+        void stop();
+        // stop and let the event loop return
+        void close();
+
+    private:
+        void accept();
+        void processRelays();
+        void completeClaim(uint64_t link, uint64_t request, bool accepted);
+
+        std::shared_ptr<spdlog::logger> logger;
+        boost::asio::io_service& ioService;
+        std::unique_ptr<boost::asio::io_service::work> work;
+        Server& server;
+
+        std::unique_ptr<boost::asio::ip::tcp::acceptor> acceptor;
+        std::vector<std::shared_ptr<Peer>> peers;
+        uint64_t nextLink = 1; // link ids are never reused, so stale claims of a dropped link are told apart
+        bool stopped = false;
+
+        // nickname claim waiting for the answers of the peers
+        struct Claim
+        {
+            std::vector<uint64_t> links; // peers that have not answered yet
+            bool rejected = false;
+            std::function<void(bool)> callback;
+        };
+
+        std::unordered_map<uint64_t, Claim> claims;
+        uint64_t nextRequest = 1; // 0 is for the claims that need no answer
+
+        // frame on its way to the peers
+        struct Relay
+        {
+            FramePtr frame;
+            std::vector<uint64_t> links; // the frame is only for these peers if not empty
+        };
+
+        Queue<Relay> relays;
+        std::atomic<bool> relayScheduled{false};
+    };
+}
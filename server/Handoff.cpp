@@ -0,0 +1,222 @@
+//
+//  Chat server
+//
+
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "cereal/archives/binary.hpp"
+#include "Handoff.hpp"
+
+namespace chat
+{
+    static const time_t RECEIVE_TIMEOUT = 30; // seconds, the old process waits at most for its writes in flight
+
+    // a new process that goes away fails the handoff instead of killing the running one
+#ifdef MSG_NOSIGNAL
+    static const int SEND_FLAGS = MSG_NOSIGNAL;
+#else
+    static const int SEND_FLAGS = 0;
+#endif
+
+    struct RecordHeader
+    {
+        uint8_t kind;
+        uint8_t hasDescriptor;
+        uint8_t reserved[2];
+        uint32_t stateSize; // bytes of the client's session that follow
+    };
+
+    static std::runtime_error systemError(const char* call)
+    {
+        return std::runtime_error(std::string(call) + ": " + std::strerror(errno));
+    }
+
+    HandoffChannel::HandoffChannel(int f):
+        fd(f)
+    {
+        timeval timeout{RECEIVE_TIMEOUT, 0};
+        ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+#ifdef SO_NOSIGPIPE
+        int enabled = 1;
+        ::setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &enabled, sizeof(enabled));
+#endif
+    }
+
+    HandoffChannel::~HandoffChannel()
+    {
+        if (fd != -1) ::close(fd);
+    }
+
+    int HandoffChannel::connect(const std::string& path)
+    {
+        sockaddr_un address;
+        std::memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(address.sun_path)) return -1;
+        std::memcpy(address.sun_path, path.data(), path.size());
+
+        int socketFd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (socketFd < 0) return -1;
+
+        if (::connect(socketFd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) < 0)
+        {
+            ::close(socketFd);
+            return -1;
+        }
+
+        return socketFd;
+    }
+
+    void HandoffChannel::send(const HandoffRecord& record)
+    {
+        std::string state;
+        if (record.kind == HandoffRecord::Kind::CLIENT)
+        {
+            std::ostringstream stream;
+            {
+                cereal::BinaryOutputArchive archive(stream);
+                archive(record.state);
+            }
+            state = stream.str();
+        }
+
+        RecordHeader header;
+        std::memset(&header, 0, sizeof(header));
+        header.kind = static_cast<uint8_t>(record.kind);
+        header.hasDescriptor = record.fd != -1;
+        header.stateSize = static_cast<uint32_t>(state.size());
+
+        iovec vector;
+        vector.iov_base = &header;
+        vector.iov_len = sizeof(header);
+
+        msghdr message;
+        std::memset(&message, 0, sizeof(message));
+        message.msg_iov = &vector;
+        message.msg_iovlen = 1;
+
+        char control[CMSG_SPACE(sizeof(int))];
+        std::memset(control, 0, sizeof(control));
+
+        if (record.fd != -1)
+        {
+            message.msg_control = control;
+            message.msg_controllen = sizeof(control);
+
+            cmsghdr* controlMessage = CMSG_FIRSTHDR(&message);
+            controlMessage->cmsg_level = SOL_SOCKET;
+            controlMessage->cmsg_type = SCM_RIGHTS;
+            controlMessage->cmsg_len = CMSG_LEN(sizeof(int));
+            std::memcpy(CMSG_DATA(controlMessage), &record.fd, sizeof(int));
+        }
+
+        ssize_t sent;
+        do
+            sent = ::sendmsg(fd, &message, SEND_FLAGS);
+        while (sent < 0 && errno == EINTR);
+
+        if (sent < 0) throw systemError("sendmsg");
+        if (static_cast<size_t>(sent) < sizeof(header))
+            sendAll(reinterpret_cast<const char*>(&header) + sent, sizeof(header) - static_cast<size_t>(sent));
+
+        sendAll(state.data(), state.size());
+    }
+
+    bool HandoffChannel::receive(HandoffRecord& record)
+    {
+        RecordHeader header;
+
+        iovec vector;
+        vector.iov_base = &header;
+        vector.iov_len = sizeof(header);
+
+        char control[CMSG_SPACE(sizeof(int))];
+
+        msghdr message;
+        std::memset(&message, 0, sizeof(message));
+        message.msg_iov = &vector;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+
+        int flags = MSG_WAITALL;
+#ifdef MSG_CMSG_CLOEXEC
+        flags |= MSG_CMSG_CLOEXEC;
+#endif
+
+        ssize_t received;
+        do
+            received = ::recvmsg(fd, &message, flags);
+        while (received < 0 && errno == EINTR);
+
+        if (received < 0) throw systemError("recvmsg");
+        if (received == 0) return false;
+
+        record = HandoffRecord();
+
+        for (cmsghdr* controlMessage = CMSG_FIRSTHDR(&message); controlMessage; controlMessage = CMSG_NXTHDR(&message, controlMessage))
+        {
+            if (controlMessage->cmsg_level == SOL_SOCKET && controlMessage->cmsg_type == SCM_RIGHTS)
+                std::memcpy(&record.fd, CMSG_DATA(controlMessage), sizeof(int));
+        }
+
+        if (static_cast<size_t>(received) < sizeof(header))
+            receiveAll(reinterpret_cast<char*>(&header) + received, sizeof(header) - static_cast<size_t>(received));
+
+        if (header.hasDescriptor && record.fd == -1)
+            throw std::runtime_error("Handoff record without its descriptor");
+
+        record.kind = static_cast<HandoffRecord::Kind>(header.kind);
+
+        if (header.stateSize)
+        {
+            std::string state(header.stateSize, '\0');
+            receiveAll(&state[0], state.size());
+
+            std::istringstream stream(state);
+            cereal::BinaryInputArchive archive(stream);
+            archive(record.state);
+        }
+
+        return true;
+    }
+
+    void HandoffChannel::sendAll(const char* data, size_t size)
+    {
+        while (size)
+        {
+            ssize_t sent = ::send(fd, data, size, SEND_FLAGS);
+            if (sent < 0)
+            {
+                if (errno == EINTR) continue;
+                throw systemError("send");
+            }
+
+            data += sent;
+            size -= static_cast<size_t>(sent);
+        }
+    }
+
+    void HandoffChannel::receiveAll(char* data, size_t size)
+    {
+        while (size)
+        {
+            ssize_t received = ::recv(fd, data, size, 0);
+            if (received < 0)
+            {
+                if (errno == EINTR) continue;
+                throw systemError("recv");
+            }
+            if (received == 0) throw std::runtime_error("Handoff channel closed");
+
+            data += received;
+            size -= static_cast<size_t>(received);
+        }
+    }
+}
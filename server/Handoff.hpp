@@ -0,0 +1,79 @@
+//
+//  Chat server
+//
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "cereal/types/string.hpp"
+#include "cereal/types/vector.hpp"
+
+namespace chat
+{
+    // Session of a client handed over to the process taking over, enough to resume it without a new login
+    struct ClientState
+    {
+        std::string nickname;
+        bool loggedIn = false;
+        bool helloReceived = false;
+        bool channelFields = false;
+        bool varint = false;
+        bool deflate = false;
+        bool batch = false;
+        bool heartbeat = false;
+        bool resumable = false;
+        std::string resumeToken;
+        std::vector<std::string> channels;
+        std::string pending; // bytes received but not handled yet, from the start of a (possibly incomplete) frame
+
+        template <class Archive>
+        void serialize(Archive& archive)
+        {
+            archive(nickname, loggedIn, helloReceived, channelFields, varint, deflate, batch, heartbeat, resumable, resumeToken, channels, pending);
+        }
+    };
+
+    // Socket passed from the running process to the one taking over
+    struct HandoffRecord
+    {
+        enum class Kind: uint8_t
+        {
+            LISTENER,
+            CLIENT, // with its session
+            END // nothing follows, sent back once everything arrived, then the old process exits
+        };
+
+        Kind kind = Kind::END;
+        int fd = -1;
+        ClientState state;
+    };
+
+    // Blocking end of the Unix domain socket of a hot restart. Every record is a fixed header sent with
+    // its descriptor (SCM_RIGHTS), followed by the session of a client. The header is read on its own, so
+    // the descriptor always arrives with the header it was sent with.
+    class HandoffChannel final
+    {
+    public:
+        explicit HandoffChannel(int f);
+        ~HandoffChannel();
+
+        HandoffChannel(const HandoffChannel&) = delete;
+        HandoffChannel& operator=(const HandoffChannel&) = delete;
+
+        // connects to the handoff socket of a running server, returns -1 if none listens on the path
+        static int connect(const std::string& path);
+
+        // the descriptor stays open, the other process gets its own copy (throws on failure)
+        void send(const HandoffRecord& record);
+        // returns false once the other process has closed the channel (throws on failure)
+        bool receive(HandoffRecord& record);
+
+    private:
+        void sendAll(const char* data, size_t size);
+        void receiveAll(char* data, size_t size);
+
+        int fd;
+    };
+}
@@ -0,0 +1,310 @@
+//
+//  Chat server
+//
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "Config.hpp"
+#include "Frame.hpp"
+#include "Message.hpp"
+#include "MessageCodec.hpp"
+#include "MessageLog.hpp"
+
+namespace chat
+{
+    // Position of a client in the history of a channel
+    struct HistoryCursor
+    {
+        std::string channel;
+        uint64_t since = 0; // timestamp of the last message read
+        size_t remaining = 0; // messages left to read
+    };
+
+    // Recent messages of every channel kept in memory for replay, and optionally all the messages
+    // in the on-disk log for clients that were away for longer. Shared by all the shards: the rings are
+    // spread over stripes with their own locks, so the shards recording and replaying different channels
+    // do not wait for each other, and only the log (if there is one) is appended to under a single lock.
+    // The replays read the log without that lock, so a scan of cold records never holds up the appends.
+    class History final
+    {
+    public:
+        static const size_t LOG_SCAN_LIMIT = 4096; // log records scanned by a single read
+        static const size_t STRIPES = 64; // locks the channels' rings are spread over
+
+        explicit History(const Config& c):
+            config(c)
+        {
+            if (!config.logPath.empty())
+            {
+                log.reset(new MessageLog(config.logPath, config.logCapacity,
+                                         std::chrono::milliseconds(config.logSyncInterval)));
+
+                // load the newest records into the rings, everything older is read from the log
+                size_t count = log->getRecordCount();
+                size_t start = count > config.historySize ? count - config.historySize : 0;
+                if (start) recoveredTimestamp = log->getRecord(start - 1).timestamp;
+                if (count) lastTimestamp.store(log->getRecord(count - 1).timestamp);
+
+                for (size_t i = start; i < count; ++i)
+                {
+                    MessageLog::Record record = log->getRecord(i);
+
+                    // a record that passed its checksum but does not decode is left to the log
+                    MessageView message;
+                    try
+                    {
+                        MessageCodec::decode(reinterpret_cast<const char*>(record.payload), record.payloadSize, message);
+                    }
+                    catch (const std::exception&)
+                    {
+                        continue;
+                    }
+
+                    std::string channel = message.channel.to_string();
+                    Ring& ring = getStripe(channel).rings[channel];
+                    ring.entries.push_back(Entry{record.timestamp, std::make_shared<const Frame>(record.payload, record.payloadSize)});
+                    ring.evictedTimestamp = recoveredTimestamp;
+                }
+            }
+        }
+
+        History(const History&) = delete;
+        History& operator=(const History&) = delete;
+
+        inline bool isLogFull() const { return logFull.load(std::memory_order_relaxed); }
+
+        // the messages of a channel are kept in memory only while a shard has members in it (the messages to
+        // everyone always are), so the names clients make up do not pile up
+        void openChannel(const std::string& channel)
+        {
+            Stripe& stripe = getStripe(channel);
+            std::lock_guard<std::mutex> lock(stripe.mutex);
+
+            ++stripe.rings[channel].shards;
+        }
+
+        void closeChannel(const std::string& channel)
+        {
+            Stripe& stripe = getStripe(channel);
+            std::lock_guard<std::mutex> lock(stripe.mutex);
+
+            auto i = stripe.rings.find(channel);
+            if (i != stripe.rings.end() && i->second.shards && --i->second.shards == 0)
+                stripe.rings.erase(i);
+        }
+
+        // stamps the message with a unique timestamp, encodes it and stores the frame
+        FramePtr record(Message message)
+        {
+            FramePtr frame;
+
+            if (log)
+            {
+                // the log's records must be in timestamp order, so the stamp is taken with the log's lock
+                std::lock_guard<std::mutex> lock(logMutex);
+
+                message.timestamp = stamp();
+                frame = std::make_shared<const Frame>(message);
+
+                // the log records have 16-bit sizes, larger messages are only kept in memory
+                if (!logFull.load(std::memory_order_relaxed) && frame->hasLegacyHeader() && !log->append(message.timestamp, *frame))
+                    logFull.store(true, std::memory_order_relaxed);
+            }
+            else
+            {
+                message.timestamp = stamp();
+                frame = std::make_shared<const Frame>(message);
+            }
+
+            Stripe& stripe = getStripe(message.channel);
+            std::lock_guard<std::mutex> lock(stripe.mutex);
+
+            auto ring = stripe.rings.find(message.channel);
+            if (ring == stripe.rings.end())
+            {
+                if (!message.channel.empty()) return frame;
+                ring = stripe.rings.insert(std::make_pair(message.channel, Ring())).first;
+            }
+
+            // another shard may have stored a newer message of the channel in the meantime
+            std::deque<Entry>& entries = ring->second.entries;
+            auto position = entries.end();
+            while (position != entries.begin() && (position - 1)->timestamp > message.timestamp) --position;
+            entries.insert(position, Entry{message.timestamp, frame});
+
+            if (entries.size() > config.historySize)
+            {
+                ring->second.evictedTimestamp = entries.front().timestamp;
+                entries.pop_front();
+            }
+
+            return frame;
+        }
+
+        // cursor for the messages newer than the timestamp, or for the last few messages if it is 0
+        HistoryCursor seek(const std::string& channel, uint64_t since)
+        {
+            HistoryCursor cursor;
+            cursor.channel = channel;
+            cursor.since = since;
+            cursor.remaining = config.historyLimit;
+
+            if (!since)
+            {
+                cursor.remaining = config.historyReplay;
+
+                Stripe& stripe = getStripe(channel);
+                std::lock_guard<std::mutex> lock(stripe.mutex);
+
+                auto i = stripe.rings.find(channel);
+                if (i != stripe.rings.end() && i->second.entries.size() > config.historyReplay)
+                    cursor.since = i->second.entries[i->second.entries.size() - config.historyReplay - 1].timestamp;
+                else if (i != stripe.rings.end())
+                    cursor.since = i->second.evictedTimestamp;
+
+                // the last few messages come only from memory
+                cursor.since = std::max(cursor.since, recoveredTimestamp);
+            }
+
+            return cursor;
+        }
+
+        // reads at most maxFrames frames and advances the cursor, returns false when there is nothing left to read
+        // (throws if a log record does not decode)
+        bool read(HistoryCursor& cursor, std::vector<FramePtr>& frames, size_t maxFrames)
+        {
+            if (!cursor.remaining) return false;
+            maxFrames = std::min(maxFrames, cursor.remaining);
+
+            Stripe& stripe = getStripe(cursor.channel);
+            uint64_t ringStart = 0;
+            {
+                std::lock_guard<std::mutex> lock(stripe.mutex);
+
+                auto i = stripe.rings.find(cursor.channel);
+                if (i != stripe.rings.end()) ringStart = i->second.evictedTimestamp;
+            }
+            ringStart = std::max(ringStart, recoveredTimestamp);
+
+            // the cursor is older than the ring, so read from the log (or skip what was lost), without the
+            // appends' lock as the records are never changed once they are counted
+            if (cursor.since < ringStart)
+            {
+                if (log && log->findRecord(cursor.since) < log->getRecordCount())
+                    return readLog(cursor, frames, maxFrames);
+
+                cursor.since = ringStart;
+            }
+
+            std::lock_guard<std::mutex> lock(stripe.mutex);
+
+            auto i = stripe.rings.find(cursor.channel);
+            if (i == stripe.rings.end()) return false;
+
+            const std::deque<Entry>& entries = i->second.entries;
+            auto entry = std::upper_bound(entries.begin(), entries.end(), cursor.since,
+                                          [](uint64_t timestamp, const Entry& e) { return timestamp < e.timestamp; });
+
+            size_t count = 0;
+            for (; entry != entries.end() && count < maxFrames; ++entry, ++count)
+            {
+                frames.push_back(entry->frame);
+                cursor.since = entry->timestamp;
+            }
+
+            cursor.remaining -= count;
+
+            return cursor.remaining && entry != entries.end();
+        }
+
+    private:
+        struct Entry
+        {
+            uint64_t timestamp;
+            FramePtr frame;
+        };
+
+        struct Ring
+        {
+            std::deque<Entry> entries;
+            uint64_t evictedTimestamp = 0; // timestamp of the last message that no longer fits
+            size_t shards = 0; // with members in the channel
+        };
+
+        struct Stripe
+        {
+            std::mutex mutex;
+            std::unordered_map<std::string, Ring> rings; // empty name for the messages to everyone
+        };
+
+        Stripe& getStripe(const std::string& channel)
+        {
+            return stripes[std::hash<std::string>()(channel) % STRIPES];
+        }
+
+        // the next unique timestamp, the current time unless messages were stamped faster than a millisecond
+        uint64_t stamp()
+        {
+            uint64_t now = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::system_clock::now().time_since_epoch()).count());
+
+            uint64_t last = lastTimestamp.load(std::memory_order_relaxed);
+            uint64_t timestamp;
+            do
+                timestamp = std::max(now, last + 1);
+            while (!lastTimestamp.compare_exchange_weak(last, timestamp, std::memory_order_relaxed));
+
+            return timestamp;
+        }
+
+        // reads only the records counted when it starts, the ones appended meanwhile are left to the next read
+        bool readLog(HistoryCursor& cursor, std::vector<FramePtr>& frames, size_t maxFrames)
+        {
+            size_t position = log->findRecord(cursor.since);
+            size_t count = log->getRecordCount(); // not less than the position
+            size_t end = std::min(count, position + LOG_SCAN_LIMIT);
+            size_t read = 0;
+
+            for (; position < end && read < maxFrames; ++position)
+            {
+                MessageLog::Record record = log->getRecord(position);
+                cursor.since = record.timestamp;
+
+                MessageView message;
+                MessageCodec::decode(reinterpret_cast<const char*>(record.payload), record.payloadSize, message);
+
+                if (message.channel == cursor.channel)
+                {
+                    frames.push_back(std::make_shared<const Frame>(record.payload, record.payloadSize));
+                    ++read;
+                }
+            }
+
+            cursor.remaining -= read;
+
+            // the newest messages may be only in the ring
+            return cursor.remaining != 0;
+        }
+
+        const Config& config;
+        Stripe stripes[STRIPES];
+        std::atomic<uint64_t> lastTimestamp{0};
+        uint64_t recoveredTimestamp = 0; // last timestamp in the log when the server started
+
+        std::mutex logMutex; // appends to the log, the reads take none
+        std::unique_ptr<MessageLog> log;
+        std::atomic<bool> logFull{false};
+    };
+}
@@ -0,0 +1,309 @@
+//
+//  Chat server
+//
+
+#ifdef CHAT_IO_URING
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+#include "IoRing.hpp"
+
+namespace chat
+{
+    static const uint16_t BUFFER_GROUP = 0;
+
+    static std::runtime_error systemError(const char* call)
+    {
+        return std::runtime_error(std::string(call) + ": " + std::strerror(errno));
+    }
+
+    IoRing::IoRing(boost::asio::io_service& s, unsigned entries, unsigned count, Handler h):
+        ioService(s),
+        handler(std::move(h)),
+        eventDescriptor(s)
+    {
+        try
+        {
+            // multishot receives need Linux 6.0
+            utsname name;
+            unsigned major = 0;
+            unsigned minor = 0;
+            if (uname(&name) != 0 || std::sscanf(name.release, "%u.%u", &major, &minor) != 2 || major < 6)
+                throw std::runtime_error("multishot receives need Linux 6.0 or newer");
+
+            io_uring_params params;
+            std::memset(&params, 0, sizeof(params));
+            params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+            params.cq_entries = entries * 4; // multishot operations complete many times
+
+            ringFd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+            if (ringFd < 0) throw systemError("io_uring_setup");
+
+            if (!(params.features & IORING_FEAT_SINGLE_MMAP))
+                throw std::runtime_error("io_uring lacks the single mmap feature");
+
+            std::vector<char> probeMemory(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op));
+            io_uring_probe* probe = reinterpret_cast<io_uring_probe*>(probeMemory.data());
+            if (syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_PROBE, probe, 256) < 0)
+                throw systemError("io_uring_register");
+
+            for (int operation : {IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SENDMSG, IORING_OP_ASYNC_CANCEL})
+                if (operation > probe->last_op || !(probe->ops[operation].flags & IO_URING_OP_SUPPORTED))
+                    throw std::runtime_error("io_uring lacks an operation");
+
+            // both queues share one mapping
+            ringMemorySize = std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                                      params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+            ringMemory = mmap(nullptr, ringMemorySize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+            if (ringMemory == MAP_FAILED)
+            {
+                ringMemory = nullptr;
+                throw systemError("mmap");
+            }
+
+            sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+            void* sqesMemory = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+            if (sqesMemory == MAP_FAILED) throw systemError("mmap");
+            sqes = static_cast<io_uring_sqe*>(sqesMemory);
+
+            char* ring = static_cast<char*>(ringMemory);
+            sqHead = reinterpret_cast<unsigned*>(ring + params.sq_off.head);
+            sqTail = reinterpret_cast<unsigned*>(ring + params.sq_off.tail);
+            sqFlags = reinterpret_cast<unsigned*>(ring + params.sq_off.flags);
+            sqMask = *reinterpret_cast<unsigned*>(ring + params.sq_off.ring_mask);
+            sqEntries = params.sq_entries;
+            sqLocalTail = *sqTail;
+
+            // the entries are always used in order
+            unsigned* sqArray = reinterpret_cast<unsigned*>(ring + params.sq_off.array);
+            for (unsigned i = 0; i < sqEntries; ++i) sqArray[i] = i;
+
+            cqHead = reinterpret_cast<unsigned*>(ring + params.cq_off.head);
+            cqTail = reinterpret_cast<unsigned*>(ring + params.cq_off.tail);
+            cqMask = *reinterpret_cast<unsigned*>(ring + params.cq_off.ring_mask);
+            cqes = reinterpret_cast<io_uring_cqe*>(ring + params.cq_off.cqes);
+
+            // provided buffers, the ring's size must be a power of two
+            for (bufferCount = 1; bufferCount < count && bufferCount < 32768; bufferCount <<= 1);
+
+            bufferRingSize = bufferCount * sizeof(io_uring_buf);
+            void* bufferRingMemory = mmap(nullptr, bufferRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (bufferRingMemory == MAP_FAILED) throw systemError("mmap");
+            // the tail is overlaid on the reserved field of the first entry (io_uring_buf_ring, whose
+            // flexible array member C++ lays out differently)
+            bufferRing = static_cast<io_uring_buf*>(bufferRingMemory);
+            bufferRingTail = &bufferRing[0].resv;
+
+            io_uring_buf_reg registration;
+            std::memset(&registration, 0, sizeof(registration));
+            registration.ring_addr = reinterpret_cast<uint64_t>(bufferRing);
+            registration.ring_entries = bufferCount;
+            registration.bgid = BUFFER_GROUP;
+            if (syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_PBUF_RING, &registration, 1) < 0)
+                throw systemError("io_uring_register");
+
+            buffers.resize(bufferCount * BUFFER_SIZE);
+            for (unsigned i = 0; i < bufferCount; ++i) recycleBuffer(static_cast<uint16_t>(i));
+            __atomic_store_n(bufferRingTail, bufferTail, __ATOMIC_RELEASE);
+
+            // the event loop learns about completions through the eventfd
+            eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (eventFd < 0) throw systemError("eventfd");
+            if (syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_EVENTFD, &eventFd, 1) < 0)
+                throw systemError("io_uring_register");
+
+            eventDescriptor.assign(eventFd);
+            eventFd = -1; // owned by the descriptor now
+        }
+        catch (...)
+        {
+            release();
+            throw;
+        }
+
+        wait();
+    }
+
+    IoRing::~IoRing()
+    {
+        release();
+    }
+
+    void IoRing::release()
+    {
+        if (eventFd != -1) ::close(eventFd);
+        if (bufferRing) munmap(bufferRing, bufferRingSize);
+        if (sqes) munmap(sqes, sqesSize);
+        if (ringMemory) munmap(ringMemory, ringMemorySize);
+        if (ringFd != -1) ::close(ringFd);
+
+        bufferRing = nullptr;
+        sqes = nullptr;
+        ringMemory = nullptr;
+        eventFd = ringFd = -1;
+    }
+
+    void IoRing::accept(int fd, uint64_t userData)
+    {
+        io_uring_sqe* sqe = getSqe();
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = fd;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_CLOEXEC;
+        sqe->user_data = userData;
+    }
+
+    void IoRing::receive(int fd, uint64_t userData)
+    {
+        io_uring_sqe* sqe = getSqe();
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = fd;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = BUFFER_GROUP;
+        sqe->user_data = userData;
+    }
+
+    void IoRing::send(int fd, const msghdr* message, uint64_t userData)
+    {
+        io_uring_sqe* sqe = getSqe();
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = fd;
+        sqe->addr = reinterpret_cast<uint64_t>(message);
+        sqe->len = 1;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = userData;
+    }
+
+    void IoRing::cancel(uint64_t target, uint64_t userData)
+    {
+        io_uring_sqe* sqe = getSqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = target;
+        sqe->user_data = userData;
+    }
+
+    void IoRing::close()
+    {
+        closed = true;
+
+        boost::system::error_code ignored;
+        eventDescriptor.close(ignored);
+    }
+
+    io_uring_sqe* IoRing::getSqe()
+    {
+        // a full queue is submitted right away
+        if (sqLocalTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) == sqEntries) submit();
+
+        io_uring_sqe* sqe = &sqes[sqLocalTail & sqMask];
+        std::memset(sqe, 0, sizeof(*sqe));
+        ++sqLocalTail;
+
+        scheduleSubmit();
+
+        return sqe;
+    }
+
+    void IoRing::scheduleSubmit()
+    {
+        // everything queued during this event loop turn goes in one system call
+        if (submitScheduled) return;
+        submitScheduled = true;
+
+        ioService.post([this]()
+        {
+            submitScheduled = false;
+            submit();
+        });
+    }
+
+    void IoRing::submit()
+    {
+        unsigned pending = sqLocalTail - *sqTail;
+        if (!pending || closed) return;
+
+        __atomic_store_n(sqTail, sqLocalTail, __ATOMIC_RELEASE);
+
+        while (syscall(__NR_io_uring_enter, ringFd, pending, 0, 0, nullptr, 0) < 0)
+        {
+            // the completions backed up in the kernel must be reaped before submitting more
+            if (errno == EBUSY)
+                reap();
+            else if (errno != EINTR && errno != EAGAIN)
+                throw systemError("io_uring_enter");
+        }
+    }
+
+    void IoRing::wait()
+    {
+        eventDescriptor.async_read_some(boost::asio::buffer(&eventCount, sizeof(eventCount)),
+                                        [this](const boost::system::error_code& error, std::size_t)
+        {
+            if (error == boost::asio::error::operation_aborted || closed) return;
+
+            reap();
+            wait();
+        });
+    }
+
+    void IoRing::reap()
+    {
+        for (;;)
+        {
+            unsigned head = *cqHead;
+            unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+
+            for (; head != tail && !closed; ++head)
+            {
+                const io_uring_cqe& cqe = cqes[head & cqMask];
+                uint64_t userData = cqe.user_data;
+                int result = cqe.res;
+                uint32_t flags = cqe.flags;
+
+                // the entry can be reused once the head moves past it, the provided buffer once the handler returns
+                __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+
+                if (flags & IORING_CQE_F_BUFFER)
+                {
+                    uint16_t id = static_cast<uint16_t>(flags >> IORING_CQE_BUFFER_SHIFT);
+                    handler(userData, result, flags, buffers.data() + id * BUFFER_SIZE);
+                    recycleBuffer(id);
+                }
+                else
+                    handler(userData, result, flags, nullptr);
+            }
+
+            __atomic_store_n(bufferRingTail, bufferTail, __ATOMIC_RELEASE);
+
+            if (closed) return;
+
+            // completions that did not fit in the queue wait in the kernel until it is asked for them
+            if (!(__atomic_load_n(sqFlags, __ATOMIC_ACQUIRE) & IORING_SQ_CQ_OVERFLOW)) return;
+
+            if (syscall(__NR_io_uring_enter, ringFd, 0, 0, IORING_ENTER_GETEVENTS, nullptr, 0) < 0 && errno != EINTR)
+                throw systemError("io_uring_enter");
+        }
+    }
+
+    void IoRing::recycleBuffer(uint16_t id)
+    {
+        io_uring_buf& buffer = bufferRing[bufferTail & (bufferCount - 1)];
+        buffer.addr = reinterpret_cast<uint64_t>(buffers.data() + id * BUFFER_SIZE);
+        buffer.len = BUFFER_SIZE;
+        buffer.bid = id;
+        ++bufferTail;
+    }
+}
+
+#endif
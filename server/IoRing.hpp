@@ -0,0 +1,91 @@
+//
+//  Chat server
+//
+
+#pragma once
+
+#ifdef CHAT_IO_URING
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+#include <boost/asio.hpp>
+#include <linux/io_uring.h>
+#include <sys/socket.h>
+
+namespace chat
+{
+    // Minimal io_uring of one event loop, driven through raw system calls. Multishot accepts and receives
+    // complete into a ring of provided buffers, and the operations queued during an event loop turn are
+    // submitted with a single system call at its end. The completions are signalled through an eventfd
+    // the event loop waits on, and reaped from the shared memory without system calls.
+    class IoRing final
+    {
+    public:
+        static const size_t BUFFER_SIZE = 4096; // of every provided buffer
+
+        // called for every completion, buffer holds the received bytes (only valid during the call)
+        typedef std::function<void(uint64_t userData, int result, uint32_t flags, const char* buffer)> Handler;
+
+        // throws if the kernel lacks io_uring or a feature used
+        IoRing(boost::asio::io_service& s, unsigned entries, unsigned bufferCount, Handler h);
+        ~IoRing();
+
+        IoRing(const IoRing&) = delete;
+        IoRing& operator=(const IoRing&) = delete;
+
+        void accept(int fd, uint64_t userData);
+        void receive(int fd, uint64_t userData);
+        // the message and its buffers must stay valid until the completion
+        void send(int fd, const msghdr* message, uint64_t userData);
+        void cancel(uint64_t target, uint64_t userData);
+
+        void close();
+
+    private:
+        io_uring_sqe* getSqe();
+        void scheduleSubmit();
+        void submit();
+        void wait();
+        void reap();
+        void recycleBuffer(uint16_t id);
+        void release();
+
+        boost::asio::io_service& ioService;
+        Handler handler;
+        int ringFd = -1;
+        int eventFd = -1;
+        boost::asio::posix::stream_descriptor eventDescriptor;
+        uint64_t eventCount = 0;
+        bool submitScheduled = false;
+        bool closed = false;
+
+        // submission queue
+        void* ringMemory = nullptr;
+        size_t ringMemorySize = 0;
+        io_uring_sqe* sqes = nullptr;
+        size_t sqesSize = 0;
+        unsigned* sqHead = nullptr;
+        unsigned* sqTail = nullptr;
+        unsigned* sqFlags = nullptr;
+        unsigned sqMask = 0;
+        unsigned sqEntries = 0;
+        unsigned sqLocalTail = 0; // queued, submitted once the tail is published
+
+        // completion queue
+        unsigned* cqHead = nullptr;
+        unsigned* cqTail = nullptr;
+        unsigned cqMask = 0;
+        io_uring_cqe* cqes = nullptr;
+
+        // provided buffers
+        io_uring_buf* bufferRing = nullptr;
+        uint16_t* bufferRingTail = nullptr;
+        size_t bufferRingSize = 0;
+        unsigned bufferCount = 0;
+        uint16_t bufferTail = 0;
+        std::vector<char> buffers;
+    };
+}
+
+#endif
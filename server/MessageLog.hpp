@@ -0,0 +1,273 @@
+//
+//  Chat server
+//
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "Frame.hpp"
+
+namespace chat
+{
+    // Append-only, memory-mapped log of frames. Every record is a 64-bit timestamp and the CRC-32 of the
+    // rest of the record, followed by the frame in its wire format (16-bit big endian length and the payload).
+    // The whole capacity is mapped up front and the file grows in steps, so appending is a memcpy. A background
+    // thread msyncs the appended records every sync interval (group fsync). The records are indexed by scanning
+    // the mapping on open, which stops at the first record torn or corrupted by a crash.
+    // A single thread appends at a time, while any number of threads read: the records and their index
+    // entries never move once written, and the record count is published after them.
+    class MessageLog final
+    {
+    public:
+        static const size_t TIMESTAMP_SIZE = sizeof(uint64_t);
+        static const size_t CHECKSUM_SIZE = sizeof(uint32_t);
+        static const size_t RECORD_HEADER_SIZE = TIMESTAMP_SIZE + CHECKSUM_SIZE;
+        static const size_t GROWTH = 16 * 1024 * 1024;
+        static const size_t INDEX_BLOCK_SIZE = 4096; // index entries allocated together
+
+        struct Record
+        {
+            uint64_t timestamp;
+            const uint8_t* payload;
+            size_t payloadSize;
+        };
+
+        MessageLog(const std::string& path, size_t c, std::chrono::milliseconds interval):
+            capacity(c),
+            syncInterval(interval)
+        {
+            fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+            if (fd == -1)
+                throw std::system_error(errno, std::system_category(), "Failed to open " + path);
+
+            struct stat fileStat;
+            if (::fstat(fd, &fileStat) == -1)
+            {
+                ::close(fd);
+                throw std::system_error(errno, std::system_category(), "Failed to stat " + path);
+            }
+
+            fileSize = std::min(static_cast<size_t>(fileStat.st_size), capacity);
+
+            void* address = ::mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (address == MAP_FAILED)
+            {
+                ::close(fd);
+                throw std::system_error(errno, std::system_category(), "Failed to map " + path);
+            }
+
+            data = static_cast<uint8_t*>(address);
+
+            // the smallest record has a one byte payload, so the table of the index blocks is sized up front
+            // and never moves under the readers
+            size_t maxRecords = capacity / (RECORD_HEADER_SIZE + Frame::HEADER_SIZE + 1) + 1;
+            indexBlocks.resize(maxRecords / INDEX_BLOCK_SIZE + 1);
+
+            recover();
+
+            syncedSize = writtenSize.load();
+            syncThread = std::thread(&MessageLog::syncLoop, this);
+        }
+
+        ~MessageLog()
+        {
+            {
+                std::lock_guard<std::mutex> lock(syncMutex);
+                stopping = true;
+            }
+            syncCondition.notify_one();
+            syncThread.join();
+
+            sync();
+            ::munmap(data, capacity);
+            ::close(fd);
+        }
+
+        MessageLog(const MessageLog&) = delete;
+        MessageLog& operator=(const MessageLog&) = delete;
+
+        // returns false if the log is full (called by one thread at a time)
+        bool append(uint64_t timestamp, const Frame& frame)
+        {
+            size_t offset = writtenSize.load(std::memory_order_relaxed);
+            size_t recordSize = RECORD_HEADER_SIZE + frame.getSize();
+
+            if (offset + recordSize > fileSize)
+            {
+                size_t newFileSize = std::min(capacity, std::max(fileSize + GROWTH, offset + recordSize));
+                if (offset + recordSize > newFileSize ||
+                    ::ftruncate(fd, static_cast<off_t>(newFileSize)) == -1)
+                    return false;
+
+                fileSize = newFileSize;
+            }
+
+            uint32_t checksum = getChecksum(timestamp, frame.getData(), frame.getSize());
+
+            std::memcpy(data + offset, &timestamp, TIMESTAMP_SIZE);
+            std::memcpy(data + offset + TIMESTAMP_SIZE, &checksum, CHECKSUM_SIZE);
+            std::memcpy(data + offset + RECORD_HEADER_SIZE, frame.getData(), frame.getSize());
+
+            addIndexEntry(IndexEntry{timestamp, offset});
+            writtenSize.store(offset + recordSize, std::memory_order_release);
+
+            return true;
+        }
+
+        // the records below the count can be read without a lock
+        inline size_t getRecordCount() const { return recordCount.load(std::memory_order_acquire); }
+
+        Record getRecord(size_t i) const
+        {
+            const IndexEntry& entry = getIndexEntry(i);
+            const uint8_t* record = data + entry.offset;
+            return Record{entry.timestamp,
+                record + RECORD_HEADER_SIZE + Frame::HEADER_SIZE,
+                static_cast<size_t>(record[RECORD_HEADER_SIZE] << 8 | record[RECORD_HEADER_SIZE + 1])};
+        }
+
+        // index of the first record newer than the timestamp, at most the record count
+        size_t findRecord(uint64_t since) const
+        {
+            size_t first = 0;
+            size_t last = getRecordCount();
+
+            while (first < last)
+            {
+                size_t middle = first + (last - first) / 2;
+                if (getIndexEntry(middle).timestamp <= since)
+                    first = middle + 1;
+                else
+                    last = middle;
+            }
+
+            return first;
+        }
+
+    private:
+        struct IndexEntry
+        {
+            uint64_t timestamp;
+            size_t offset;
+        };
+
+        inline const IndexEntry& getIndexEntry(size_t i) const
+        {
+            return indexBlocks[i / INDEX_BLOCK_SIZE][i % INDEX_BLOCK_SIZE];
+        }
+
+        // the entry is written before the count that lets the readers see it
+        void addIndexEntry(const IndexEntry& entry)
+        {
+            size_t count = recordCount.load(std::memory_order_relaxed);
+
+            std::unique_ptr<IndexEntry[]>& block = indexBlocks[count / INDEX_BLOCK_SIZE];
+            if (!block) block.reset(new IndexEntry[INDEX_BLOCK_SIZE]);
+            block[count % INDEX_BLOCK_SIZE] = entry;
+
+            recordCount.store(count + 1, std::memory_order_release);
+        }
+
+        // covers the timestamp and the frame, so a record is either whole or ignored
+        static uint32_t getChecksum(uint64_t timestamp, const uint8_t* frame, size_t frameSize)
+        {
+            uLong checksum = ::crc32(0L, Z_NULL, 0);
+            checksum = ::crc32(checksum, reinterpret_cast<const Bytef*>(&timestamp), TIMESTAMP_SIZE);
+            checksum = ::crc32(checksum, frame, static_cast<uInt>(frameSize));
+            return static_cast<uint32_t>(checksum);
+        }
+
+        // walks the records in the mapping and stops at the zeroed tail or at the first torn or corrupt
+        // record, everything after it is overwritten by the next appends
+        void recover()
+        {
+            size_t offset = 0;
+            uint64_t lastTimestamp = 0;
+
+            while (offset + RECORD_HEADER_SIZE + Frame::HEADER_SIZE <= fileSize)
+            {
+                const uint8_t* record = data + offset;
+                size_t payloadSize = static_cast<size_t>(record[RECORD_HEADER_SIZE] << 8 | record[RECORD_HEADER_SIZE + 1]);
+                size_t recordSize = RECORD_HEADER_SIZE + Frame::HEADER_SIZE + payloadSize;
+
+                if (!payloadSize || offset + recordSize > fileSize) break;
+
+                uint64_t timestamp;
+                uint32_t checksum;
+                std::memcpy(&timestamp, record, TIMESTAMP_SIZE);
+                std::memcpy(&checksum, record + TIMESTAMP_SIZE, CHECKSUM_SIZE);
+
+                // the timestamps only grow, which the lookups rely on
+                if (checksum != getChecksum(timestamp, record + RECORD_HEADER_SIZE, Frame::HEADER_SIZE + payloadSize) ||
+                    timestamp <= lastTimestamp)
+                    break;
+
+                addIndexEntry(IndexEntry{timestamp, offset});
+                lastTimestamp = timestamp;
+
+                offset += recordSize;
+            }
+
+            writtenSize.store(offset);
+        }
+
+        void syncLoop()
+        {
+            std::unique_lock<std::mutex> lock(syncMutex);
+
+            while (!stopping)
+            {
+                syncCondition.wait_for(lock, syncInterval);
+
+                lock.unlock();
+                sync();
+                lock.lock();
+            }
+        }
+
+        // flushes everything appended since the last sync with a single msync
+        void sync()
+        {
+            size_t size = writtenSize.load(std::memory_order_acquire);
+            if (size == syncedSize) return;
+
+            size_t pageSize = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+            size_t start = syncedSize / pageSize * pageSize;
+            ::msync(data + start, size - start, MS_SYNC);
+            syncedSize = size;
+        }
+
+        size_t capacity;
+        size_t fileSize = 0;
+        int fd = -1;
+        uint8_t* data = nullptr;
+
+        std::vector<std::unique_ptr<IndexEntry[]>> indexBlocks; // sized up front, the blocks never move
+        std::atomic<size_t> recordCount{0};
+        std::atomic<size_t> writtenSize{0};
+        size_t syncedSize = 0; // accessed only by the sync thread after the constructor
+
+        std::chrono::milliseconds syncInterval;
+        std::thread syncThread;
+        std::mutex syncMutex;
+        std::condition_variable syncCondition;
+        bool stopping = false;
+    };
+}
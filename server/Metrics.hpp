@@ -0,0 +1,168 @@
+//
+//  Chat server
+//
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include "Histogram.hpp"
+
+namespace chat
+{
+    enum class DisconnectReason
+    {
+        ERROR, // the connection failed or the peer closed it
+        PROTOCOL, // invalid or unexpected message
+        INACTIVITY, // nothing received from a client without heartbeats
+        HEARTBEAT, // the heartbeats stopped
+        SLOW_CONSUMER,
+        CLOSED, // closed by the server after sending the queued frames
+        COUNT
+    };
+
+    // Values of a kind of event, of which only every SAMPLE_INTERVAL-th is recorded: a clock read costs
+    // more than all the other instrumentation, and a histogram update is several times a counter's
+    // (the events themselves are counted by the counters)
+    struct SampledHistogram
+    {
+        static const uint32_t SAMPLE_INTERVAL = 64;
+
+        Histogram histogram;
+        uint32_t events = 0;
+
+        inline bool sample()
+        {
+            return events++ % SAMPLE_INTERVAL == 0;
+        }
+
+        inline void record(uint64_t value)
+        {
+            if (sample()) histogram.record(value);
+        }
+    };
+
+    // Counters and histograms of a shard. They are updated only by the shard's thread and copied on that
+    // thread when a snapshot is taken, so updating them is a plain increment.
+    struct Metrics
+    {
+        uint64_t connectionsAccepted = 0;
+        uint64_t connectionsAdopted = 0; // handed over by the previous process on a hot restart
+        uint64_t connectionsClosed = 0;
+        uint64_t sessionsResumed = 0;
+        uint64_t heartbeats = 0; // pings answered
+        uint64_t disconnects[static_cast<size_t>(DisconnectReason::COUNT)] = {};
+        uint64_t bytesReceived = 0;
+        uint64_t messagesReceived = 0;
+        uint64_t messagesBroadcast = 0;
+        uint64_t directMessages = 0; // sent to their recipients only
+        uint64_t undeliveredRecipients = 0; // recipients of direct messages that were not online
+        uint64_t batches = 0; // batch frames broadcast
+        uint64_t messagesBatched = 0;
+        uint64_t bytesSent = 0;
+        uint64_t framesSent = 0;
+        uint64_t writes = 0;
+        uint64_t framesDropped = 0;
+        uint64_t framesCompressed = 0; // sent compressed
+        uint64_t compressionSavedBytes = 0;
+        uint64_t deliveries = 0; // frames received from other shards
+        uint64_t relays = 0; // frames handed to the peer links
+        uint64_t connectionsRejected = 0; // turned away by the admission control
+        uint64_t loginsQueued = 0; // waited for the login rate
+        uint64_t loginsRejected = 0; // turned away by the admission control
+
+        // gauges, filled in when a snapshot is taken
+        uint64_t connections = 0;
+        uint64_t loggedInClients = 0;
+        uint64_t channels = 0;
+        uint64_t sendQueueBytes = 0;
+        uint64_t pendingLogins = 0;
+        uint64_t connectionMemory = 0; // bytes of the client sessions, their buffers and the spares
+        uint64_t idleConnections = 0; // holding no buffer, only waiting for input
+        uint64_t idleConnectionMemory = 0; // bytes of the idle connections' sessions
+
+        SampledHistogram receiveTime; // nanoseconds to decode and handle the bytes of one read
+        Histogram handleTime; // nanoseconds to handle one message of a sampled read
+        Histogram broadcastTime; // nanoseconds to encode a message of a sampled read and hand it to all the recipients
+        SampledHistogram writeFrames; // frames gathered into a single write
+
+        // the read being handled is sampled, so its messages are timed too (the messages of the other
+        // reads cost a check of this flag instead of a sampling decision each)
+        bool timing = false;
+
+        void merge(const Metrics& other)
+        {
+            connectionsAccepted += other.connectionsAccepted;
+            connectionsAdopted += other.connectionsAdopted;
+            connectionsClosed += other.connectionsClosed;
+            sessionsResumed += other.sessionsResumed;
+            heartbeats += other.heartbeats;
+            for (size_t i = 0; i < static_cast<size_t>(DisconnectReason::COUNT); ++i)
+                disconnects[i] += other.disconnects[i];
+            bytesReceived += other.bytesReceived;
+            messagesReceived += other.messagesReceived;
+            messagesBroadcast += other.messagesBroadcast;
+            directMessages += other.directMessages;
+            undeliveredRecipients += other.undeliveredRecipients;
+            batches += other.batches;
+            messagesBatched += other.messagesBatched;
+            bytesSent += other.bytesSent;
+            framesSent += other.framesSent;
+            writes += other.writes;
+            framesDropped += other.framesDropped;
+            framesCompressed += other.framesCompressed;
+            compressionSavedBytes += other.compressionSavedBytes;
+            deliveries += other.deliveries;
+            relays += other.relays;
+            connectionsRejected += other.connectionsRejected;
+            loginsQueued += other.loginsQueued;
+            loginsRejected += other.loginsRejected;
+
+            connections += other.connections;
+            loggedInClients += other.loggedInClients;
+            channels += other.channels;
+            sendQueueBytes += other.sendQueueBytes;
+            pendingLogins += other.pendingLogins;
+            connectionMemory += other.connectionMemory;
+            idleConnections += other.idleConnections;
+            idleConnectionMemory += other.idleConnectionMemory;
+
+            receiveTime.histogram.merge(other.receiveTime.histogram);
+            handleTime.merge(other.handleTime);
+            broadcastTime.merge(other.broadcastTime);
+            writeFrames.histogram.merge(other.writeFrames.histogram);
+        }
+    };
+
+    // Records the time spent in a scope if the event is sampled
+    class ScopedTimer final
+    {
+    public:
+        explicit ScopedTimer(SampledHistogram& d):
+            ScopedTimer(d.histogram, d.sample())
+        {
+        }
+
+        ScopedTimer(Histogram& h, bool timed):
+            histogram(timed ? &h : nullptr)
+        {
+            if (histogram) start = std::chrono::steady_clock::now();
+        }
+
+        ~ScopedTimer()
+        {
+            if (histogram)
+                histogram->record(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - start).count()));
+        }
+
+        ScopedTimer(const ScopedTimer&) = delete;
+        ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+        inline bool isTiming() const { return histogram != nullptr; }
+
+    private:
+        Histogram* histogram;
+        std::chrono::steady_clock::time_point start;
+    };
+}
@@ -0,0 +1,250 @@
+//
+//  Chat server
+//
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include "MetricsExporter.hpp"
+#include "Server.hpp"
+
+namespace chat
+{
+    static const char* DISCONNECT_REASONS[] = {"error", "protocol", "inactivity", "heartbeat", "slow_consumer", "closed"};
+
+    // upper bounds of the duration histogram buckets in nanoseconds
+    static const uint64_t DURATION_BUCKETS[] = {
+        1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+        1000000, 2500000, 5000000, 10000000, 25000000, 50000000, 100000000, 1000000000
+    };
+
+    static const uint64_t FRAME_BUCKETS[] = {1, 2, 4, 8, 16, 32, 64};
+
+    MetricsExporter::MetricsExporter(const std::shared_ptr<spdlog::logger>& l,
+                                     boost::asio::io_service& s,
+                                     Server& serv):
+        logger(l),
+        ioService(s),
+        server(serv),
+        dumpTimer(s)
+    {
+        start();
+    }
+
+    void MetricsExporter::start()
+    {
+        const Config& config = server.getConfig();
+        closed = false;
+
+        if (!config.metricsFile.empty()) scheduleDump();
+
+        if (config.adminPort)
+        {
+            // metrics are only for the local host
+            boost::asio::ip::tcp::endpoint endpoint(boost::asio::ip::address_v4::loopback(), config.adminPort);
+
+            acceptor.reset(new boost::asio::ip::tcp::acceptor(ioService));
+            acceptor->open(endpoint.protocol());
+            acceptor->set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
+            acceptor->bind(endpoint);
+            acceptor->listen();
+
+            accept();
+        }
+    }
+
+    void MetricsExporter::close()
+    {
+        closed = true;
+        dumpTimer.cancel();
+        if (acceptor) acceptor->close();
+        acceptor.reset();
+    }
+
+    void MetricsExporter::scheduleDump()
+    {
+        dumpTimer.expires_from_now(boost::posix_time::milliseconds(server.getConfig().metricsInterval));
+        dumpTimer.async_wait([this](const boost::system::error_code& error)
+        {
+            if (!error) // not boost::asio::error::operation_aborted
+            {
+                server.collectMetrics([this](const std::vector<Metrics>& shardMetrics) {
+                    dump(shardMetrics);
+                    if (!closed) scheduleDump();
+                });
+            }
+        });
+    }
+
+    void MetricsExporter::dump(const std::vector<Metrics>& shardMetrics)
+    {
+        // write a new file and rename it, so readers never see a partial dump
+        const std::string& path = server.getConfig().metricsFile;
+        std::string temporaryPath = path + ".tmp";
+
+        {
+            std::ofstream file(temporaryPath, std::ios::trunc);
+            format(file, shardMetrics);
+            if (!file)
+            {
+                logger->error("Failed to write metrics to {0}", temporaryPath);
+                return;
+            }
+        }
+
+        if (std::rename(temporaryPath.c_str(), path.c_str()) != 0)
+            logger->error("Failed to rename {0}", temporaryPath);
+    }
+
+    void MetricsExporter::accept()
+    {
+        std::shared_ptr<boost::asio::ip::tcp::socket> socket = std::make_shared<boost::asio::ip::tcp::socket>(ioService);
+
+        acceptor->async_accept(*socket, [this, socket](boost::system::error_code error)
+        {
+            if (error) return;
+
+            // answer the first request on the connection, whatever it is, the way a scraper expects
+            std::shared_ptr<std::vector<char>> request = std::make_shared<std::vector<char>>(1024);
+            socket->async_read_some(boost::asio::buffer(*request),
+                                    [this, socket, request](const boost::system::error_code& error, std::size_t)
+            {
+                if (error) return;
+
+                server.collectMetrics([socket](const std::vector<Metrics>& shardMetrics) {
+                    std::ostringstream body;
+                    format(body, shardMetrics);
+
+                    std::shared_ptr<std::string> response = std::make_shared<std::string>(
+                        "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n" +
+                        body.str());
+
+                    boost::asio::async_write(*socket, boost::asio::buffer(*response),
+                                             [socket, response](const boost::system::error_code&, std::size_t)
+                    {
+                        boost::system::error_code ignored;
+                        socket->shutdown(boost::asio::ip::tcp::socket::shutdown_both, ignored);
+                        socket->close(ignored);
+                    });
+                });
+            });
+
+            accept();
+        });
+    }
+
+    template <class F>
+    static void formatShardMetric(std::ostream& output, const std::vector<Metrics>& shardMetrics,
+                                  const char* name, const char* type, const char* help, F value)
+    {
+        output << "# HELP " << name << " " << help << "\n";
+        output << "# TYPE " << name << " " << type << "\n";
+
+        for (size_t i = 0; i < shardMetrics.size(); ++i)
+            output << name << "{shard=\"" << i << "\"} " << value(shardMetrics[i]) << "\n";
+    }
+
+    template <size_t N>
+    static void formatHistogram(std::ostream& output, const Histogram& histogram,
+                                const char* name, const char* help,
+                                const uint64_t (&bounds)[N], double scale)
+    {
+        output << "# HELP " << name << " " << help << "\n";
+        output << "# TYPE " << name << " histogram\n";
+
+        for (uint64_t bound : bounds)
+            output << name << "_bucket{le=\"" << bound * scale << "\"} " << histogram.getCountBelow(bound) << "\n";
+
+        output << name << "_bucket{le=\"+Inf\"} " << histogram.getCount() << "\n";
+        output << name << "_sum " << histogram.getSum() * scale << "\n";
+        output << name << "_count " << histogram.getCount() << "\n";
+    }
+
+    void MetricsExporter::format(std::ostream& output, const std::vector<Metrics>& shardMetrics)
+    {
+        formatShardMetric(output, shardMetrics, "chat_connections_accepted_total", "counter", "Connections accepted",
+                          [](const Metrics& m) { return m.connectionsAccepted; });
+        formatShardMetric(output, shardMetrics, "chat_connections_adopted_total", "counter", "Connections handed over by the previous process",
+                          [](const Metrics& m) { return m.connectionsAdopted; });
+        formatShardMetric(output, shardMetrics, "chat_connections_closed_total", "counter", "Connections closed",
+                          [](const Metrics& m) { return m.connectionsClosed; });
+        formatShardMetric(output, shardMetrics, "chat_resumed_sessions_total", "counter", "Sessions resumed on a new connection",
+                          [](const Metrics& m) { return m.sessionsResumed; });
+        formatShardMetric(output, shardMetrics, "chat_heartbeats_total", "counter", "Heartbeats answered",
+                          [](const Metrics& m) { return m.heartbeats; });
+
+        output << "# HELP chat_disconnects_total Connections closed by the server or the peer by reason\n";
+        output << "# TYPE chat_disconnects_total counter\n";
+        for (size_t i = 0; i < shardMetrics.size(); ++i)
+            for (size_t reason = 0; reason < static_cast<size_t>(DisconnectReason::COUNT); ++reason)
+                output << "chat_disconnects_total{shard=\"" << i << "\",reason=\"" << DISCONNECT_REASONS[reason] << "\"} " <<
+                    shardMetrics[i].disconnects[reason] << "\n";
+
+        formatShardMetric(output, shardMetrics, "chat_received_bytes_total", "counter", "Bytes received",
+                          [](const Metrics& m) { return m.bytesReceived; });
+        formatShardMetric(output, shardMetrics, "chat_received_messages_total", "counter", "Messages received",
+                          [](const Metrics& m) { return m.messagesReceived; });
+        formatShardMetric(output, shardMetrics, "chat_broadcast_messages_total", "counter", "Messages broadcast",
+                          [](const Metrics& m) { return m.messagesBroadcast; });
+        formatShardMetric(output, shardMetrics, "chat_direct_messages_total", "counter", "Messages sent to their recipients only",
+                          [](const Metrics& m) { return m.directMessages; });
+        formatShardMetric(output, shardMetrics, "chat_undelivered_recipients_total", "counter", "Recipients of direct messages that were not online",
+                          [](const Metrics& m) { return m.undeliveredRecipients; });
+        formatShardMetric(output, shardMetrics, "chat_batches_total", "counter", "Batch frames broadcast",
+                          [](const Metrics& m) { return m.batches; });
+        formatShardMetric(output, shardMetrics, "chat_batched_messages_total", "counter", "Messages broadcast in batches",
+                          [](const Metrics& m) { return m.messagesBatched; });
+        formatShardMetric(output, shardMetrics, "chat_sent_bytes_total", "counter", "Bytes sent",
+                          [](const Metrics& m) { return m.bytesSent; });
+        formatShardMetric(output, shardMetrics, "chat_sent_frames_total", "counter", "Frames sent",
+                          [](const Metrics& m) { return m.framesSent; });
+        formatShardMetric(output, shardMetrics, "chat_writes_total", "counter", "Gathered socket writes",
+                          [](const Metrics& m) { return m.writes; });
+        formatShardMetric(output, shardMetrics, "chat_dropped_frames_total", "counter", "Frames dropped for slow consumers",
+                          [](const Metrics& m) { return m.framesDropped; });
+        formatShardMetric(output, shardMetrics, "chat_compressed_frames_total", "counter", "Frames sent compressed",
+                          [](const Metrics& m) { return m.framesCompressed; });
+        formatShardMetric(output, shardMetrics, "chat_compression_saved_bytes_total", "counter", "Bytes saved by compressing frames",
+                          [](const Metrics& m) { return m.compressionSavedBytes; });
+        formatShardMetric(output, shardMetrics, "chat_deliveries_total", "counter", "Frames received from other shards",
+                          [](const Metrics& m) { return m.deliveries; });
+        formatShardMetric(output, shardMetrics, "chat_relayed_frames_total", "counter", "Frames relayed to the peer servers",
+                          [](const Metrics& m) { return m.relays; });
+        formatShardMetric(output, shardMetrics, "chat_rejected_connections_total", "counter", "Connections turned away by the admission control",
+                          [](const Metrics& m) { return m.connectionsRejected; });
+        formatShardMetric(output, shardMetrics, "chat_queued_logins_total", "counter", "Logins that waited for the login rate",
+                          [](const Metrics& m) { return m.loginsQueued; });
+        formatShardMetric(output, shardMetrics, "chat_rejected_logins_total", "counter", "Logins turned away by the admission control",
+                          [](const Metrics& m) { return m.loginsRejected; });
+
+        formatShardMetric(output, shardMetrics, "chat_connections", "gauge", "Open connections",
+                          [](const Metrics& m) { return m.connections; });
+        formatShardMetric(output, shardMetrics, "chat_logged_in_clients", "gauge", "Logged in clients",
+                          [](const Metrics& m) { return m.loggedInClients; });
+        formatShardMetric(output, shardMetrics, "chat_channels", "gauge", "Channels with members",
+                          [](const Metrics& m) { return m.channels; });
+        formatShardMetric(output, shardMetrics, "chat_send_queue_bytes", "gauge", "Bytes queued for sending",
+                          [](const Metrics& m) { return m.sendQueueBytes; });
+        formatShardMetric(output, shardMetrics, "chat_pending_logins", "gauge", "Logins waiting for the login rate",
+                          [](const Metrics& m) { return m.pendingLogins; });
+        formatShardMetric(output, shardMetrics, "chat_connection_memory_bytes", "gauge",
+                          "Memory of the client sessions and their buffers, spares included",
+                          [](const Metrics& m) { return m.connectionMemory; });
+        formatShardMetric(output, shardMetrics, "chat_idle_connections", "gauge", "Connections holding no buffer",
+                          [](const Metrics& m) { return m.idleConnections; });
+        formatShardMetric(output, shardMetrics, "chat_idle_connection_bytes", "gauge", "Memory held per idle connection",
+                          [](const Metrics& m) { return m.idleConnections ? m.idleConnectionMemory / m.idleConnections : 0; });
+
+        Metrics total;
+        for (const Metrics& metrics : shardMetrics) total.merge(metrics);
+
+        formatHistogram(output, total.receiveTime.histogram, "chat_receive_duration_seconds",
+                        "Time to decode and handle the bytes of one read (sampled)", DURATION_BUCKETS, 1e-9);
+        formatHistogram(output, total.handleTime, "chat_handle_duration_seconds",
+                        "Time to handle one message (sampled)", DURATION_BUCKETS, 1e-9);
+        formatHistogram(output, total.broadcastTime, "chat_broadcast_duration_seconds",
+                        "Time to encode a message and hand it to all the recipients (sampled)", DURATION_BUCKETS, 1e-9);
+        formatHistogram(output, total.writeFrames.histogram, "chat_write_frames",
+                        "Frames gathered into a single write (sampled)", FRAME_BUCKETS, 1.0);
+    }
+}
@@ -0,0 +1,50 @@
+//
+//  Chat server
+//
+
+#pragma once
+
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+#include "spdlog/spdlog.h"
+#include "Metrics.hpp"
+
+namespace chat
+{
+    class Server;
+
+    // Publishes the metrics of all the shards in the Prometheus text format, periodically to a file
+    // and on request to a local admin port. Runs on the first shard's event loop.
+    class MetricsExporter final
+    {
+    public:
+        MetricsExporter(const std::shared_ptr<spdlog::logger>& l,
+                        boost::asio::io_service& s,
+                        Server& serv);
+
+        MetricsExporter(const MetricsExporter&) = delete;
+        MetricsExporter& operator=(const MetricsExporter&) = delete;
+
+        // start publishing again after a close (the admin port is opened anew)
+        void start();
+        void close();
+
+        static void format(std::ostream& output, const std::vector<Metrics>& shardMetrics);
+
+    private:
+        void scheduleDump();
+        void dump(const std::vector<Metrics>& shardMetrics);
+        void accept();
+
+        std::shared_ptr<spdlog::logger> logger;
+        boost::asio::io_service& ioService;
+        Server& server;
+
+        boost::asio::deadline_timer dumpTimer;
+        std::unique_ptr<boost::asio::ip::tcp::acceptor> acceptor;
+        bool closed = false;
+    };
+}
@@ -0,0 +1,386 @@
+//
+//  Chat server
+//
+
+#pragma once
+
+#include <algorithm>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+#include "spdlog/spdlog.h"
+#include "Federation.hpp"
+#include "Frame.hpp"
+#include "FrameDecoder.hpp"
+#include "Message.hpp"
+
+namespace chat
+{
+    static const size_t PEER_BUFFER_SIZE = 64 * 1024; // initial receive buffer, it grows for larger frames
+    static const size_t MAX_PEER_WRITE_FRAMES = 256; // frames gathered into a single write
+
+    // Link to another server of the cluster, always with varint prefixes. Both sides start with a PEER
+    // handshake naming their server and presenting the cluster's secret. Dialed links are redialed after
+    // they drop, accepted ones are forgotten. Runs on the federation's event loop.
+    class Peer final: public std::enable_shared_from_this<Peer>
+    {
+    public:
+        // accepted link
+        Peer(const std::shared_ptr<spdlog::logger>& l,
+             boost::asio::io_service& service,
+             Federation& f,
+             boost::asio::ip::tcp::socket sock):
+            logger(l),
+            ioService(service),
+            federation(f),
+            socket(std::move(sock)),
+            reconnectTimer(service),
+            dialed(false)
+        {
+        }
+
+        // dialed link
+        Peer(const std::shared_ptr<spdlog::logger>& l,
+             boost::asio::io_service& service,
+             Federation& f,
+             const std::string& a,
+             const boost::asio::ip::tcp::endpoint& e):
+            logger(l),
+            ioService(service),
+            federation(f),
+            socket(service),
+            reconnectTimer(service),
+            dialed(true),
+            address(a),
+            endpoint(e)
+        {
+        }
+
+        Peer(const Peer&) = delete;
+        Peer& operator=(const Peer&) = delete;
+
+        inline bool isDialed() const { return dialed; }
+        inline bool isEstablished() const { return established; }
+
+        // identifies the link while it is established, 0 before
+        inline uint64_t getId() const { return id; }
+        inline void setId(uint64_t newId) { id = newId; }
+
+        inline const std::string& getName() const
+        {
+            return name.empty() ? address : name;
+        }
+
+        void start()
+        {
+            if (dialed)
+                connect();
+            else
+                begin();
+        }
+
+        // relay a frame broadcast on this server, the link is dropped if the peer does not keep up
+        void sendFrame(const FramePtr& frame)
+        {
+            if (!established) return;
+
+            if (outputQueueSize + frame->getSize() > federation.getConfig().peerQueueLimit)
+            {
+                logger->error("Peer {0} is not reading fast enough, link dropped", getName());
+                disconnect();
+                return;
+            }
+
+            queueFrame(frame);
+        }
+
+        void sendClaim(const std::string& nickname, uint64_t request)
+        {
+            Message message;
+            message.type = Message::Type::CLAIM;
+            message.nickname = nickname;
+            message.timestamp = request;
+            queueFrame(std::make_shared<const Frame>(message));
+        }
+
+        void sendClaimReply(const std::string& nickname, uint64_t request, bool accepted)
+        {
+            Message message;
+            message.type = Message::Type::CLAIM;
+            message.nickname = nickname;
+            message.body = accepted ? "accepted" : "rejected";
+            message.timestamp = request;
+            queueFrame(std::make_shared<const Frame>(message));
+        }
+
+        void sendRelease(const std::string& nickname)
+        {
+            Message message;
+            message.type = Message::Type::RELEASE;
+            message.nickname = nickname;
+            queueFrame(std::make_shared<const Frame>(message));
+        }
+
+        void disconnect()
+        {
+            if (!socket.is_open()) return;
+
+            // the handlers of the dropped connection see the new attempt and do nothing
+            ++attempt;
+            boost::system::error_code ignored;
+            socket.close(ignored);
+
+            if (established) logger->warn("Link to {0} dropped", getName());
+
+            federation.removePeer(*this);
+
+            established = false;
+            id = 0;
+            outputQueue.clear();
+            outputQueueSize = 0;
+            writing = false;
+            decoder = FrameDecoder(PEER_BUFFER_SIZE);
+
+            if (dialed && !closed) scheduleConnect();
+        }
+
+        void close()
+        {
+            closed = true;
+            ++attempt;
+            reconnectTimer.cancel();
+
+            boost::system::error_code ignored;
+            socket.close(ignored);
+        }
+
+    private:
+        void connect()
+        {
+            size_t current = ++attempt;
+            std::shared_ptr<Peer> self = shared_from_this();
+
+            socket.async_connect(endpoint, [this, self, current](const boost::system::error_code& error)
+            {
+                if (current != attempt || error == boost::asio::error::operation_aborted) return;
+
+                if (error)
+                {
+                    // report a peer that is down once, not at every attempt
+                    if (!failing) logger->warn("Failed to link to {0}: {1}", address, error.message());
+                    failing = true;
+
+                    boost::system::error_code ignored;
+                    socket.close(ignored);
+                    scheduleConnect();
+                    return;
+                }
+
+                failing = false;
+                begin();
+            });
+        }
+
+        void scheduleConnect()
+        {
+            std::shared_ptr<Peer> self = shared_from_this();
+
+            reconnectTimer.expires_from_now(boost::posix_time::milliseconds(federation.getConfig().peerReconnect));
+            reconnectTimer.async_wait([this, self](const boost::system::error_code& error)
+            {
+                if (!error && !closed) // not boost::asio::error::operation_aborted
+                    connect();
+            });
+        }
+
+        void begin()
+        {
+            boost::system::error_code ignored;
+            socket.set_option(boost::asio::ip::tcp::no_delay(true), ignored);
+            socket.set_option(boost::asio::socket_base::keep_alive(true), ignored);
+
+            // frames up to the largest any server accepts, the buffer grows only for the large ones
+            decoder.setVarint(Frame::MAX_PAYLOAD_SIZE);
+
+            Message hello;
+            hello.type = Message::Type::PEER;
+            hello.nickname = federation.getConfig().nodeName;
+            hello.body = federation.getConfig().peerSecret;
+            queueFrame(std::make_shared<const Frame>(hello));
+
+            receive();
+        }
+
+        void queueFrame(const FramePtr& frame)
+        {
+            if (!socket.is_open()) return;
+
+            outputQueue.push_back(frame);
+            outputQueueSize += frame->getSize();
+
+            // the frames relayed during this event loop turn go out together
+            if (!writing && !writeScheduled)
+            {
+                writeScheduled = true;
+
+                std::shared_ptr<Peer> self = shared_from_this();
+                ioService.post([this, self]()
+                {
+                    writeScheduled = false;
+                    if (socket.is_open() && !writing && !outputQueue.empty()) write();
+                });
+            }
+        }
+
+        void write()
+        {
+            writing = true;
+            writingFrames = std::min(outputQueue.size(), MAX_PEER_WRITE_FRAMES);
+            outputBuffers.clear();
+            outputHeaders.resize(writingFrames * Frame::MAX_VARINT_HEADER_SIZE);
+
+            for (size_t i = 0; i < writingFrames; ++i)
+            {
+                const Frame& frame = *outputQueue[i];
+                uint8_t* header = outputHeaders.data() + i * Frame::MAX_VARINT_HEADER_SIZE;
+
+                outputBuffers.push_back(boost::asio::buffer(header, Frame::encodeVarintHeader(frame.getPayloadSize(), header)));
+                outputBuffers.push_back(boost::asio::buffer(frame.getPayload(), frame.getPayloadSize()));
+            }
+
+            size_t current = attempt;
+            std::shared_ptr<Peer> self = shared_from_this();
+
+            boost::asio::async_write(socket, outputBuffers,
+                                     [this, self, current](const boost::system::error_code& error, std::size_t)
+            {
+                if (current != attempt || error == boost::asio::error::operation_aborted) return;
+
+                writing = false;
+
+                if (error)
+                {
+                    disconnect();
+                    return;
+                }
+
+                for (; writingFrames > 0; --writingFrames)
+                {
+                    outputQueueSize -= outputQueue.front()->getSize();
+                    outputQueue.pop_front();
+                }
+
+                if (!outputQueue.empty()) write();
+            });
+        }
+
+        void receive()
+        {
+            size_t current = attempt;
+            std::shared_ptr<Peer> self = shared_from_this();
+
+            socket.async_receive(decoder.prepare(),
+                                 [this, self, current](const boost::system::error_code& error, std::size_t bytesTransferred)
+            {
+                if (current != attempt || error == boost::asio::error::operation_aborted) return;
+
+                if (error)
+                {
+                    disconnect();
+                    return;
+                }
+
+                decoder.commit(bytesTransferred);
+
+                try
+                {
+                    MessageView message;
+                    while (current == attempt && decoder.decode(message))
+                        handleMessage(message);
+                }
+                catch (const std::exception& e)
+                {
+                    logger->error("Peer {0}: {1}", getName(), e.what());
+                    disconnect();
+                    return;
+                }
+
+                if (current == attempt) receive();
+            });
+        }
+
+        void handleMessage(const MessageView& message)
+        {
+            if (established)
+            {
+                federation.handleMessage(*this, message);
+                return;
+            }
+
+            if (message.type != Message::Type::PEER || message.nickname.empty())
+            {
+                logger->error("Invalid handshake from peer {0}", getName());
+                disconnect();
+                return;
+            }
+
+            if (!isSecret(message.body, federation.getConfig().peerSecret))
+            {
+                logger->error("Peer {0} at {1} did not present the secret", message.nickname.to_string(), getRemoteAddress());
+                disconnect();
+                return;
+            }
+
+            name = message.nickname.to_string();
+            established = true;
+
+            if (!federation.establish(*this)) disconnect();
+        }
+
+        // compared in constant time, so the secret can not be guessed a byte at a time
+        static bool isSecret(boost::string_ref value, const std::string& secret)
+        {
+            if (value.size() != secret.size()) return false;
+
+            unsigned char difference = 0;
+            for (size_t i = 0; i < secret.size(); ++i)
+                difference |= static_cast<unsigned char>(value[i] ^ secret[i]);
+            return difference == 0;
+        }
+
+        std::string getRemoteAddress() const
+        {
+            boost::system::error_code error;
+            boost::asio::ip::tcp::endpoint remote = socket.remote_endpoint(error);
+            return error ? "unknown address" : remote.address().to_string();
+        }
+
+        std::shared_ptr<spdlog::logger> logger;
+        boost::asio::io_service& ioService;
+        Federation& federation;
+        boost::asio::ip::tcp::socket socket;
+        boost::asio::deadline_timer reconnectTimer;
+
+        bool dialed;
+        std::string address; // host:port of a dialed peer
+        boost::asio::ip::tcp::endpoint endpoint;
+        size_t attempt = 0; // connection attempt the handlers belong to
+        bool failing = false;
+        bool closed = false;
+
+        std::string name; // of the peer's server, from its handshake
+        bool established = false;
+        uint64_t id = 0;
+
+        FrameDecoder decoder{PEER_BUFFER_SIZE};
+        std::deque<FramePtr> outputQueue;
+        size_t outputQueueSize = 0; // bytes
+        std::vector<boost::asio::const_buffer> outputBuffers;
+        std::vector<uint8_t> outputHeaders;
+        size_t writingFrames = 0;
+        bool writing = false;
+        bool writeScheduled = false;
+    };
+}
@@ -0,0 +1,152 @@
+//
+//  Chat server
+//
+
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace chat
+{
+    // Allocates objects of one type from blocks carved out of large chunks. The freed blocks are
+    // linked into a free list and reused, so the objects of a shard stay close together and creating
+    // one is a pointer pop instead of a trip through the general purpose allocator. The chunks are
+    // kept until the pool is destroyed, which must happen after all its objects are.
+    template <class T>
+    class ObjectPool final
+    {
+    public:
+        // returns the object's block to the pool it was created from
+        class Deleter final
+        {
+        public:
+            Deleter(ObjectPool* p = nullptr): pool(p) {}
+
+            void operator()(T* object) const
+            {
+                pool->destroy(object);
+            }
+
+        private:
+            ObjectPool* pool;
+        };
+
+        typedef std::unique_ptr<T, Deleter> Pointer;
+
+        explicit ObjectPool(size_t blocks = 64):
+            blocksPerChunk(blocks)
+        {
+        }
+
+        ObjectPool(const ObjectPool&) = delete;
+        ObjectPool& operator=(const ObjectPool&) = delete;
+
+        template <class... Args>
+        Pointer create(Args&&... args)
+        {
+            Block* block = allocate();
+
+            try
+            {
+                return Pointer(new (&block->storage) T(std::forward<Args>(args)...), Deleter(this));
+            }
+            catch (...)
+            {
+                deallocate(block);
+                throw;
+            }
+        }
+
+        // bytes of all the chunks, used or not
+        inline size_t getReservedSize() const
+        {
+            return chunks.size() * blocksPerChunk * sizeof(Block);
+        }
+
+    private:
+        union Block
+        {
+            Block* next;
+            typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+        };
+
+        Block* allocate()
+        {
+            if (!firstFree)
+            {
+                chunks.push_back(std::unique_ptr<Block[]>(new Block[blocksPerChunk]));
+
+                Block* chunk = chunks.back().get();
+                for (size_t i = blocksPerChunk; i > 0; --i)
+                {
+                    chunk[i - 1].next = firstFree;
+                    firstFree = &chunk[i - 1];
+                }
+            }
+
+            Block* block = firstFree;
+            firstFree = block->next;
+            return block;
+        }
+
+        void deallocate(Block* block)
+        {
+            block->next = firstFree;
+            firstFree = block;
+        }
+
+        void destroy(T* object)
+        {
+            object->~T();
+            deallocate(reinterpret_cast<Block*>(object));
+        }
+
+        size_t blocksPerChunk;
+        std::vector<std::unique_ptr<Block[]>> chunks;
+        Block* firstFree = nullptr;
+    };
+
+    // Spare values (buffers, queues) handed out and taken back, so their memory is reused instead of
+    // freed and allocated again. At most limit spares are kept, the rest are freed when given back.
+    template <class T>
+    class FreeList final
+    {
+    public:
+        explicit FreeList(size_t l):
+            limit(l)
+        {
+        }
+
+        // a spare, or a default constructed value if there is none
+        T acquire()
+        {
+            if (spares.empty()) return T();
+
+            T value = std::move(spares.back());
+            spares.pop_back();
+            return value;
+        }
+
+        void release(T value)
+        {
+            if (spares.size() < limit) spares.push_back(std::move(value));
+        }
+
+        template <class F>
+        void forEach(F f) const
+        {
+            for (const T& spare : spares) f(spare);
+        }
+
+        inline size_t size() const { return spares.size(); }
+
+    private:
+        size_t limit;
+        std::vector<T> spares;
+    };
+}
@@ -0,0 +1,66 @@
+//
+//  Chat server
+//
+
+#pragma once
+
+#include <atomic>
+#include <utility>
+
+namespace chat
+{
+    // Unbounded lock-free multiple-producer single-consumer queue (intrusive node based, after Dmitry Vyukov).
+    // push can be called from any thread, pop only from the thread that owns the queue.
+    template <class T>
+    class Queue final
+    {
+    public:
+        Queue():
+            head(new Node()), tail(head.load(std::memory_order_relaxed))
+        {
+        }
+
+        ~Queue()
+        {
+            T value;
+            while (pop(value));
+            delete tail;
+        }
+
+        Queue(const Queue&) = delete;
+        Queue& operator=(const Queue&) = delete;
+
+        void push(T value)
+        {
+            Node* node = new Node(std::move(value));
+            Node* previous = head.exchange(node, std::memory_order_acq_rel);
+            previous->next.store(node, std::memory_order_release);
+        }
+
+        bool pop(T& value)
+        {
+            Node* next = tail->next.load(std::memory_order_acquire);
+            if (!next) return false;
+
+            value = std::move(next->value);
+            delete tail;
+            tail = next;
+
+            return true;
+        }
+
+    private:
+        struct Node
+        {
+            Node() {}
+            explicit Node(T v): value(std::move(v)) {}
+
+            std::atomic<Node*> next{nullptr};
+            T value;
+        };
+
+        std::atomic<Node*> head;
+        char padding[64 - sizeof(std::atomic<Node*>)]; // keep the producers and the consumer on different cache lines
+        Node* tail;
+    };
+}
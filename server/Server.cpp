@@ -2,53 +2,785 @@
 //  Chat server
 //
 
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <sys/random.h>
+#else
+#include <stdlib.h>
+#endif
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <system_error>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "Server.hpp"
 #include "Client.hpp"
 
 namespace chat
 {
-    void Server::accept()
+    static const long SESSION_EXPIRY_INTERVAL = 1000; // milliseconds between the checks for parked sessions to release
+
+    // only a process of the user running the server takes its sockets over
+    static bool isSameUser(int fd)
+    {
+#ifdef SO_PEERCRED
+        ucred credentials;
+        socklen_t size = sizeof(credentials);
+        return ::getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, &size) == 0 && credentials.uid == ::geteuid();
+#else
+        uid_t user;
+        gid_t group;
+        return ::getpeereid(fd, &user, &group) == 0 && user == ::geteuid();
+#endif
+    }
+
+    // from the kernel's CSPRNG, so the tokens a client sees tell nothing about the others
+    static void fillRandom(void* buffer, size_t size)
+    {
+#ifdef __linux__
+        uint8_t* output = static_cast<uint8_t*>(buffer);
+        while (size)
+        {
+            ssize_t result = ::getrandom(output, size, 0);
+            if (result == -1)
+            {
+                if (errno == EINTR) continue;
+                throw std::system_error(errno, std::system_category(), "Failed to get random bytes");
+            }
+
+            output += result;
+            size -= static_cast<size_t>(result);
+        }
+#else
+        ::arc4random_buf(buffer, size);
+#endif
+    }
+
+    // compared in constant time, so a token can not be guessed a byte at a time
+    static bool isSameToken(const std::string& value, const std::string& token)
+    {
+        if (value.size() != token.size()) return false;
+
+        unsigned char difference = 0;
+        for (size_t i = 0; i < token.size(); ++i)
+            difference |= static_cast<unsigned char>(value[i] ^ token[i]);
+        return difference == 0;
+    }
+
+    static void pinThread(std::thread::native_handle_type thread, size_t index)
+    {
+#ifdef __linux__
+        unsigned int cpuCount = std::thread::hardware_concurrency();
+        if (!cpuCount) return;
+
+        cpu_set_t cpuSet;
+        CPU_ZERO(&cpuSet);
+        CPU_SET(index % cpuCount, &cpuSet);
+        pthread_setaffinity_np(thread, sizeof(cpuSet), &cpuSet);
+#endif
+    }
+
+    Server::Server(const std::shared_ptr<spdlog::logger>& l,
+                   boost::asio::io_service& s,
+                   const boost::asio::ip::tcp::endpoint& endpoint,
+                   const Config& c):
+        logger(l),
+        config(c),
+        history(config),
+        admission(config),
+        expiryTimer(s),
+        signals(s, SIGINT, SIGTERM)
     {
-        acceptor.async_accept(socket,
-                            [this](boost::system::error_code error)
+        size_t threadCount = config.threads ? config.threads : 1;
+
+        shards.push_back(std::unique_ptr<Shard>(new Shard(logger, s, *this, 0)));
+
+        // the other shards would fail the same way
+        if (!shards.front()->getRing()) config.ioBackend = Config::IoBackend::ASIO;
+
+        for (size_t i = 1; i < threadCount; ++i)
+        {
+            ioServices.push_back(std::unique_ptr<boost::asio::io_service>(new boost::asio::io_service(1)));
+            shards.push_back(std::unique_ptr<Shard>(new Shard(logger, *ioServices.back(), *this, i)));
+        }
+
+        if (config.handoffPath.empty() || !takeOver())
+        {
+#ifdef SO_REUSEPORT
+            for (const auto& shard : shards)
+                shard->listen(endpoint, threadCount > 1);
+#else
+            handOff = threadCount > 1;
+            shards.front()->listen(endpoint, false);
+#endif
+        }
+
+        if (!config.handoffPath.empty()) listenForHandoff(s);
+        if (config.resumeTimeout) scheduleSessionExpiry();
+
+        if (!config.metricsFile.empty() || config.adminPort)
+            metricsExporter.reset(new MetricsExporter(logger, s, *this));
+
+        if (config.peerPort || !config.peers.empty())
+        {
+            federationService.reset(new boost::asio::io_service(1));
+            federation.reset(new Federation(logger, *federationService, *this));
+        }
+
+        logger->info("Server started (port: {0}, threads: {1}, io: {2})", endpoint.port(), threadCount,
+                     config.ioBackend == Config::IoBackend::IO_URING ? "io_uring" : "asio");
+
+        // the first shard runs on the thread that runs the given io_service
+        if (config.pinThreads) pinThread(pthread_self(), 0);
+
+        for (size_t i = 1; i < threadCount; ++i)
+        {
+            boost::asio::io_service& ioService = shards[i]->getIoService();
+
+            threads.push_back(std::thread([this, &ioService]()
+            {
+                try
+                {
+                    ioService.run();
+                }
+                catch (const std::exception& e)
+                {
+                    logger->error("{0}", e.what());
+                }
+            }));
+
+            if (config.pinThreads) pinThread(threads.back().native_handle(), i);
+        }
+
+        if (federation)
+        {
+            threads.push_back(std::thread([this]()
+            {
+                try
+                {
+                    federationService->run();
+                }
+                catch (const std::exception& e)
+                {
+                    logger->error("{0}", e.what());
+                }
+            }));
+        }
+
+        signals.async_wait([this](const boost::system::error_code& error,
+                                int signalNumber)
         {
             if (!error)
             {
-                clients.insert(std::unique_ptr<Client>(new Client(logger, ioService, *this, std::move(socket))));
+                logger->info("Received signal {0}", signalNumber);
+                close();
+            }
+        });
+    }
+
+    Server::~Server()
+    {
+        if (metricsExporter) shards.front()->getIoService().post([this]() { metricsExporter->close(); });
+        if (federation) federationService->post([this]() { federation->close(); });
 
-                accept();
+        for (const auto& shard : shards)
+            shard->getIoService().post([&shard]() { shard->close(); });
+
+        for (auto& thread : threads)
+            thread.join();
+    }
+
+    void Server::close()
+    {
+        if (handoffAcceptor) handoffAcceptor->close();
+        expiryTimer.cancel();
+        if (metricsExporter) metricsExporter->close();
+        if (federation) federationService->post([this]() { federation->close(); });
+
+        for (const auto& shard : shards)
+            shard->getIoService().post([&shard]() { shard->close(); });
+    }
+
+    bool Server::takeOver()
+    {
+        int fd = HandoffChannel::connect(config.handoffPath);
+        if (fd == -1) return false;
+
+        logger->info("Taking over from the running server");
+
+        HandoffChannel channel(fd);
+        size_t listeners = 0;
+        size_t clients = 0;
+
+        // nothing is adopted before the end record, the running process takes everything back if the
+        // handoff fails, so this one must not keep any of it
+        std::vector<HandoffRecord> records;
+        try
+        {
+            HandoffRecord record;
+            bool ended = false;
+            while (channel.receive(record))
+            {
+                if (record.kind == HandoffRecord::Kind::END)
+                {
+                    ended = true;
+                    break;
+                }
+
+                records.push_back(record);
             }
+
+            if (!ended) throw std::runtime_error("Handoff channel closed");
+
+            // the running process keeps the sockets until it knows they arrived
+            channel.send(HandoffRecord());
+        }
+        catch (const std::exception& e)
+        {
+            for (const HandoffRecord& received : records)
+                if (received.fd != -1) ::close(received.fd);
+
+            throw std::runtime_error(std::string("Takeover failed: ") + e.what());
+        }
+
+        // the shards do not run yet, so the sockets are adopted from this thread
+        for (const HandoffRecord& record : records)
+        {
+            if (record.kind == HandoffRecord::Kind::LISTENER)
+                shards[listeners++ % shards.size()]->adoptListener(record.fd);
+            else if (record.kind == HandoffRecord::Kind::CLIENT)
+                shards[clients++ % shards.size()]->adoptClient(record);
+            else if (record.fd != -1)
+                ::close(record.fd);
+        }
+
+        // without a listening socket each, the shards that have one pass the connections on
+        handOff = listeners < shards.size();
+
+        logger->info("Took over {0} listening sockets and {1} clients", listeners, clients);
+        return listeners != 0;
+    }
+
+    void Server::listenForHandoff(boost::asio::io_service& ioService)
+    {
+        // a path left by a process that is gone (or that was just taken over) is replaced
+        ::unlink(config.handoffPath.c_str());
+
+        handoffAcceptor.reset(new boost::asio::local::stream_protocol::acceptor(ioService));
+        handoffAcceptor->open();
+        handoffAcceptor->bind(boost::asio::local::stream_protocol::endpoint(config.handoffPath));
+        ::chmod(config.handoffPath.c_str(), S_IRUSR | S_IWUSR);
+        handoffAcceptor->listen();
+
+        acceptHandoff(ioService);
+    }
+
+    void Server::acceptHandoff(boost::asio::io_service& ioService)
+    {
+        std::shared_ptr<boost::asio::local::stream_protocol::socket> socket =
+            std::make_shared<boost::asio::local::stream_protocol::socket>(ioService);
+
+        handoffAcceptor->async_accept(*socket, [this, socket, &ioService](boost::system::error_code error)
+        {
+            if (error) return;
+
+            boost::system::error_code ignored;
+            if (!isSameUser(socket->native_handle()))
+            {
+                logger->error("Handoff refused to a process of another user");
+                socket->close(ignored);
+                acceptHandoff(ioService);
+                return;
+            }
+
+            handOver(socket->release(ignored));
         });
     }
 
-    void Server::removeClient(Client& client)
+    void Server::handOver(int fd)
+    {
+        logger->info("Handing over to a new server");
+
+        // the path now belongs to the new process, so it is not unlinked
+        handoffAcceptor->close();
+
+        std::shared_ptr<HandoffChannel> channel = std::make_shared<HandoffChannel>(fd);
+
+        struct Handoff
+        {
+            std::shared_ptr<std::vector<std::vector<HandoffRecord>>> records;
+            std::atomic<size_t> pending;
+        };
+
+        std::shared_ptr<Handoff> handoff = std::make_shared<Handoff>();
+        handoff->records = std::make_shared<std::vector<std::vector<HandoffRecord>>>(shards.size());
+        handoff->pending = shards.size();
+
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(config.handoffTimeout);
+
+        // every shard gives its sockets up on its thread, the last one hands them to the first shard
+        for (size_t i = 0; i < shards.size(); ++i)
+        {
+            Shard& shard = *shards[i];
+            Shard& firstShard = *shards.front();
+
+            shard.getIoService().post([this, channel, handoff, deadline, &shard, &firstShard, i]()
+            {
+                shard.handOff(deadline, [this, channel, handoff, &firstShard, i](std::vector<HandoffRecord> records)
+                {
+                    (*handoff->records)[i] = std::move(records);
+
+                    if (--handoff->pending == 0)
+                    {
+                        firstShard.getIoService().post([this, channel, handoff]()
+                        {
+                            if (!sendHandoff(*channel, *handoff->records))
+                            {
+                                cancelHandoff(handoff->records);
+                                return;
+                            }
+
+                            endHandoff(channel, handoff->records);
+                        });
+                    }
+                });
+            });
+        }
+    }
+
+    bool Server::sendHandoff(HandoffChannel& channel, const std::vector<std::vector<HandoffRecord>>& records)
     {
-        for (auto i = clients.begin(); i != clients.end(); ++i)
+        try
+        {
+            // the new process must be able to accept before it adopts the clients
+            for (HandoffRecord::Kind kind : {HandoffRecord::Kind::LISTENER, HandoffRecord::Kind::CLIENT})
+                for (const std::vector<HandoffRecord>& shardRecords : records)
+                    for (const HandoffRecord& record : shardRecords)
+                        if (record.kind == kind) channel.send(record);
+        }
+        catch (const std::exception& e)
         {
-            if (i->get() == &client)
+            logger->error("Handoff failed: {0}", e.what());
+            return false;
+        }
+
+        return true;
+    }
+
+    void Server::endHandoff(const std::shared_ptr<HandoffChannel>& channel,
+                            const std::shared_ptr<std::vector<std::vector<HandoffRecord>>>& records)
+    {
+        // the new process starts its own exporter and peer links once the takeover ends, so the admin and
+        // peer ports are let go before the end record, and the peers learn the nicknames again from it
+        if (metricsExporter) metricsExporter->close();
+
+        std::function<void()> end = [this, channel, records]()
+        {
+            // the new process answers the end record with its own once it has everything, until then the
+            // sockets are still this process's
+            try
             {
-                clients.erase(i);
-                break;
+                channel->send(HandoffRecord());
+
+                HandoffRecord reply;
+                if (!channel->receive(reply) || reply.kind != HandoffRecord::Kind::END)
+                    throw std::runtime_error("The new server did not confirm the takeover");
             }
+            catch (const std::exception& e)
+            {
+                logger->error("Handoff failed: {0}", e.what());
+                restartServices();
+                cancelHandoff(records);
+                return;
+            }
+
+            // the new process has its own descriptors now
+            size_t listeners = 0;
+            size_t clients = 0;
+            for (const std::vector<HandoffRecord>& shardRecords : *records)
+                for (const HandoffRecord& record : shardRecords)
+                {
+                    if (record.kind == HandoffRecord::Kind::LISTENER)
+                        ++listeners;
+                    else
+                        ++clients;
+
+                    ::close(record.fd);
+                }
+
+            logger->info("Handed over {0} listening sockets and {1} clients", listeners, clients);
+
+            // nothing keeps the process running once the shards are closed
+            signals.cancel();
+            close();
+        };
+
+        if (federation)
+        {
+            federationService->post([this, end]()
+            {
+                // the event loop keeps running, the links are started again if the handoff fails
+                federation->stop();
+                shards.front()->getIoService().post(end);
+            });
         }
+        else
+            end();
     }
 
-    bool Server::isNicknameAvailable(const std::string& nickname) const
+    void Server::restartServices()
     {
-        for (const auto& client : clients)
+        // the admin and peer ports were let go for the new process, which did not take them
+        if (metricsExporter)
         {
-            if (client->isLoggedIn() && client->getNickname() == nickname)
-                return false;
+            try
+            {
+                metricsExporter->start();
+            }
+            catch (const std::exception& e)
+            {
+                logger->error("Failed to restart the metrics exporter: {0}", e.what());
+            }
         }
 
+        if (federation)
+        {
+            federationService->post([this]()
+            {
+                try
+                {
+                    federation->start();
+                }
+                catch (const std::exception& e)
+                {
+                    logger->error("Failed to restart the federation: {0}", e.what());
+                }
+            });
+        }
+    }
+
+    void Server::cancelHandoff(const std::shared_ptr<std::vector<std::vector<HandoffRecord>>>& records)
+    {
+        logger->warn("Resuming after the failed handoff");
+
+        // the clients given up were removed, which released their nicknames on the peers
+        std::shared_ptr<std::atomic<size_t>> pending = std::make_shared<std::atomic<size_t>>(shards.size());
+
+        for (size_t i = 0; i < shards.size(); ++i)
+        {
+            Shard& shard = *shards[i];
+            shard.getIoService().post([this, &shard, records, pending, i]()
+            {
+                shard.cancelHandoff((*records)[i]);
+                if (--*pending == 0 && federation) federation->claimLocalNicknames();
+            });
+        }
+
+        listenForHandoff(shards.front()->getIoService());
+    }
+
+    bool Server::claimNickname(const std::string& nickname, const Session& session, bool* parked)
+    {
+        SessionStripe& stripe = getSessionStripe(nickname);
+        std::lock_guard<std::mutex> lock(stripe.mutex);
+
+        if (parked) *parked = false;
+
+        auto i = stripe.sessions.find(nickname);
+        if (i == stripe.sessions.end())
+        {
+            stripe.sessions.insert(std::make_pair(nickname, session));
+            return true;
+        }
+
+        if (session.peer || !stripe.parkedSessions.erase(nickname)) return false;
+
+        i->second = session;
+        if (parked) *parked = true;
+        return true;
+    }
+
+    void Server::releaseNickname(const std::string& nickname)
+    {
+        {
+            SessionStripe& stripe = getSessionStripe(nickname);
+            std::lock_guard<std::mutex> lock(stripe.mutex);
+            stripe.sessions.erase(nickname);
+        }
+
+        if (federation) federation->releaseNickname(nickname);
+    }
+
+    bool Server::findSession(const std::string& nickname, Session& session)
+    {
+        SessionStripe& stripe = getSessionStripe(nickname);
+        std::lock_guard<std::mutex> lock(stripe.mutex);
+
+        auto i = stripe.sessions.find(nickname);
+        if (i == stripe.sessions.end() || stripe.parkedSessions.count(nickname)) return false;
+
+        session = i->second;
+        return true;
+    }
+
+    std::string Server::createResumeToken()
+    {
+        uint64_t words[2];
+        fillRandom(words, sizeof(words));
+
+        char token[33];
+        std::snprintf(token, sizeof(token), "%016llx%016llx",
+                      static_cast<unsigned long long>(words[0]), static_cast<unsigned long long>(words[1]));
+        return token;
+    }
+
+    bool Server::resumeSession(const std::string& nickname, const std::string& token, const Session& session,
+                               Session& previous, std::vector<std::string>& channels)
+    {
+        SessionStripe& stripe = getSessionStripe(nickname);
+        std::lock_guard<std::mutex> lock(stripe.mutex);
+
+        auto i = stripe.sessions.find(nickname);
+        if (token.empty() || i == stripe.sessions.end() || i->second.peer || !isSameToken(token, i->second.token)) return false;
+
+        previous = i->second;
+
+        auto parked = stripe.parkedSessions.find(nickname);
+        if (parked != stripe.parkedSessions.end())
+        {
+            channels.swap(parked->second.channels);
+            stripe.parkedSessions.erase(parked);
+        }
+
+        i->second = session;
         return true;
     }
 
-    void Server::broadcastMessage(const Message& message)
+    void Server::parkSession(const std::string& nickname, const Session& session, std::vector<std::string> channels)
+    {
+        SessionStripe& stripe = getSessionStripe(nickname);
+        std::lock_guard<std::mutex> lock(stripe.mutex);
+
+        auto i = stripe.sessions.find(nickname);
+        if (i == stripe.sessions.end() || i->second.peer || i->second.shard != session.shard || !(i->second.handle == session.handle))
+            return;
+
+        i->second.handle = SlotHandle();
+
+        ParkedSession& parked = stripe.parkedSessions[nickname];
+        parked.channels.swap(channels);
+        parked.expiry = std::chrono::steady_clock::now() + std::chrono::milliseconds(config.resumeTimeout);
+    }
+
+    void Server::scheduleSessionExpiry()
+    {
+        expiryTimer.expires_from_now(boost::posix_time::milliseconds(SESSION_EXPIRY_INTERVAL));
+        expiryTimer.async_wait([this](const boost::system::error_code& error)
+        {
+            if (!error) // not boost::asio::error::operation_aborted
+            {
+                expireSessions();
+                scheduleSessionExpiry();
+            }
+        });
+    }
+
+    void Server::expireSessions()
+    {
+        std::vector<std::string> expired;
+        auto now = std::chrono::steady_clock::now();
+
+        for (SessionStripe& stripe : sessionStripes)
+        {
+            std::lock_guard<std::mutex> lock(stripe.mutex);
+
+            for (auto i = stripe.parkedSessions.begin(); i != stripe.parkedSessions.end(); )
+            {
+                if (i->second.expiry <= now)
+                {
+                    stripe.sessions.erase(i->first);
+                    expired.push_back(i->first);
+                    i = stripe.parkedSessions.erase(i);
+                }
+                else
+                    ++i;
+            }
+        }
+
+        if (federation)
+            for (const std::string& nickname : expired)
+                federation->releaseNickname(nickname);
+    }
+
+    void Server::releasePeerNickname(const std::string& nickname, uint64_t peer)
+    {
+        SessionStripe& stripe = getSessionStripe(nickname);
+        std::lock_guard<std::mutex> lock(stripe.mutex);
+
+        // the nickname may have been claimed by another server since
+        auto i = stripe.sessions.find(nickname);
+        if (i != stripe.sessions.end() && i->second.peer == peer) stripe.sessions.erase(i);
+    }
+
+    void Server::releasePeerNicknames(uint64_t peer)
+    {
+        for (SessionStripe& stripe : sessionStripes)
+        {
+            std::lock_guard<std::mutex> lock(stripe.mutex);
+
+            for (auto i = stripe.sessions.begin(); i != stripe.sessions.end(); )
+            {
+                if (i->second.peer == peer)
+                    i = stripe.sessions.erase(i);
+                else
+                    ++i;
+            }
+        }
+    }
+
+    std::vector<std::string> Server::getLocalNicknames()
+    {
+        std::vector<std::string> nicknames;
+        for (SessionStripe& stripe : sessionStripes)
+        {
+            std::lock_guard<std::mutex> lock(stripe.mutex);
+
+            for (const auto& session : stripe.sessions)
+                if (!session.second.peer) nicknames.push_back(session.first);
+        }
+
+        return nicknames;
+    }
+
+    Shard& Server::selectShard(Shard& acceptingShard)
+    {
+        if (!handOff) return acceptingShard;
+
+        return *shards[nextShard++ % shards.size()];
+    }
+
+    void Server::collectMetrics(std::function<void(const std::vector<Metrics>&)> callback)
+    {
+        struct Collection
+        {
+            std::vector<Metrics> metrics;
+            std::atomic<size_t> pending;
+            std::function<void(const std::vector<Metrics>&)> callback;
+        };
+
+        std::shared_ptr<Collection> collection = std::make_shared<Collection>();
+        collection->metrics.resize(shards.size());
+        collection->pending = shards.size();
+        collection->callback = std::move(callback);
+
+        // every shard copies its own metrics on its thread, the last one hands them back to the first shard
+        for (size_t i = 0; i < shards.size(); ++i)
+        {
+            Shard& shard = *shards[i];
+            Shard& firstShard = *shards.front();
+
+            shard.getIoService().post([collection, &shard, &firstShard, i]()
+            {
+                shard.collectMetrics(collection->metrics[i]);
+
+                if (--collection->pending == 0)
+                    firstShard.getIoService().post([collection]() { collection->callback(collection->metrics); });
+            });
+        }
+    }
+
+    void Server::broadcastFrame(const FramePtr& frame, const std::string& channel, Shard& origin)
     {
-        for (const auto& client : clients)
+        for (const auto& shard : shards)
+        {
+            if (shard.get() == &origin)
+                shard->sendFrame(frame, channel);
+            else
+                shard->postFrame(frame, channel);
+        }
+
+        if (federation)
         {
-            if (client->isLoggedIn()) client->sendMessage(message);
+            federation->relayFrame(frame);
+            ++origin.getMetrics().relays;
+        }
+    }
+
+    void Server::deliverFrame(const FramePtr& frame, const std::string& channel)
+    {
+        for (const auto& shard : shards)
+            shard->postFrame(frame, channel);
+    }
+
+    std::vector<std::string> Server::sendDirectFrame(const FramePtr& frame, const std::vector<std::string>& recipients, Shard* origin,
+                                                     std::vector<std::string>& unreachable)
+    {
+        std::vector<std::string> offline;
+        std::vector<std::vector<SlotHandle>> clients(shards.size());
+        std::vector<uint64_t> links;
+
+        // every recipient holds the lock of its own stripe only for its lookup, so a long list does not
+        // keep the logins waiting
+        for (const std::string& recipient : recipients)
+        {
+            SessionStripe& stripe = getSessionStripe(recipient);
+            std::lock_guard<std::mutex> lock(stripe.mutex);
+
+            auto i = stripe.sessions.find(recipient);
+            if (i == stripe.sessions.end() || stripe.parkedSessions.count(recipient))
+                offline.push_back(recipient);
+            else if (!i->second.peer)
+            {
+                // the clients in the original layout close the connection on the message
+                if (i->second.channelFields)
+                    clients[i->second.shard].push_back(i->second.handle);
+                else
+                    unreachable.push_back(recipient);
+            }
+            else if (origin && std::find(links.begin(), links.end(), i->second.peer) == links.end())
+                links.push_back(i->second.peer);
         }
+
+        for (size_t i = 0; i < shards.size(); ++i)
+        {
+            if (clients[i].empty()) continue;
+
+            if (shards[i].get() == origin)
+                origin->sendFrame(frame, clients[i]);
+            else
+                shards[i]->postFrame(frame, std::move(clients[i]));
+        }
+
+        // every peer with a recipient gets the frame once, and finds its own clients in it
+        if (federation && !links.empty())
+        {
+            federation->relayFrame(frame, std::move(links));
+            ++origin->getMetrics().relays;
+        }
+
+        return offline;
+    }
+
+    std::vector<std::string> Server::getRecipients(const MessageView& message)
+    {
+        std::vector<std::string> recipients;
+
+        // a direct message has exactly one recipient
+        if (message.type == Message::Type::DIRECT && message.recipients.size() != 1) return recipients;
+
+        for (const boost::string_ref& recipient : message.recipients)
+        {
+            // invalid as a whole, like a nickname that could not log in
+            if (recipient.empty()) return std::vector<std::string>();
+            recipients.push_back(recipient.to_string());
+        }
+
+        // a recipient named twice gets the message once
+        std::sort(recipients.begin(), recipients.end());
+        recipients.erase(std::unique(recipients.begin(), recipients.end()), recipients.end());
+        return recipients;
     }
 }
@@ -4,61 +4,166 @@
 
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <functional>
 #include <memory>
-#include <set>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 #include <boost/asio.hpp>
 #include "cereal/cereal.hpp"
 #include "spdlog/spdlog.h"
+#include "Admission.hpp"
+#include "Config.hpp"
+#include "Federation.hpp"
+#include "Frame.hpp"
+#include "Handoff.hpp"
+#include "History.hpp"
 #include "Message.hpp"
+#include "Metrics.hpp"
+#include "MetricsExporter.hpp"
+#include "Shard.hpp"
 
 namespace chat
 {
-    class Client;
-
     class Server final
     {
     public:
         Server(const std::shared_ptr<spdlog::logger>& l,
             boost::asio::io_service& s,
-            const boost::asio::ip::tcp::endpoint& endpoint):
-            logger(l),
-            ioService(s),
-            acceptor(s, endpoint),
-            socket(s),
-            signals(s, SIGINT, SIGTERM)
+            const boost::asio::ip::tcp::endpoint& endpoint,
+            const Config& c);
+        ~Server();
+
+        inline const Config& getConfig() const
+        {
+            return config;
+        }
+
+        inline History& getHistory()
         {
-            logger->info("Server started (port: {0})", endpoint.port());
-            accept();
-
-            signals.async_wait([this](const boost::system::error_code& error,
-                                    int signalNumber)
-            {
-                if (!error)
-                {
-                    logger->info("Received signal {0}", signalNumber);
-                    close();
-                }
-            });
+            return history;
         }
 
-        void removeClient(Client& client);
-        bool isNicknameAvailable(const std::string& nickname) const;
-        void broadcastMessage(const Message& message);
+        inline Admission& getAdmission()
+        {
+            return admission;
+        }
 
-    private:
-        void accept();
-        void close()
+        // null unless the server is linked to peers
+        inline Federation* getFederation()
         {
-            acceptor.cancel();
-            clients.clear();
+            return federation.get();
         }
 
+        // a client of this server may take over the nickname of a parked session (parked is set then),
+        // which stays claimed on the peers
+        bool claimNickname(const std::string& nickname, const Session& session, bool* parked = nullptr);
+        void releaseNickname(const std::string& nickname);
+        // the session of a connected client, parked sessions are not found
+        bool findSession(const std::string& nickname, Session& session);
+
+        // session resume
+        std::string createResumeToken();
+        // give the session with the token to the resuming client, previous is its last connection (without a
+        // handle if it was parked) and channels the channels of the parked session
+        bool resumeSession(const std::string& nickname, const std::string& token, const Session& session,
+                           Session& previous, std::vector<std::string>& channels);
+        // keep the session of the dropped client for a resume, unless another connection has resumed it already
+        void parkSession(const std::string& nickname, const Session& session, std::vector<std::string> channels);
+
+        Shard& getShard(size_t index)
+        {
+            return *shards[index];
+        }
+
+        // nicknames claimed through a peer link, released when the link drops
+        void releasePeerNickname(const std::string& nickname, uint64_t peer);
+        void releasePeerNicknames(uint64_t peer);
+        std::vector<std::string> getLocalNicknames();
+
+        Shard& selectShard(Shard& acceptingShard);
+        // send the frame to the clients on all the shards and relay it to the peers
+        void broadcastFrame(const FramePtr& frame, const std::string& channel, Shard& origin);
+        // send a frame relayed by a peer to the clients on all the shards
+        void deliverFrame(const FramePtr& frame, const std::string& channel);
+        // send the frame to the clients with the nicknames, on this server or a peer (only on this server if the
+        // frame came from a peer, without an origin), returns the nicknames that are not online and adds the
+        // clients of this server that can not decode the frame (without the channels feature) to unreachable
+        std::vector<std::string> sendDirectFrame(const FramePtr& frame, const std::vector<std::string>& recipients, Shard* origin,
+                                                 std::vector<std::string>& unreachable);
+        // the distinct nicknames a direct or multicast message is addressed to
+        static std::vector<std::string> getRecipients(const MessageView& message);
+
+        // take a snapshot of the metrics of every shard, the callback runs on the first shard's thread
+        void collectMetrics(std::function<void(const std::vector<Metrics>&)> callback);
+
+    private:
+        void close();
+
+        // hot restart: adopt the sockets of the running process, returns false if none runs
+        bool takeOver();
+        void listenForHandoff(boost::asio::io_service& ioService);
+        void acceptHandoff(boost::asio::io_service& ioService);
+        void handOver(int fd);
+        // returns false if the new process did not get all the records
+        bool sendHandoff(HandoffChannel& channel, const std::vector<std::vector<HandoffRecord>>& records);
+        // let the new process start and close this one
+        void endHandoff(const std::shared_ptr<HandoffChannel>& channel,
+                        const std::shared_ptr<std::vector<std::vector<HandoffRecord>>>& records);
+        // open the admin and peer ports again after the new process failed to confirm the takeover
+        void restartServices();
+        // the shards take back what they gave up and the next process can try again
+        void cancelHandoff(const std::shared_ptr<std::vector<std::vector<HandoffRecord>>>& records);
+
+        void scheduleSessionExpiry();
+        // release the nicknames of the parked sessions that were not resumed in time
+        void expireSessions();
+
         std::shared_ptr<spdlog::logger> logger;
-        boost::asio::io_service& ioService;
-        boost::asio::ip::tcp::acceptor acceptor;
-        boost::asio::ip::tcp::socket socket;
-        std::set<std::unique_ptr<Client>> clients;
+        Config config;
+        History history;
+        Admission admission; // shared by the shards
+
+        // peer links, on their own thread (declared before the shards, whose clients release their nicknames through it)
+        std::unique_ptr<boost::asio::io_service> federationService;
+        std::unique_ptr<Federation> federation;
+
+        std::vector<std::unique_ptr<boost::asio::io_service>> ioServices;
+        std::vector<std::unique_ptr<Shard>> shards;
+        std::vector<std::thread> threads;
+        bool handOff = false;
+        std::atomic<size_t> nextShard{0};
+        std::unique_ptr<MetricsExporter> metricsExporter;
+        std::unique_ptr<boost::asio::local::stream_protocol::acceptor> handoffAcceptor;
+
+        struct ParkedSession
+        {
+            std::vector<std::string> channels;
+            std::chrono::steady_clock::time_point expiry;
+        };
+
+        // the nickname index is spread over stripes with their own locks, so the logins and the direct
+        // messages of different nicknames do not wait for each other
+        struct SessionStripe
+        {
+            std::mutex mutex;
+            std::unordered_map<std::string, Session> sessions; // the logged in clients
+            std::unordered_map<std::string, ParkedSession> parkedSessions;
+        };
+
+        SessionStripe& getSessionStripe(const std::string& nickname)
+        {
+            return sessionStripes[std::hash<std::string>()(nickname) % SESSION_STRIPES];
+        }
+
+        static const size_t SESSION_STRIPES = 64; // locks the nickname index is spread over
+        SessionStripe sessionStripes[SESSION_STRIPES];
+
+        boost::asio::deadline_timer expiryTimer;
 
         boost::asio::signal_set signals;
     };
@@ -0,0 +1,856 @@
+//
+//  Chat server
+//
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#ifdef CHAT_IO_URING
+#include <cerrno>
+#include <netinet/in.h>
+#endif
+#include "Shard.hpp"
+#include "Admission.hpp"
+#include "IoRing.hpp"
+#include "Server.hpp"
+#include "Client.hpp"
+
+namespace chat
+{
+#ifdef CHAT_IO_URING
+    static const unsigned RING_ENTRIES = 1024; // submissions of an event loop turn, more are submitted early
+#endif
+    static const size_t SPARE_BUFFERS = 256; // receive buffers kept for reuse, the rest are freed
+    static const size_t SPARE_OUTPUTS = 256; // send queues kept for reuse
+    static const long HANDOFF_POLL_INTERVAL = 5; // milliseconds between the checks for clients still busy
+
+    static boost::asio::ip::tcp getProtocol(int fd)
+    {
+        sockaddr_storage address;
+        socklen_t size = sizeof(address);
+        if (::getsockname(fd, reinterpret_cast<sockaddr*>(&address), &size) == 0 && address.ss_family == AF_INET6)
+            return boost::asio::ip::tcp::v6();
+
+        return boost::asio::ip::tcp::v4();
+    }
+
+    // the ring's operations on a non-blocking socket fail instead of waiting
+    static void setBlocking(int fd)
+    {
+        int flags = ::fcntl(fd, F_GETFL);
+        if (flags != -1 && (flags & O_NONBLOCK)) ::fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+    }
+
+    Shard::Shard(const std::shared_ptr<spdlog::logger>& l,
+                 boost::asio::io_service& s,
+                 Server& serv,
+                 size_t i):
+        logger(l),
+        ioService(s),
+        work(new boost::asio::io_service::work(s)),
+        server(serv),
+        index(i),
+        timingWheel(s, std::chrono::milliseconds(serv.getConfig().timerTick)),
+        spareBuffers(SPARE_BUFFERS),
+        spareOutputs(SPARE_OUTPUTS),
+        loginTimer(s),
+        flushTimer(s),
+        batchTimer(s),
+        handoffTimer(s)
+    {
+        const Config& config = serv.getConfig();
+
+        if (config.ioBackend == Config::IoBackend::IO_URING)
+        {
+#ifdef CHAT_IO_URING
+            try
+            {
+                ring.reset(new IoRing(s, RING_ENTRIES, static_cast<unsigned>(config.ringBuffers),
+                                      [this](uint64_t userData, int result, uint32_t flags, const char* buffer)
+                {
+                    handleCompletion(userData, result, flags, buffer);
+                }));
+            }
+            catch (const std::exception& e)
+            {
+                logger->warn("io_uring unavailable, falling back to asio: {0}", e.what());
+            }
+#else
+            logger->warn("Built without io_uring, falling back to asio");
+#endif
+        }
+    }
+
+    Shard::~Shard()
+    {
+    }
+
+    void Shard::listen(const boost::asio::ip::tcp::endpoint& endpoint, bool reusePort)
+    {
+#ifdef CHAT_IO_URING
+        if (ring)
+        {
+            // a plain socket of the endpoint's family, the ring accepts on it
+            int listenFd = ::socket(endpoint.protocol().family(), endpoint.protocol().type() | SOCK_CLOEXEC,
+                                    endpoint.protocol().protocol());
+            if (listenFd < 0) throw boost::system::system_error(errno, boost::system::system_category(), "socket");
+
+            int enable = 1;
+            ::setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+            if (reusePort) ::setsockopt(listenFd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable));
+
+            const char* failed = nullptr;
+            if (::bind(listenFd, endpoint.data(), static_cast<socklen_t>(endpoint.size())) < 0)
+                failed = "bind";
+            else if (::listen(listenFd, SOMAXCONN) < 0)
+                failed = "listen";
+
+            if (failed)
+            {
+                int error = errno;
+                ::close(listenFd);
+                throw boost::system::system_error(error, boost::system::system_category(), failed);
+            }
+
+            acceptRing(listenFd);
+            return;
+        }
+#endif
+
+        std::unique_ptr<boost::asio::ip::tcp::acceptor> acceptor(new boost::asio::ip::tcp::acceptor(ioService));
+        acceptor->open(endpoint.protocol());
+        acceptor->set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
+#ifdef SO_REUSEPORT
+        // every shard gets its own listening socket and the kernel balances the connections between them
+        if (reusePort)
+            acceptor->set_option(boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true));
+#endif
+        acceptor->bind(endpoint);
+        acceptor->listen();
+
+        acceptors.push_back(std::move(acceptor));
+        accept(*acceptors.back());
+    }
+
+    void Shard::adoptListener(int fd)
+    {
+#ifdef CHAT_IO_URING
+        if (ring)
+        {
+            setBlocking(fd);
+            acceptRing(fd);
+            return;
+        }
+#endif
+
+        acceptors.push_back(std::unique_ptr<boost::asio::ip::tcp::acceptor>(
+            new boost::asio::ip::tcp::acceptor(ioService, getProtocol(fd), fd)));
+        accept(*acceptors.back());
+    }
+
+    void Shard::adoptClient(const HandoffRecord& record)
+    {
+        ObjectPool<Client>::Pointer pointer;
+        if (getRing())
+        {
+            setBlocking(record.fd);
+            pointer = clientPool.create(logger, ioService, server, *this,
+                                        boost::asio::ip::tcp::socket(ioService), getRing(), record.fd);
+        }
+        else
+            pointer = clientPool.create(logger, ioService, server, *this,
+                                        boost::asio::ip::tcp::socket(ioService, getProtocol(record.fd), record.fd));
+
+        Client* client = pointer.get();
+        client->setHandle(clients.insert(std::move(pointer)));
+        ++metrics.connectionsAdopted;
+
+        client->resume(record.state);
+    }
+
+    void Shard::handOff(std::chrono::steady_clock::time_point deadline,
+                        std::function<void(std::vector<HandoffRecord>)> callback)
+    {
+        handoffDeadline = deadline;
+        handoffCallback = std::move(callback);
+
+        // the listening sockets go first, the connections accepted until then are handed over as clients
+        for (auto& acceptor : acceptors)
+        {
+            if (!acceptor->is_open()) continue;
+
+            HandoffRecord record;
+            record.kind = HandoffRecord::Kind::LISTENER;
+
+            boost::system::error_code error;
+            record.fd = acceptor->release(error);
+            if (!error) handoffRecords.push_back(record);
+        }
+#ifdef CHAT_IO_URING
+        for (size_t i = 0; i < listenFds.size(); ++i)
+        {
+            if (listenFds[i] == -1) continue;
+
+            SlotHandle listener;
+            listener.index = static_cast<uint32_t>(i);
+            listener.generation = 0;
+            ring->cancel(getRingUserData(listener, RingOperation::ACCEPT), getRingUserData(SlotHandle(), RingOperation::CANCEL));
+
+            // not shut down like on close, the socket lives on in the other process
+            HandoffRecord record;
+            record.kind = HandoffRecord::Kind::LISTENER;
+            record.fd = listenFds[i];
+            handoffRecords.push_back(record);
+            listenFds[i] = -1;
+        }
+#endif
+
+        clients.forEach([](ObjectPool<Client>::Pointer& client) {
+            client->pauseForHandoff();
+        });
+
+        completeHandoff();
+    }
+
+    void Shard::cancelHandoff(const std::vector<HandoffRecord>& records)
+    {
+        // the clients still busy at the deadline were kept, paused
+        clients.forEach([](ObjectPool<Client>::Pointer& client) {
+            client->cancelHandoff();
+        });
+
+        for (const HandoffRecord& record : records)
+        {
+            if (record.kind == HandoffRecord::Kind::LISTENER)
+                adoptListener(record.fd);
+            else if (record.kind == HandoffRecord::Kind::CLIENT)
+                adoptClient(record);
+        }
+    }
+
+    void Shard::completeHandoff()
+    {
+        bool busy = false;
+        clients.forEach([&busy](ObjectPool<Client>::Pointer& client) {
+            if (client->isOpen() && !client->isReadyForHandoff()) busy = true;
+        });
+
+        // the writes in flight and the queued frames go out before the sockets change hands
+        if (busy && std::chrono::steady_clock::now() < handoffDeadline)
+        {
+            handoffTimer.expires_from_now(boost::posix_time::milliseconds(HANDOFF_POLL_INTERVAL));
+            handoffTimer.async_wait([this](const boost::system::error_code& error)
+            {
+                if (!error) // not boost::asio::error::operation_aborted
+                    completeHandoff();
+            });
+            return;
+        }
+
+        size_t dropped = 0;
+        clients.forEach([this, &dropped](ObjectPool<Client>::Pointer& client) {
+            if (!client->isOpen()) return;
+
+            if (client->isReadyForHandoff())
+                handoffRecords.push_back(client->handOff());
+            else
+                ++dropped;
+        });
+
+        if (dropped) logger->warn("{0} clients still busy at the handoff timeout are dropped", dropped);
+
+        std::vector<HandoffRecord> records;
+        records.swap(handoffRecords);
+        handoffCallback(std::move(records));
+    }
+
+    void Shard::acceptRing(int fd)
+    {
+#ifdef CHAT_IO_URING
+        // a single submission keeps accepting until it fails, its user data tells the listening sockets apart
+        SlotHandle listener;
+        listener.index = static_cast<uint32_t>(listenFds.size());
+        listener.generation = 0;
+
+        listenFds.push_back(fd);
+        ring->accept(fd, getRingUserData(listener, RingOperation::ACCEPT));
+#else
+        (void)fd;
+#endif
+    }
+
+    void Shard::accept(boost::asio::ip::tcp::acceptor& acceptor)
+    {
+        // hand the connection off to the next shard if this is the only listening one
+        Shard& target = server.selectShard(*this);
+        std::shared_ptr<boost::asio::ip::tcp::socket> socket = std::make_shared<boost::asio::ip::tcp::socket>(target.getIoService());
+
+        boost::asio::ip::tcp::acceptor* listener = &acceptor;
+        acceptor.async_accept(*socket,
+                              [this, listener, &target, socket](boost::system::error_code error)
+        {
+            if (!error)
+            {
+                if (admitConnection(*socket))
+                {
+                    if (&target == this)
+                        addClient(std::move(*socket));
+                    else
+                        target.getIoService().post([&target, socket]() { target.addClient(std::move(*socket)); });
+                }
+
+                accept(*listener);
+            }
+        });
+    }
+
+    bool Shard::admitConnection(boost::asio::ip::tcp::socket& socket)
+    {
+        boost::system::error_code ignored;
+        boost::asio::ip::address address;
+        if (server.getAdmission().isLimitingSources(Admission::Kind::CONNECTION))
+            address = socket.remote_endpoint(ignored).address();
+
+        uint64_t retryAfter = getConnectionWait(address);
+        if (!retryAfter) return true;
+
+        // nothing was sent on the new socket yet, so a non-blocking send takes the whole reply
+        Frame reply(createBusyReply(retryAfter));
+        socket.non_blocking(true, ignored);
+        socket.send(boost::asio::buffer(reply.getData(), reply.getSize()), 0, ignored);
+        socket.close(ignored);
+        return false;
+    }
+
+    bool Shard::admitConnection(int fd)
+    {
+#ifdef CHAT_IO_URING
+        boost::asio::ip::tcp::endpoint endpoint;
+        if (server.getAdmission().isLimitingSources(Admission::Kind::CONNECTION))
+        {
+            socklen_t size = static_cast<socklen_t>(endpoint.capacity());
+            if (::getpeername(fd, endpoint.data(), &size) == 0) endpoint.resize(size);
+        }
+
+        uint64_t retryAfter = getConnectionWait(endpoint.address());
+        if (!retryAfter) return true;
+
+        Frame reply(createBusyReply(retryAfter));
+        ::send(fd, reply.getData(), reply.getSize(), MSG_DONTWAIT | MSG_NOSIGNAL);
+        ::close(fd);
+        return false;
+#else
+        (void)fd;
+        return true;
+#endif
+    }
+
+    uint64_t Shard::getConnectionWait(const boost::asio::ip::address& address)
+    {
+        Admission& admission = server.getAdmission();
+
+        uint64_t wait = admission.admitSource(Admission::Kind::CONNECTION, address);
+        if (!wait) wait = admission.admit(Admission::Kind::CONNECTION);
+        if (!wait) return 0;
+
+        ++metrics.connectionsRejected;
+        return admission.getRetryAfter(wait);
+    }
+
+    void Shard::addClient(boost::asio::ip::tcp::socket socket)
+    {
+        ObjectPool<Client>::Pointer pointer = clientPool.create(logger, ioService, server, *this, std::move(socket));
+        Client* client = pointer.get();
+        client->setHandle(clients.insert(std::move(pointer)));
+        ++metrics.connectionsAccepted;
+
+        client->start();
+    }
+
+    void Shard::addClient(int fd)
+    {
+        ObjectPool<Client>::Pointer pointer = clientPool.create(logger, ioService, server, *this,
+                                                                boost::asio::ip::tcp::socket(ioService), getRing(), fd);
+        Client* client = pointer.get();
+        client->setHandle(clients.insert(std::move(pointer)));
+        ++metrics.connectionsAccepted;
+
+        client->start();
+    }
+
+    void Shard::handleCompletion(uint64_t userData, int result, uint32_t flags, const char* buffer)
+    {
+#ifdef CHAT_IO_URING
+        RingOperation operation = static_cast<RingOperation>(userData & 0xFF);
+
+        if (operation == RingOperation::ACCEPT)
+        {
+            if (result < 0) return; // like the acceptor, stop accepting on errors (or once cancelled)
+
+            if (admitConnection(result)) addClient(result);
+
+            // the kernel ends a multishot accept when it can not go on
+            size_t listener = static_cast<size_t>(userData >> 40);
+            if (!(flags & IORING_CQE_F_MORE) && listener < listenFds.size() && listenFds[listener] != -1)
+                ring->accept(listenFds[listener], userData);
+            return;
+        }
+
+        SlotHandle handle;
+        handle.index = static_cast<uint32_t>(userData >> 40);
+        handle.generation = static_cast<uint32_t>(userData >> 8);
+
+        if (Client* client = getClient(handle))
+            client->handleRingCompletion(operation, result, flags, buffer);
+#endif
+    }
+
+    void Shard::removeClient(SlotHandle handle)
+    {
+        Client* client = getClient(handle);
+        if (!client) return;
+
+        client->park();
+
+        while (!client->getMemberships().empty())
+            removeMember(*client, *client->getMemberships().back().channel);
+
+        if (client->isLoggedIn())
+        {
+            // move the last logged in client into the removed client's place
+            size_t index = client->getLoggedInIndex();
+            loggedInClients[index] = loggedInClients.back();
+            loggedInClients[index]->setLoggedInIndex(index);
+            loggedInClients.pop_back();
+        }
+
+        clients.erase(handle);
+        ++metrics.connectionsClosed;
+    }
+
+    Client* Shard::getClient(SlotHandle handle)
+    {
+        ObjectPool<Client>::Pointer* client = clients.get(handle);
+        return client ? client->get() : nullptr;
+    }
+
+    void Shard::addLoggedInClient(Client& client)
+    {
+        client.setLoggedInIndex(loggedInClients.size());
+        loggedInClients.push_back(&client);
+    }
+
+    LoginAdmission Shard::admitLogin(Client& client, uint64_t& retryAfter)
+    {
+        const Config& config = server.getConfig();
+        Admission& admission = server.getAdmission();
+
+        // a source over its own rate is turned away, whatever the others do
+        uint64_t wait = 0;
+        if (admission.isLimitingSources(Admission::Kind::LOGIN))
+            wait = admission.admitSource(Admission::Kind::LOGIN, client.getAddress());
+
+        if (wait)
+        {
+            ++metrics.loginsRejected;
+            retryAfter = admission.getRetryAfter(wait);
+            return LoginAdmission::REJECTED;
+        }
+
+        // the logins queued before go first
+        if (pendingLogins.empty())
+        {
+            wait = admission.admit(Admission::Kind::LOGIN);
+            if (!wait) return LoginAdmission::ADMITTED;
+        }
+
+        if (pendingLogins.size() >= config.pendingLogins)
+        {
+            // about the time the queues of all the shards take to drain at the login rate
+            ++metrics.loginsRejected;
+            size_t shardCount = std::max(config.threads, static_cast<size_t>(1));
+            retryAfter = admission.getRetryAfter(pendingLogins.size() * shardCount * 1000 / config.loginRate + 1);
+            return LoginAdmission::REJECTED;
+        }
+
+        ++metrics.loginsQueued;
+        pendingLogins.push_back(client.getHandle());
+        if (!loginsScheduled) scheduleLogins(wait);
+
+        return LoginAdmission::QUEUED;
+    }
+
+    Message Shard::createBusyReply(uint64_t retryAfter)
+    {
+        Message reply;
+        reply.type = Message::Type::LOGIN;
+        reply.body = "Server busy, retry in " + std::to_string(retryAfter) + " ms";
+        reply.timestamp = retryAfter;
+        return reply;
+    }
+
+    void Shard::scheduleLogins(uint64_t wait)
+    {
+        loginsScheduled = true;
+        loginTimer.expires_from_now(boost::posix_time::milliseconds(static_cast<int64_t>(std::max(wait, static_cast<uint64_t>(1)))));
+        loginTimer.async_wait([this](const boost::system::error_code& error)
+        {
+            if (!error) // not boost::asio::error::operation_aborted
+                resumeLogins();
+        });
+    }
+
+    void Shard::resumeLogins()
+    {
+        loginsScheduled = false;
+
+        while (!pendingLogins.empty())
+        {
+            // the clients that disconnected while waiting are skipped
+            Client* client = getClient(pendingLogins.front());
+            if (!client || !client->isOpen())
+            {
+                pendingLogins.pop_front();
+                continue;
+            }
+
+            uint64_t wait = server.getAdmission().admit(Admission::Kind::LOGIN);
+            if (wait)
+            {
+                scheduleLogins(wait);
+                return;
+            }
+
+            pendingLogins.pop_front();
+            client->resumeLogin();
+        }
+    }
+
+    bool Shard::joinChannel(Client& client, const std::string& name)
+    {
+        auto i = channels.find(name);
+        if (i == channels.end())
+        {
+            i = channels.insert(std::make_pair(name, Channel<Client>(name))).first;
+            server.getHistory().openChannel(name);
+        }
+
+        Channel<Client>& channel = i->second;
+        if (client.getMembershipIndex(channel)) return false;
+
+        client.addMembership(channel, channel.add(&client));
+        return true;
+    }
+
+    bool Shard::partChannel(Client& client, const std::string& name)
+    {
+        auto i = channels.find(name);
+        if (i == channels.end() || !client.getMembershipIndex(i->second)) return false;
+
+        removeMember(client, i->second);
+        return true;
+    }
+
+    void Shard::removeMember(Client& client, Channel<Client>& channel)
+    {
+        size_t index = *client.getMembershipIndex(channel);
+
+        if (Client* moved = channel.remove(index))
+            *moved->getMembershipIndex(channel) = index;
+
+        client.removeMembership(channel);
+
+        if (channel.isEmpty())
+        {
+            server.getHistory().closeChannel(channel.getName());
+            channels.erase(channels.find(channel.getName()));
+        }
+    }
+
+    void Shard::broadcastMessage(const Message& message)
+    {
+        ScopedTimer timer(metrics.broadcastTime, metrics.timing);
+        ++metrics.messagesBroadcast;
+
+        // encode the message once and share the frame between all the recipients on all the shards,
+        // text messages are stamped and stored for replay
+        FramePtr frame = (message.type == Message::Type::TEXT) ?
+            server.getHistory().record(message) :
+            std::make_shared<const Frame>(message);
+
+        if (server.getConfig().batchWindow)
+            addToBatch(frame, message.channel);
+        else
+            server.broadcastFrame(frame, message.channel, *this);
+    }
+
+    void Shard::broadcastMessage(const MessageView& message)
+    {
+        ScopedTimer timer(metrics.broadcastTime, metrics.timing);
+        ++metrics.messagesBroadcast;
+
+        // the bytes are copied once from the receive buffer into the shared frame
+        server.broadcastFrame(std::make_shared<const Frame>(message), message.channel.to_string(), *this);
+    }
+
+    std::vector<std::string> Shard::sendDirectMessage(const Message& message, const std::vector<std::string>& recipients,
+                                                      std::vector<std::string>& unreachable)
+    {
+        ScopedTimer timer(metrics.broadcastTime, metrics.timing);
+        ++metrics.directMessages;
+
+        // encoded once for all the recipients, which are looked up by nickname instead of visiting every client
+        std::vector<std::string> offline = server.sendDirectFrame(std::make_shared<const Frame>(message), recipients, this, unreachable);
+        metrics.undeliveredRecipients += offline.size() + unreachable.size();
+        return offline;
+    }
+
+    void Shard::addToBatch(const FramePtr& frame, const std::string& channel)
+    {
+        const Config& config = server.getConfig();
+        Batch& batch = batches[channel];
+
+        // a batch must fit in a frame the clients accept
+        size_t entrySize = sizeof(uint64_t) + frame->getPayloadSize();
+        if (!batch.frames.empty() && batch.payloadSize + entrySize > config.maxFrameSize)
+            flushBatch(channel);
+
+        batch.frames.push_back(frame);
+        batch.payloadSize += entrySize;
+
+        if (batch.frames.size() >= config.batchSize)
+        {
+            flushBatch(channel);
+            return;
+        }
+
+        // the window bounds the latency the batching adds
+        if (!batchScheduled)
+        {
+            batchScheduled = true;
+            batchTimer.expires_from_now(boost::posix_time::microseconds(config.batchWindow));
+            batchTimer.async_wait([this](const boost::system::error_code& error)
+            {
+                if (!error) // not boost::asio::error::operation_aborted
+                    flushBatches();
+            });
+        }
+    }
+
+    void Shard::flushBatch(const std::string& channel)
+    {
+        auto i = batches.find(channel);
+        if (i == batches.end() || i->second.frames.empty()) return;
+
+        std::vector<FramePtr> frames;
+        frames.swap(i->second.frames);
+        i->second.payloadSize = 0;
+
+        if (frames.size() == 1)
+        {
+            server.broadcastFrame(frames.front(), channel, *this);
+            return;
+        }
+
+        ++metrics.batches;
+        metrics.messagesBatched += frames.size();
+
+        // encoded once for all the recipients, the ones without the batch feature get the frames in it
+        server.broadcastFrame(std::make_shared<const Frame>(std::move(frames)), channel, *this);
+    }
+
+    void Shard::flushBatches()
+    {
+        batchScheduled = false;
+
+        for (auto& batch : batches)
+            flushBatch(batch.first);
+
+        batches.clear();
+    }
+
+    void Shard::sendFrame(const FramePtr& frame, const std::string& channel)
+    {
+        if (channel.empty())
+        {
+            for (Client* client : loggedInClients)
+                client->sendFrame(frame);
+        }
+        else
+        {
+            auto i = channels.find(channel);
+            if (i == channels.end()) return;
+
+            for (Client* client : i->second.getMembers())
+                client->sendFrame(frame);
+        }
+    }
+
+    void Shard::postFrame(const FramePtr& frame, const std::string& channel)
+    {
+        deliveries.push(Delivery{frame, channel, std::vector<SlotHandle>()});
+
+        // wake the shard up only if it is not already going to process the queue
+        if (!processingScheduled.exchange(true))
+            ioService.post([this]() { processFrames(); });
+    }
+
+    void Shard::sendFrame(const FramePtr& frame, const std::vector<SlotHandle>& handles)
+    {
+        // the handles are checked, a client may have been removed since its session was looked up
+        for (SlotHandle handle : handles)
+        {
+            Client* client = getClient(handle);
+            if (client && client->isLoggedIn()) client->sendFrame(frame);
+        }
+    }
+
+    void Shard::postFrame(const FramePtr& frame, std::vector<SlotHandle> handles)
+    {
+        deliveries.push(Delivery{frame, std::string(), std::move(handles)});
+
+        // wake the shard up only if it is not already going to process the queue
+        if (!processingScheduled.exchange(true))
+            ioService.post([this]() { processFrames(); });
+    }
+
+    void Shard::processFrames()
+    {
+        processingScheduled.store(false);
+
+        Delivery delivery;
+        while (deliveries.pop(delivery))
+        {
+            if (delivery.clients.empty())
+                sendFrame(delivery.frame, delivery.channel);
+            else
+                sendFrame(delivery.frame, delivery.clients);
+            ++metrics.deliveries;
+        }
+    }
+
+    void Shard::scheduleWrite(SlotHandle handle)
+    {
+        pendingWrites.push_back(handle);
+
+        if (flushScheduled) return;
+        flushScheduled = true;
+
+        size_t coalesceWindow = server.getConfig().coalesceWindow;
+
+        if (coalesceWindow)
+        {
+            flushTimer.expires_from_now(boost::posix_time::microseconds(coalesceWindow));
+            flushTimer.async_wait([this](const boost::system::error_code& error)
+            {
+                if (!error) // not boost::asio::error::operation_aborted
+                    flushWrites();
+            });
+        }
+        else
+            ioService.post([this]() { flushWrites(); });
+    }
+
+    void Shard::flushWrites()
+    {
+        flushScheduled = false;
+
+        // clients can schedule writes again while flushing, so flush a separate list
+        flushingWrites.swap(pendingWrites);
+
+        for (SlotHandle handle : flushingWrites)
+        {
+            if (Client* client = getClient(handle))
+                client->flush();
+        }
+
+        flushingWrites.clear();
+    }
+
+    std::vector<char> Shard::acquireBuffer()
+    {
+        return spareBuffers.acquire();
+    }
+
+    void Shard::releaseBuffer(std::vector<char> buffer)
+    {
+        spareBuffers.release(std::move(buffer));
+    }
+
+    std::unique_ptr<ClientOutput> Shard::acquireOutput()
+    {
+        std::unique_ptr<ClientOutput> output = spareOutputs.acquire();
+        if (!output) output.reset(new ClientOutput());
+        return output;
+    }
+
+    void Shard::releaseOutput(std::unique_ptr<ClientOutput> output)
+    {
+        output->clear();
+        spareOutputs.release(std::move(output));
+    }
+
+    void Shard::collectMetrics(Metrics& snapshot)
+    {
+        snapshot = metrics;
+        snapshot.connections = clients.size();
+        snapshot.loggedInClients = loggedInClients.size();
+        snapshot.channels = channels.size();
+        snapshot.pendingLogins = pendingLogins.size();
+        snapshot.sendQueueBytes = 0;
+        snapshot.idleConnections = 0;
+        snapshot.idleConnectionMemory = 0;
+
+        // the pool's free blocks and the spares count too, they are held for the connections
+        snapshot.connectionMemory = clientPool.getReservedSize() - clients.size() * sizeof(Client);
+        spareBuffers.forEach([&snapshot](const std::vector<char>& buffer) {
+            snapshot.connectionMemory += buffer.capacity();
+        });
+        spareOutputs.forEach([&snapshot](const std::unique_ptr<ClientOutput>& output) {
+            snapshot.connectionMemory += output->getMemoryUsage();
+        });
+
+        clients.forEach([&snapshot](ObjectPool<Client>::Pointer& client) {
+            size_t memory = client->getMemoryUsage();
+
+            snapshot.sendQueueBytes += client->getOutputQueueSize();
+            snapshot.connectionMemory += memory;
+
+            if (client->isIdle())
+            {
+                ++snapshot.idleConnections;
+                snapshot.idleConnectionMemory += memory;
+            }
+        });
+    }
+
+    void Shard::close()
+    {
+        // the ones handed over are closed already
+        boost::system::error_code ignored;
+        for (auto& acceptor : acceptors) acceptor->cancel(ignored);
+#ifdef CHAT_IO_URING
+        // wakes the pending accept up, closing alone does not
+        for (int& listenFd : listenFds)
+        {
+            if (listenFd == -1) continue;
+
+            ::shutdown(listenFd, SHUT_RDWR);
+            ::close(listenFd);
+            listenFd = -1;
+        }
+#endif
+        loggedInClients.clear();
+        channels.clear();
+        clients.clear();
+        timingWheel.stop();
+        loginTimer.cancel();
+        handoffTimer.cancel();
+        flushTimer.cancel();
+        batchTimer.cancel();
+#ifdef CHAT_IO_URING
+        if (ring) ring->close();
+#endif
+        work.reset();
+    }
+}
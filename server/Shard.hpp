@@ -0,0 +1,248 @@
+//
+//  Chat server
+//
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <boost/asio.hpp>
+#include "spdlog/spdlog.h"
+#include "Channel.hpp"
+#include "Frame.hpp"
+#include "Handoff.hpp"
+#include "Message.hpp"
+#include "Metrics.hpp"
+#include "Pool.hpp"
+#include "Queue.hpp"
+#include "SlotMap.hpp"
+#include "TimingWheel.hpp"
+
+namespace chat
+{
+    class Client;
+    struct ClientOutput;
+    class IoRing;
+    class Server;
+
+    // Identifies a client across all the shards, or the peer server it is logged in on. The session of a client
+    // whose connection dropped is parked for a while, without a handle, so the client can resume it.
+    struct Session
+    {
+        size_t shard;
+        SlotHandle handle;
+        uint64_t peer; // link to the client's server, 0 for the clients of this server
+        std::string token; // resume token of a client of this server, empty if it can not resume
+        bool channelFields; // the client of this server negotiated the channels feature, without it it can not take direct messages
+    };
+
+    // Frame on its way to the members of a channel on another shard, or to some of its clients
+    struct Delivery
+    {
+        FramePtr frame;
+        std::string channel; // empty for everyone
+        std::vector<SlotHandle> clients; // the frame is only for these clients if not empty
+    };
+
+    // Operation of a client the completion of an io_uring submission belongs to
+    enum class RingOperation: uint8_t
+    {
+        ACCEPT,
+        RECEIVE,
+        SEND,
+        CANCEL
+    };
+
+    // What becomes of a login asking for admission
+    enum class LoginAdmission
+    {
+        ADMITTED,
+        QUEUED, // waits for the login rate, the client is resumed once it is admitted
+        REJECTED // turned away with the milliseconds to wait before retrying
+    };
+
+    // One event loop with its own clients. Clients never leave the shard that accepted them,
+    // other shards reach them only through the shard's frame queue.
+    class Shard final
+    {
+    public:
+        Shard(const std::shared_ptr<spdlog::logger>& l,
+              boost::asio::io_service& s,
+              Server& serv,
+              size_t i);
+        ~Shard();
+
+        Shard(const Shard&) = delete;
+        Shard& operator=(const Shard&) = delete;
+
+        inline boost::asio::io_service& getIoService() const
+        {
+            return ioService;
+        }
+
+        inline size_t getIndex() const
+        {
+            return index;
+        }
+
+        inline TimingWheel& getTimingWheel()
+        {
+            return timingWheel;
+        }
+
+        inline Metrics& getMetrics()
+        {
+            return metrics;
+        }
+
+        // null unless the shard does its socket I/O through io_uring
+        inline IoRing* getRing() const
+        {
+#ifdef CHAT_IO_URING
+            return ring.get();
+#else
+            return nullptr;
+#endif
+        }
+
+        // identifies the client and the operation of an io_uring submission
+        static inline uint64_t getRingUserData(SlotHandle handle, RingOperation operation)
+        {
+            return static_cast<uint64_t>(handle.index & 0xFFFFFF) << 40 |
+                static_cast<uint64_t>(handle.generation) << 8 |
+                static_cast<uint64_t>(operation);
+        }
+
+        // copy the metrics and fill in the gauges (called from the shard's thread)
+        void collectMetrics(Metrics& snapshot);
+
+        void listen(const boost::asio::ip::tcp::endpoint& endpoint, bool reusePort);
+        void addClient(boost::asio::ip::tcp::socket socket);
+        void addClient(int fd);
+
+        // hot restart: take over a listening socket or a client of the previous process
+        void adoptListener(int fd);
+        void adoptClient(const HandoffRecord& record);
+        // stop accepting and reading, and give the listening sockets and the clients up once nothing is in
+        // flight (the clients still busy at the deadline are dropped), the callback runs on the shard's thread
+        void handOff(std::chrono::steady_clock::time_point deadline,
+                     std::function<void(std::vector<HandoffRecord>)> callback);
+        // the handoff failed, take the listening sockets and the clients given up back and read again
+        void cancelHandoff(const std::vector<HandoffRecord>& records);
+        void removeClient(SlotHandle handle);
+        Client* getClient(SlotHandle handle);
+
+        void addLoggedInClient(Client& client);
+
+        // admit the client's login now, queue it until it is within the login rate, or turn it away
+        LoginAdmission admitLogin(Client& client, uint64_t& retryAfter);
+        // the login reply of a client turned away by the admission control
+        static Message createBusyReply(uint64_t retryAfter);
+
+        bool joinChannel(Client& client, const std::string& name);
+        bool partChannel(Client& client, const std::string& name);
+
+        // send the message to the members of its channel (or to everyone) on all the shards
+        void broadcastMessage(const Message& message);
+        // relay the decoded message as it is, without recording it (chunks)
+        void broadcastMessage(const MessageView& message);
+        // send the message only to the clients with the nicknames, returns the ones that are not online and
+        // adds the ones without the channels feature to unreachable
+        std::vector<std::string> sendDirectMessage(const Message& message, const std::vector<std::string>& recipients,
+                                                   std::vector<std::string>& unreachable);
+
+        // send the frame to the channel members of this shard (called from the shard's thread)
+        void sendFrame(const FramePtr& frame, const std::string& channel);
+        // queue the frame for the channel members of this shard (can be called from any thread)
+        void postFrame(const FramePtr& frame, const std::string& channel);
+        // the same for some of the shard's clients, the ones that have gone meanwhile are skipped
+        void sendFrame(const FramePtr& frame, const std::vector<SlotHandle>& handles);
+        void postFrame(const FramePtr& frame, std::vector<SlotHandle> handles);
+
+        // write the client's queued frames at the end of the event loop turn or the coalescing window
+        void scheduleWrite(SlotHandle handle);
+
+        // receive buffers and send queues, lent to the clients only while they have bytes in flight
+        std::vector<char> acquireBuffer();
+        void releaseBuffer(std::vector<char> buffer);
+        std::unique_ptr<ClientOutput> acquireOutput();
+        void releaseOutput(std::unique_ptr<ClientOutput> output);
+
+        void close();
+
+    private:
+        void accept(boost::asio::ip::tcp::acceptor& acceptor);
+        void acceptRing(int fd);
+        void completeHandoff();
+        // turn the connection away before it becomes a client, unless it is within the accept rates
+        bool admitConnection(boost::asio::ip::tcp::socket& socket);
+        bool admitConnection(int fd);
+        // milliseconds the source has to wait before retrying, 0 if the connection is admitted
+        uint64_t getConnectionWait(const boost::asio::ip::address& address);
+        void scheduleLogins(uint64_t wait);
+        void resumeLogins();
+        void handleCompletion(uint64_t userData, int result, uint32_t flags, const char* buffer);
+        void processFrames();
+        void flushWrites();
+        void addToBatch(const FramePtr& frame, const std::string& channel);
+        void flushBatch(const std::string& channel);
+        void flushBatches();
+        void removeMember(Client& client, Channel<Client>& channel);
+
+        std::shared_ptr<spdlog::logger> logger;
+        boost::asio::io_service& ioService;
+        std::unique_ptr<boost::asio::io_service::work> work;
+        Server& server;
+        size_t index;
+
+        std::vector<std::unique_ptr<boost::asio::ip::tcp::acceptor>> acceptors;
+#ifdef CHAT_IO_URING
+        std::unique_ptr<IoRing> ring; // must outlive the clients, whose operations it completes
+        std::vector<int> listenFds; // indexed by the accept submission's user data, -1 once closed or handed over
+#endif
+        TimingWheel timingWheel; // must outlive the clients, whose timers are linked into it
+        ObjectPool<Client> clientPool; // must outlive the clients allocated from it
+        SlotMap<ObjectPool<Client>::Pointer> clients;
+        FreeList<std::vector<char>> spareBuffers;
+        FreeList<std::unique_ptr<ClientOutput>> spareOutputs;
+        std::vector<Client*> loggedInClients; // dense array of the logged in clients for broadcasting
+        std::unordered_map<std::string, Channel<Client>> channels; // channels with members on this shard
+
+        std::deque<SlotHandle> pendingLogins; // logins waiting for the login rate, oldest first
+        boost::asio::deadline_timer loginTimer;
+        bool loginsScheduled = false;
+
+        std::vector<SlotHandle> pendingWrites;
+        std::vector<SlotHandle> flushingWrites;
+        boost::asio::deadline_timer flushTimer;
+        bool flushScheduled = false;
+
+        // messages of a channel collected during the batch window
+        struct Batch
+        {
+            std::vector<FramePtr> frames;
+            size_t payloadSize = 0;
+        };
+
+        std::unordered_map<std::string, Batch> batches;
+        boost::asio::deadline_timer batchTimer;
+        bool batchScheduled = false;
+
+        // the listening sockets and the clients being handed over to the process taking over
+        std::vector<HandoffRecord> handoffRecords;
+        std::function<void(std::vector<HandoffRecord>)> handoffCallback;
+        std::chrono::steady_clock::time_point handoffDeadline;
+        boost::asio::deadline_timer handoffTimer;
+
+        Queue<Delivery> deliveries;
+        std::atomic<bool> processingScheduled{false};
+
+        Metrics metrics;
+    };
+}
@@ -0,0 +1,113 @@
+//
+//  Chat server
+//
+
+#pragma once
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace chat
+{
+    // Generational handle to a slot map element, stays invalid after the element is erased
+    // even if its slot is reused
+    struct SlotHandle
+    {
+        uint32_t index = UINT32_MAX;
+        uint32_t generation = 0;
+    };
+
+    inline bool operator==(const SlotHandle& a, const SlotHandle& b)
+    {
+        return a.index == b.index && a.generation == b.generation;
+    }
+
+    inline bool operator!=(const SlotHandle& a, const SlotHandle& b)
+    {
+        return !(a == b);
+    }
+
+    // Stores elements in a vector of slots and reuses the freed slots, so insertion, erasure
+    // and lookup by handle are all constant time
+    template <class T>
+    class SlotMap final
+    {
+    public:
+        SlotHandle insert(T value)
+        {
+            SlotHandle handle;
+
+            if (firstFree != UINT32_MAX)
+            {
+                handle.index = firstFree;
+                firstFree = slots[firstFree].nextFree;
+            }
+            else
+            {
+                handle.index = static_cast<uint32_t>(slots.size());
+                slots.push_back(Slot());
+            }
+
+            Slot& slot = slots[handle.index];
+            slot.value = std::move(value);
+            slot.occupied = true;
+            handle.generation = slot.generation;
+            ++count;
+
+            return handle;
+        }
+
+        bool erase(SlotHandle handle)
+        {
+            if (!get(handle)) return false;
+
+            Slot& slot = slots[handle.index];
+            slot.value = T();
+            slot.occupied = false;
+            ++slot.generation;
+            slot.nextFree = firstFree;
+            firstFree = handle.index;
+            --count;
+
+            return true;
+        }
+
+        T* get(SlotHandle handle)
+        {
+            if (handle.index >= slots.size()) return nullptr;
+
+            Slot& slot = slots[handle.index];
+            return (slot.occupied && slot.generation == handle.generation) ? &slot.value : nullptr;
+        }
+
+        template <class F>
+        void forEach(F f)
+        {
+            for (Slot& slot : slots)
+                if (slot.occupied) f(slot.value);
+        }
+
+        void clear()
+        {
+            slots.clear();
+            firstFree = UINT32_MAX;
+            count = 0;
+        }
+
+        inline size_t size() const { return count; }
+
+    private:
+        struct Slot
+        {
+            T value;
+            uint32_t generation = 0;
+            uint32_t nextFree = UINT32_MAX;
+            bool occupied = false;
+        };
+
+        std::vector<Slot> slots;
+        uint32_t firstFree = UINT32_MAX;
+        size_t count = 0;
+    };
+}
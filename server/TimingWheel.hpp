@@ -0,0 +1,183 @@
+//
+//  Chat server
+//
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/asio/deadline_timer.hpp>
+
+namespace chat
+{
+    // Hashed timing wheel shared by all the timers of a shard. Arming, re-arming and cancelling a timer
+    // only relinks it in an intrusive list, and a single deadline timer ticks the wheel.
+    class TimingWheel final
+    {
+        struct Link
+        {
+            Link* previous = this;
+            Link* next = this;
+
+            void unlink()
+            {
+                previous->next = next;
+                next->previous = previous;
+                previous = next = this;
+            }
+
+            void insertBefore(Link& link)
+            {
+                previous = link.previous;
+                next = &link;
+                link.previous->next = this;
+                link.previous = this;
+            }
+
+            bool isLinked() const { return next != this; }
+        };
+
+    public:
+        class Timer final: private Link
+        {
+            friend TimingWheel;
+        public:
+            explicit Timer(std::function<void()> cb): callback(std::move(cb)) {}
+            ~Timer() { unlink(); }
+
+            Timer(const Timer&) = delete;
+            Timer& operator=(const Timer&) = delete;
+
+            bool isArmed() const { return isLinked(); }
+            void cancel() { unlink(); }
+
+        private:
+            std::function<void()> callback;
+            uint64_t expiry = 0; // tick
+        };
+
+        TimingWheel(boost::asio::io_service& s,
+                    std::chrono::milliseconds tick,
+                    size_t slotCount = 512):
+            tickDuration(tick.count() > 0 ? tick : std::chrono::milliseconds(1)),
+            slots(slotCount),
+            timer(s),
+            start(std::chrono::steady_clock::now())
+        {
+        }
+
+        TimingWheel(const TimingWheel&) = delete;
+        TimingWheel& operator=(const TimingWheel&) = delete;
+
+        ~TimingWheel()
+        {
+            for (Link& slot : slots)
+                while (slot.isLinked()) slot.next->unlink();
+        }
+
+        // (re)arms the timer to fire after the given timeout, rounded up to the tick
+        void arm(Timer& t, std::chrono::milliseconds timeout)
+        {
+            // the wheel does not tick while there are no timers, so catch up with the clock first
+            if (!ticking && !processing) currentTick = getElapsedTicks();
+
+            uint64_t ticks = static_cast<uint64_t>((timeout + tickDuration - std::chrono::milliseconds(1)) / tickDuration);
+            t.expiry = currentTick + (ticks ? ticks : 1);
+
+            t.unlink();
+            t.insertBefore(slots[t.expiry % slots.size()]);
+
+            if (!ticking && !processing) scheduleTick();
+        }
+
+        void stop()
+        {
+            timer.cancel();
+            stopped = true;
+        }
+
+    private:
+        void scheduleTick()
+        {
+            if (stopped) return;
+
+            ticking = true;
+            timer.expires_at(boost::posix_time::microsec_clock::universal_time() +
+                             boost::posix_time::milliseconds(tickDuration.count()));
+            timer.async_wait([this](const boost::system::error_code& error)
+            {
+                if (!error) // not boost::asio::error::operation_aborted
+                {
+                    ticking = false;
+                    processTicks();
+                }
+            });
+        }
+
+        uint64_t getElapsedTicks() const
+        {
+            return static_cast<uint64_t>((std::chrono::steady_clock::now() - start) / tickDuration);
+        }
+
+        void processTicks()
+        {
+            // catch up with all the ticks missed while the event loop was busy
+            uint64_t targetTick = getElapsedTicks();
+            bool armed = false;
+            processing = true;
+
+            while (currentTick < targetTick)
+            {
+                ++currentTick;
+
+                // move the slot aside, so the callbacks can arm and cancel timers safely
+                Link& slot = slots[currentTick % slots.size()];
+                Link expired;
+                if (slot.isLinked())
+                {
+                    expired.next = slot.next;
+                    expired.previous = slot.previous;
+                    expired.next->previous = &expired;
+                    expired.previous->next = &expired;
+                    slot.previous = slot.next = &slot;
+                }
+
+                while (expired.isLinked())
+                {
+                    Timer& t = static_cast<Timer&>(*expired.next);
+                    t.unlink();
+
+                    if (t.expiry > currentTick) // not this round yet
+                        t.insertBefore(slots[t.expiry % slots.size()]);
+                    else
+                        t.callback();
+                }
+            }
+
+            processing = false;
+
+            for (const Link& slot : slots)
+            {
+                if (slot.isLinked())
+                {
+                    armed = true;
+                    break;
+                }
+            }
+
+            if (armed) scheduleTick();
+        }
+
+        std::chrono::milliseconds tickDuration;
+        std::vector<Link> slots;
+        boost::asio::deadline_timer timer;
+        std::chrono::steady_clock::time_point start;
+        uint64_t currentTick = 0;
+        bool ticking = false;
+        bool processing = false;
+        bool stopped = false;
+    };
+}
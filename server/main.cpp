@@ -2,10 +2,14 @@
 //  Chat server
 //
 
+#include <algorithm>
 #include <cstdlib>
+#include <fstream>
 #include <iostream>
+#include <stdexcept>
 #include <vector>
 #include "args.hxx"
+#include "Log.hpp"
 #include "Server.hpp"
 #include "Client.hpp"
 
@@ -13,8 +17,6 @@ int main(int argc, const char * argv[])
 {
     try
     {
-        auto console = spdlog::stdout_color_mt("console");
-
         args::ArgumentParser parser("A simple chat server.");
         args::HelpFlag help(parser, "help", "Display this help menu", {'h', "help"});
         args::ValueFlag<uint16_t> port(parser, "port", "Port number to listen to", {'p', "port"}, args::Options::Required);
@@ -30,6 +32,76 @@ int main(int argc, const char * argv[])
         };
 
         args::MapFlag<std::string, spdlog::level::level_enum> logLevel(parser, "level", "Log level", {'l', "level"}, map);
+        args::Flag logAsync(parser, "log-async", "Format and write the log on a background thread, dropping lines when it falls behind", {"log-async"});
+        args::ValueFlag<size_t> logQueueSize(parser, "lines", "Size of the async log queue (a power of two)", {"log-queue-size"}, 8192);
+
+        chat::Config config;
+
+        args::ValueFlag<size_t> threads(parser, "threads", "Number of event loop threads", {'t', "threads"}, config.threads);
+        args::Flag pinThreads(parser, "pin-threads", "Pin every event loop thread to its own CPU", {"pin-threads"});
+        args::ValueFlag<size_t> timerTick(parser, "milliseconds", "Resolution of the connection timeouts", {"timer-tick"}, config.timerTick);
+        args::ValueFlag<size_t> inactivityTimeout(parser, "milliseconds", "Time without traffic after which a client without heartbeats is disconnected, 0 to never", {"inactivity-timeout"}, config.inactivityTimeout);
+        args::ValueFlag<size_t> heartbeatInterval(parser, "milliseconds", "Heartbeat interval offered to the clients, 0 to not offer heartbeats", {"heartbeat"}, config.heartbeatInterval);
+
+        std::unordered_map<std::string, chat::Config::IoBackend> ioBackends {
+            {"asio", chat::Config::IoBackend::ASIO},
+            {"io_uring", chat::Config::IoBackend::IO_URING}
+        };
+
+        args::MapFlag<std::string, chat::Config::IoBackend> ioBackend(parser, "backend", "Socket I/O of the event loops (asio or io_uring)", {"io"}, ioBackends, config.ioBackend);
+        args::ValueFlag<size_t> ringBuffers(parser, "buffers", "Receive buffers shared by the connections of an event loop with io_uring", {"ring-buffers"}, config.ringBuffers);
+
+        args::ValueFlag<size_t> acceptRate(parser, "per-second", "Connections accepted per second, more are turned away, 0 for no limit", {"accept-rate"}, config.acceptRate);
+        args::ValueFlag<size_t> sourceAcceptRate(parser, "per-second", "Connections accepted per second from a single address, 0 for no limit", {"source-accept-rate"}, config.sourceAcceptRate);
+        args::ValueFlag<size_t> loginRate(parser, "per-second", "Logins per second, more wait in the pending login queue, 0 for no limit", {"login-rate"}, config.loginRate);
+        args::ValueFlag<size_t> sourceLoginRate(parser, "per-second", "Logins per second from a single address, more are turned away, 0 for no limit", {"source-login-rate"}, config.sourceLoginRate);
+        args::ValueFlag<size_t> admissionBurst(parser, "milliseconds", "Time worth of the accept and login rates admitted at once", {"admission-burst"}, config.admissionBurst);
+        args::ValueFlag<size_t> pendingLogins(parser, "logins", "Logins waiting for the login rate per event loop, more are turned away", {"pending-logins"}, config.pendingLogins);
+
+        std::unordered_map<std::string, chat::Config::SlowConsumerPolicy> slowConsumerPolicies {
+            {"drop-oldest", chat::Config::SlowConsumerPolicy::DROP_OLDEST},
+            {"drop-new", chat::Config::SlowConsumerPolicy::DROP_NEW},
+            {"disconnect", chat::Config::SlowConsumerPolicy::DISCONNECT}
+        };
+
+        args::ValueFlag<size_t> sendHighWatermark(parser, "bytes", "Send queue size above which the slow consumer policy applies", {"send-high-watermark"}, config.sendHighWatermark);
+        args::ValueFlag<size_t> sendLowWatermark(parser, "bytes", "Send queue size below which a client is no longer considered slow", {"send-low-watermark"}, config.sendLowWatermark);
+        args::ValueFlag<size_t> sendQueueLimit(parser, "bytes", "Send queue size at which a slow client is disconnected", {"send-queue-limit"}, config.sendQueueLimit);
+        args::ValueFlag<size_t> sendQueueAge(parser, "milliseconds", "Send queue age at which a slow client is disconnected", {"send-queue-age"}, config.sendQueueAge);
+        args::ValueFlag<size_t> coalesceWindow(parser, "microseconds", "Time to wait for more outgoing frames before writing them", {"coalesce-us"}, config.coalesceWindow);
+        args::ValueFlag<size_t> batchWindow(parser, "microseconds", "Time to collect a channel's messages into a single frame, 0 for no batching", {"batch-us"}, config.batchWindow);
+        args::ValueFlag<size_t> batchSize(parser, "messages", "Messages after which a batch is sent without waiting", {"batch-size"}, config.batchSize);
+        args::ValueFlag<size_t> maxRecipients(parser, "nicknames", "Nicknames a multicast message can be addressed to", {"max-recipients"}, config.maxRecipients);
+        args::MapFlag<std::string, chat::Config::SlowConsumerPolicy> slowConsumerPolicy(parser, "policy", "Slow consumer policy (drop-oldest, drop-new or disconnect)", {"slow-consumer"}, slowConsumerPolicies, config.slowConsumerPolicy);
+
+        args::ValueFlag<size_t> maxFrameSize(parser, "bytes", "Largest message of the clients with varint framing", {"max-frame-size"}, config.maxFrameSize);
+        args::ValueFlag<size_t> chunkQueueLimit(parser, "bytes", "Chunks queued for a client above which newer chunks are dropped", {"chunk-queue-limit"}, config.chunkQueueLimit);
+        args::ValueFlag<size_t> chunkRate(parser, "bytes", "Chunk bytes read from a client per second, 0 for no limit", {"chunk-rate"}, config.chunkRate);
+        args::ValueFlag<size_t> compressionThreshold(parser, "bytes", "Size from which messages are compressed for the clients that support it, 0 to never compress", {"compression-threshold"}, config.compressionThreshold);
+
+        args::ValueFlag<size_t> resumeTimeout(parser, "milliseconds", "Time a dropped client's session is kept for it to resume, 0 to never resume", {"resume-timeout"}, config.resumeTimeout);
+
+        args::ValueFlag<std::string> nodeName(parser, "name", "Name of the server in the cluster (the host name and port by default)", {"node-name"});
+        args::ValueFlag<uint16_t> peerPort(parser, "port", "Port to accept the links of the other servers on", {"peer-port"}, config.peerPort);
+        args::ValueFlag<std::string> peerAddress(parser, "address", "Address to accept the links of the other servers on", {"peer-address"}, config.peerAddress);
+        args::ValueFlag<std::string> peerSecretPath(parser, "path", "File with the secret the servers of the cluster share", {"peer-secret-file"});
+        args::ValueFlagList<std::string> peers(parser, "host:port", "Server to link to, repeat for several", {"peer"});
+        args::ValueFlag<size_t> peerQueueLimit(parser, "bytes", "Frames queued for a peer above which its link is dropped", {"peer-queue-limit"}, config.peerQueueLimit);
+        args::ValueFlag<size_t> peerReconnect(parser, "milliseconds", "Time between the attempts to link to a peer", {"peer-reconnect"}, config.peerReconnect);
+
+        args::ValueFlag<std::string> handoffPath(parser, "path", "Unix socket to take the clients over from a running server and to hand them to the next one", {"handoff"});
+        args::ValueFlag<size_t> handoffTimeout(parser, "milliseconds", "Time the writes in flight get to finish before the clients are handed over", {"handoff-timeout"}, config.handoffTimeout);
+
+        args::ValueFlag<size_t> historySize(parser, "messages", "Messages kept in memory per channel", {"history-size"}, config.historySize);
+        args::ValueFlag<size_t> historyReplay(parser, "messages", "Messages sent to a client on login and join", {"history-replay"}, config.historyReplay);
+        args::ValueFlag<size_t> historyLimit(parser, "messages", "Messages sent to a returning client since its last message", {"history-limit"}, config.historyLimit);
+        args::ValueFlag<std::string> logPath(parser, "path", "Append-only message log", {"log"});
+        args::ValueFlag<size_t> logCapacity(parser, "bytes", "Maximum size of the message log", {"log-capacity"}, config.logCapacity);
+        args::ValueFlag<size_t> logSyncInterval(parser, "milliseconds", "Time between the message log flushes to disk", {"log-sync"}, config.logSyncInterval);
+
+        args::ValueFlag<std::string> metricsFile(parser, "path", "File to periodically write the metrics to", {"metrics-file"});
+        args::ValueFlag<size_t> metricsInterval(parser, "milliseconds", "Time between the metrics file updates", {"metrics-interval"}, config.metricsInterval);
+        args::ValueFlag<uint16_t> adminPort(parser, "port", "Local port to serve the metrics on", {"admin-port"}, config.adminPort);
 
         try
         {
@@ -60,14 +132,68 @@ int main(int argc, const char * argv[])
             return EXIT_FAILURE;
         }
 
+        auto console = chat::createConsoleLogger("console", logAsync.Get(), logQueueSize.Get());
+
         try
         {
             console->set_level(logLevel.Get());
 
+            config.threads = threads.Get();
+            config.pinThreads = pinThreads.Get();
+            config.timerTick = timerTick.Get();
+            config.inactivityTimeout = inactivityTimeout.Get();
+            config.heartbeatInterval = heartbeatInterval.Get();
+            config.ioBackend = ioBackend.Get();
+            config.ringBuffers = ringBuffers.Get();
+            config.acceptRate = acceptRate.Get();
+            config.sourceAcceptRate = sourceAcceptRate.Get();
+            config.loginRate = loginRate.Get();
+            config.sourceLoginRate = sourceLoginRate.Get();
+            config.admissionBurst = admissionBurst.Get();
+            config.pendingLogins = pendingLogins.Get();
+            config.sendHighWatermark = sendHighWatermark.Get();
+            config.sendLowWatermark = sendLowWatermark.Get();
+            config.sendQueueLimit = sendQueueLimit.Get();
+            config.sendQueueAge = sendQueueAge.Get();
+            config.slowConsumerPolicy = slowConsumerPolicy.Get();
+            config.coalesceWindow = coalesceWindow.Get();
+            config.batchWindow = batchWindow.Get();
+            config.batchSize = std::max(batchSize.Get(), static_cast<size_t>(1));
+            config.maxRecipients = std::max(maxRecipients.Get(), static_cast<size_t>(1));
+            config.maxFrameSize = std::min(maxFrameSize.Get(), static_cast<size_t>(chat::Frame::MAX_PAYLOAD_SIZE));
+            config.chunkQueueLimit = chunkQueueLimit.Get();
+            config.chunkRate = chunkRate.Get();
+            config.compressionThreshold = compressionThreshold.Get();
+            config.resumeTimeout = resumeTimeout.Get();
+            config.nodeName = nodeName ? nodeName.Get() : boost::asio::ip::host_name() + ":" + std::to_string(port.Get());
+            config.peerPort = peerPort.Get();
+            config.peerAddress = peerAddress.Get();
+            if (peerSecretPath)
+            {
+                // a file keeps the secret out of the process list
+                std::ifstream file(peerSecretPath.Get());
+                if (!std::getline(file, config.peerSecret) || config.peerSecret.empty())
+                    throw std::runtime_error("Failed to read the peer secret from " + peerSecretPath.Get());
+            }
+            config.peers = peers.Get();
+            config.peerQueueLimit = peerQueueLimit.Get();
+            config.peerReconnect = peerReconnect.Get();
+            config.handoffPath = handoffPath.Get();
+            config.handoffTimeout = handoffTimeout.Get();
+            config.historySize = historySize.Get();
+            config.historyReplay = historyReplay.Get();
+            config.historyLimit = historyLimit.Get();
+            config.logPath = logPath.Get();
+            config.logCapacity = logCapacity.Get();
+            config.logSyncInterval = logSyncInterval.Get();
+            config.metricsFile = metricsFile.Get();
+            config.metricsInterval = metricsInterval.Get();
+            config.adminPort = adminPort.Get();
+
             boost::asio::io_service ioService;
             boost::asio::ip::tcp::endpoint endpoint(boost::asio::ip::tcp::v4(), port.Get());
 
-            chat::Server server(console, ioService, endpoint);
+            chat::Server server(console, ioService, endpoint, config);
 
             ioService.run();
         }
@@ -75,6 +201,8 @@ int main(int argc, const char * argv[])
         {
             console->error("{0}", e.what());
         }
+
+        chat::shutdownLogging();
     }
     catch (const spdlog::spdlog_ex& e)
     {